@@ -0,0 +1,144 @@
+#include <wup/wup.hpp>
+
+#include <set>
+#include <vector>
+#include <cstdlib>
+
+using namespace wup;
+
+// Accuracy and throughput of HashedKernelSpace with more and more tables,
+// compared to the exact EuclideanKernelSpace, on the libras dataset
+
+const int numKernels = 2048;
+const double activation = 0.01;
+const int termBits = 2;
+const int ramBits = 32;
+
+// Binary output of a canvas that read every feature of the sample
+template <typename KernelSpace>
+std::vector<int>
+encode(KernelCanvas<KernelSpace> & canvas, Sample & sample)
+{
+    canvas.clear();
+
+    for (auto & feature : sample)
+        canvas.read(feature.data());
+
+    return canvas.binary_output();
+}
+
+template <typename KernelSpace>
+double
+accuracy(KernelCanvas<KernelSpace> & canvas, Dataset & dataset,
+    const uint * const indexes, const int threshold)
+{
+    Wisard w(canvas.binary_output_size(), ramBits, dataset.classes());
+
+    for (int i=0;i!=threshold;++i)
+    {
+        Sample & sample = dataset[indexes[i]];
+        w.learn(encode(canvas, sample), sample.target());
+    }
+
+    int hits = 0;
+
+    for (int i=threshold;i!=int(dataset.size());++i)
+    {
+        Sample & sample = dataset[indexes[i]];
+        hits += w.readBleaching(encode(canvas, sample)) == sample.target();
+    }
+
+    return hits / double(dataset.size() - threshold);
+}
+
+template <typename KernelSpace>
+double
+selectTime(KernelSpace & space, const std::vector<double> & points, long & checksum)
+{
+    const uint dims = space.dims();
+    const uint numPoints = points.size() / dims;
+
+    Clock clock(false);
+
+    for (uint i=0;i!=numPoints;++i)
+        checksum += space.select(&points[i * dims])[0];
+
+    return clock.lap_micro(numPoints);
+}
+
+int
+main()
+{
+    srand(7);
+
+    Dataset dataset("../../datasets/libras");
+
+    const int length = dataset.size();
+    const int threshold = length * 0.9;
+    wup::random r;
+    const uint * const indexes = r.randperm(length);
+
+    // Kernels spread over the box of the features, every feature is a point
+    std::vector<double> points;
+    for (auto & sample : dataset)
+        for (auto & feature : sample)
+            points.insert(points.end(), feature.data(), feature.data() + feature.size());
+
+    const uint dims = dataset.numFeatures();
+    std::vector<double> lo(points.begin(), points.begin() + dims);
+    std::vector<double> hi(lo);
+
+    for (uint i=0;i!=points.size();++i)
+    {
+        lo[i % dims] = math::min(lo[i % dims], points[i]);
+        hi[i % dims] = math::max(hi[i % dims], points[i]);
+    }
+
+    Bundle<double> kernels(numKernels, dims);
+    for (uint i=0;i!=kernels.rows();++i)
+        for (uint j=0;j!=dims;++j)
+            kernels(i, j) = lo[j] + (hi[j] - lo[j]) * (rand() / double(RAND_MAX));
+
+    Bundle<double> copy(kernels);
+    KernelCanvas<EuclideanKernelSpace> exact(activation, termBits, copy);
+    EuclideanKernelSpace & reference = exact.kernelSpace();
+
+    long checksum = 0;
+    const double exactTime = selectTime(reference, points, checksum);
+
+    print("space: euclidean", "k:", reference.k(), "select(us):", exactTime,
+          "recall:", 1.0, "accuracy:", accuracy(exact, dataset, indexes, threshold));
+
+    for (uint numTables : {1u, 2u, 4u, 8u, 16u})
+    {
+        Bundle<double> copy(kernels);
+        KernelCanvas<HashedKernelSpace> hashed(activation, termBits, copy, numTables);
+
+        const double time = selectTime(hashed.kernelSpace(), points, checksum);
+
+        double recall = 0.0;
+        const uint numPoints = points.size() / dims;
+
+        for (uint i=0;i!=numPoints;++i)
+        {
+            const int * const expected = reference.select(&points[i * dims]);
+            std::set<int> nearest(expected, expected + reference.k());
+
+            const int * const selected = hashed.kernelSpace().select(&points[i * dims]);
+            for (uint j=0;j!=hashed.kernelSpace().k();++j)
+                recall += nearest.count(selected[j]);
+        }
+
+        recall /= double(numPoints) * reference.k();
+
+        print("space: hashed", "tables:", numTables, "select(us):", time,
+              "speedup:", exactTime / time, "recall:", recall,
+              "accuracy:", accuracy(hashed, dataset, indexes, threshold));
+    }
+
+    print("checksum:", checksum);
+
+    delete [] indexes;
+
+    return 0;
+}
@@ -0,0 +1,81 @@
+#include <wup/common/clock.hpp>
+#include <wup/common/msgs.hpp>
+#include <wup/models/kernelcanvas.hpp>
+
+#include <vector>
+#include <cstdlib>
+
+using namespace wup;
+
+// Benchmark of FloatEuclideanKernelSpace against EuclideanKernelSpace, for
+// select and selectMany, and how many of the float selections differ from
+// the double precision ones
+
+const int numKernels = 2048;
+const int numPatterns = 4096;
+
+template <typename Space, typename T>
+void
+measure(Space & space, const std::vector<T> & patterns, double & single,
+    double & batch)
+{
+    const uint dims = space.dims();
+    std::vector<int> selections(size_t(numPatterns) * space.k());
+    long checksum = 0;
+
+    Clock clock(false);
+
+    for (int i=0;i!=numPatterns;++i)
+        checksum += space.select(&patterns[size_t(i) * dims])[0];
+
+    single = clock.lap_micro(numPatterns);
+
+    space.selectMany(patterns.data(), numPatterns, selections.data());
+    batch = clock.lap_micro(numPatterns);
+
+    if (checksum == 0)
+        print("checksum:", checksum);
+}
+
+int
+main()
+{
+    srand(7);
+
+    for (uint dims : {2, 8, 32, 128}) {
+        Bundle<double> kernels(numKernels, dims);
+        for (auto & v : kernels)
+            v = rand() / double(RAND_MAX);
+
+        std::vector<double> patterns(size_t(numPatterns) * dims);
+        for (auto & v : patterns)
+            v = rand() / double(RAND_MAX);
+
+        const std::vector<float> floatPatterns(patterns.begin(), patterns.end());
+
+        FloatEuclideanKernelSpace single(0.05, kernels);
+        FloatEuclideanKernelSpace validated(0.05, kernels, true);
+        EuclideanKernelSpace reference(0.05, kernels);
+
+        double doubleSelect, doubleMany, floatSelect, floatMany;
+        measure(reference, patterns, doubleSelect, doubleMany);
+        measure(single, floatPatterns, floatSelect, floatMany);
+
+        for (int i=0;i!=numPatterns;++i)
+            validated.select(&patterns[size_t(i) * dims]);
+
+        const FloatEuclideanKernelSpace::Validation & v = validated.validation();
+
+        print("dims:", dims,
+              "select double(us):", doubleSelect, "float(us):", floatSelect,
+              "speedup:", doubleSelect / floatSelect);
+        print("dims:", dims,
+              "selectMany double(us):", doubleMany, "float(us):", floatMany,
+              "speedup:", doubleMany / floatMany);
+        print("dims:", dims,
+              "different selections:", v.mismatches, "/", v.selections,
+              "missed kernels:", v.missedKernels, "/", v.selections * validated.k());
+    }
+
+    return 0;
+}
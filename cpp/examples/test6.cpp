@@ -0,0 +1,93 @@
+#include <wup/common/clock.hpp>
+#include <wup/common/msgs.hpp>
+#include <wup/models/decoders/graydecoder.hpp>
+
+#include <vector>
+#include <cstdlib>
+
+using namespace wup;
+
+// Benchmark of GrayDecoder::read, compared to the previous implementation
+// that compared each pixel with every other one and hashed by relabeling
+
+const int numReads = 200000;
+
+size_t
+naiveRead(const std::vector<int> & retina, const std::vector<uint> & indexes,
+    std::vector<int> & ranks, std::vector<size_t> & factorials)
+{
+    const uint size = indexes.size();
+
+    for (uint i=0;i<size;++i) {
+        int n = 0;
+        const int current = retina[indexes[i]];
+
+        for (uint j=0;j<size;++j) {
+            const int visiting = retina[indexes[j]];
+
+            if ((current < visiting) || (current == visiting && i < j))
+                n += 1;
+        }
+
+        ranks[i] = n;
+    }
+
+    size_t h = 0;
+
+    for (uint n=size-1; n!=0; --n) {
+        h += ranks[n] * factorials[n];
+
+        for (int j=n-1; j!=-1; --j)
+            if (ranks[j] > ranks[n])
+                --ranks[j];
+    }
+
+    return h;
+}
+
+int
+main()
+{
+    srand(7);
+
+    const int numPixels = 1024;
+    std::vector<std::vector<int> > retinas(64, std::vector<int>(numPixels));
+
+    for (auto & retina : retinas)
+        for (auto & v : retina)
+            v = rand() % 256;
+
+    for (uint size : {8, 12, 16, 20, 24, 28, 32}) {
+        std::vector<uint> indexes(size);
+        for (auto & i : indexes)
+            i = rand() % numPixels;
+
+        std::vector<int> ranks(size);
+        std::vector<size_t> factorials(size, 1);
+        for (uint i=1;i<size;++i)
+            factorials[i] = i * factorials[i-1];
+
+        GrayDecoder decoder(indexes.data(), size);
+        size_t checksum1 = 0;
+        size_t checksum2 = 0;
+
+        Clock clock(false);
+
+        for (int k=0;k!=numReads;++k)
+            checksum1 += naiveRead(retinas[k % retinas.size()], indexes, ranks, factorials);
+
+        const double naive = clock.lap_nano(numReads);
+
+        for (int k=0;k!=numReads;++k) {
+            decoder.read(retinas[k % retinas.size()]);
+            checksum2 += decoder.hash();
+        }
+
+        const double current = clock.lap_nano(numReads);
+
+        print("inputs:", size, "naive(ns):", naive, "current(ns):", current,
+              "speedup:", naive / current, checksum1 == checksum2 ? "same" : "DIFFERENT");
+    }
+
+    return 0;
+}
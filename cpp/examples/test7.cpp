@@ -0,0 +1,81 @@
+#include <wup/common/clock.hpp>
+#include <wup/common/msgs.hpp>
+#include <wup/common/generic.hpp>
+#include <wup/models/kernelcanvas.hpp>
+
+#include <vector>
+#include <cstdlib>
+
+using namespace wup;
+
+// Benchmark of EuclideanKernelSpace::select at each instruction set,
+// compared to the previous implementation that computed one distance at a
+// time and sorted every kernel
+
+const int numKernels = 2048;
+const int numSelects = 2000;
+
+int
+naiveSelect(const Bundle<double> & kernels, const double * const pattern,
+    BOX * const boxes)
+{
+    double const * kernel = kernels.begin();
+
+    for (uint i=0; i!=kernels.rows(); ++i)
+    {
+        boxes[i].w = -math::sdistance(pattern, kernel, kernels.cols());
+        boxes[i].id = i;
+        kernel += kernels.cols();
+    }
+
+    halfqsort(boxes, 0, kernels.rows()-1, kernels.rows()-1);
+
+    return boxes[0].id;
+}
+
+int
+main()
+{
+    srand(7);
+
+    for (uint dims : {2, 4, 8, 16, 32}) {
+        Bundle<double> kernels(numKernels, dims);
+        for (auto & v : kernels)
+            v = rand() / double(RAND_MAX);
+
+        std::vector<double> patterns(64 * dims);
+        for (auto & v : patterns)
+            v = rand() / double(RAND_MAX);
+
+        std::vector<BOX> boxes(numKernels);
+        long checksum1 = 0;
+
+        Clock clock(false);
+
+        for (int s=0;s!=numSelects;++s)
+            checksum1 += naiveSelect(kernels, &patterns[(s % 64) * dims], boxes.data());
+
+        const double naive = clock.lap_micro(numSelects);
+
+        Bundle<double> copy(kernels);
+        EuclideanKernelSpace space(0.05, copy);
+
+        for (int level=simd::Scalar; level<=simd::best(); ++level) {
+            space.simdLevel(simd::Level(level));
+            long checksum2 = 0;
+
+            clock.lap_micro();
+
+            for (int s=0;s!=numSelects;++s)
+                checksum2 += space.select(&patterns[(s % 64) * dims])[0];
+
+            const double current = clock.lap_micro(numSelects);
+
+            print("dims:", dims, "level:", simd::name(simd::Level(level)),
+                  "naive(us):", naive, "current(us):", current,
+                  "speedup:", naive / current, checksum1 == checksum2 ? "same" : "DIFFERENT");
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,58 @@
+#include <wup/common/clock.hpp>
+#include <wup/common/msgs.hpp>
+#include <wup/models/kernelcanvas.hpp>
+
+#include <vector>
+#include <cstdlib>
+#include <thread>
+
+using namespace wup;
+
+// Benchmark of EuclideanKernelSpace::selectMany, compared to calling select
+// once per pattern
+
+const int numKernels = 2048;
+const int numPatterns = 4096;
+
+int
+main()
+{
+    srand(7);
+
+    for (uint dims : {2, 8, 32, 128}) {
+        Bundle<double> kernels(numKernels, dims);
+        for (auto & v : kernels)
+            v = rand() / double(RAND_MAX);
+
+        std::vector<double> patterns(size_t(numPatterns) * dims);
+        for (auto & v : patterns)
+            v = rand() / double(RAND_MAX);
+
+        EuclideanKernelSpace space(0.05, kernels);
+        std::vector<int> selections(size_t(numPatterns) * space.k());
+        long checksum1 = 0;
+
+        Clock clock(false);
+
+        for (int i=0;i!=numPatterns;++i)
+            checksum1 += space.select(&patterns[size_t(i) * dims])[space.k() - 1];
+
+        const double single = clock.lap_micro(numPatterns);
+
+        for (uint threads : {1u, std::thread::hardware_concurrency()}) {
+            clock.lap_micro();
+            space.selectMany(patterns.data(), numPatterns, selections.data(), threads);
+            const double batch = clock.lap_micro(numPatterns);
+
+            long checksum2 = 0;
+            for (int i=0;i!=numPatterns;++i)
+                checksum2 += selections[size_t(i) * space.k() + space.k() - 1];
+
+            print("dims:", dims, "threads:", threads, "select(us):", single,
+                  "selectMany(us):", batch, "speedup:", single / batch,
+                  checksum1 == checksum2 ? "same" : "DIFFERENT");
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,59 @@
+#include <wup/common/clock.hpp>
+#include <wup/common/msgs.hpp>
+#include <wup/models/kernelcanvas.hpp>
+
+#include <vector>
+#include <cstdlib>
+
+using namespace wup;
+
+// Benchmark of IndexedKernelSpace::select, compared to the brute force scan
+// of EuclideanKernelSpace
+
+const int numKernels = 4096;
+const int numSelects = 4000;
+
+int
+main()
+{
+    srand(7);
+
+    for (uint dims : {2, 3, 4, 6, 8}) {
+        Bundle<double> kernels(numKernels, dims);
+        for (auto & v : kernels)
+            v = rand() / double(RAND_MAX);
+
+        std::vector<double> patterns(256 * dims);
+        for (auto & v : patterns)
+            v = rand() / double(RAND_MAX);
+
+        for (double act : {0.001, 0.01, 0.05}) {
+            Bundle<double> copy1(kernels);
+            Bundle<double> copy2(kernels);
+
+            EuclideanKernelSpace euclidean(act, copy1);
+            IndexedKernelSpace indexed(act, copy2);
+
+            long checksum1 = 0;
+            long checksum2 = 0;
+
+            Clock clock(false);
+
+            for (int s=0;s!=numSelects;++s)
+                checksum1 += euclidean.select(&patterns[(s % 256) * dims])[euclidean.k() - 1];
+
+            const double scan = clock.lap_micro(numSelects);
+
+            for (int s=0;s!=numSelects;++s)
+                checksum2 += indexed.select(&patterns[(s % 256) * dims])[indexed.k() - 1];
+
+            const double tree = clock.lap_micro(numSelects);
+
+            print("dims:", dims, "k:", euclidean.k(), "euclidean(us):", scan,
+                  "indexed(us):", tree, "speedup:", scan / tree,
+                  checksum1 == checksum2 ? "same" : "DIFFERENT");
+        }
+    }
+
+    return 0;
+}
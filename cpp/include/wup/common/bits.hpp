@@ -7,6 +7,10 @@
 #include <stdint.h>
 #include <limits.h>
 
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
 namespace wup {
 
 inline uint32_t
@@ -27,6 +31,107 @@ rotateRight(uint32_t n,
     return (n>>c) | (n<<( (-c)&mask ));
 }
 
+// Gathers the bits of word selected by mask into the lowest bits of the
+// result, keeping their order (same as the BMI2 pext instruction)
+inline uint64_t
+extractBits(uint64_t word,
+            uint64_t mask)
+{
+#ifdef __BMI2__
+    return _pext_u64(word, mask);
+#else
+    uint64_t result = 0;
+
+    for (uint64_t bit=1; mask; bit<<=1)
+    {
+        if (word & mask & -mask)
+            result |= bit;
+
+        mask &= mask - 1;
+    }
+
+    return result;
+#endif
+}
+
+// Number of bits set in word
+inline int
+countBits(uint64_t word)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(word);
+#else
+    int count = 0;
+
+    for (; word; word &= word - 1)
+        ++count;
+
+    return count;
+#endif
+}
+
+// Spreads the entropy of a 64 bits value over all its bits (MurmurHash3
+// finalizer), used to hash packed addresses in a single step
+inline uint64_t
+mixBits(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdull;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ull;
+    k ^= k >> 33;
+    return k;
+}
+
+// Asks the CPU to start loading the cache line holding address, so a later
+// access does not stall. It is only a hint, ignored by other compilers.
+inline void
+prefetchLine(const void * const address)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(address);
+#else
+    (void) address;
+#endif
+}
+
+// Appends v to out using 7 bits per byte, the high bit marks that more
+// bytes follow (LEB128)
+template <typename Bytes>
+inline void
+putVarint(Bytes & out,
+          uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        out.push_back(uint8_t(v) | 0x80);
+        v >>= 7;
+    }
+
+    out.push_back(uint8_t(v));
+}
+
+// Reads a value written by putVarint and advances ptr. Returns false if the
+// buffer ends before the value does.
+inline bool
+getVarint(uint8_t const *& ptr,
+          uint8_t const * const end,
+          uint64_t & v)
+{
+    v = 0;
+
+    for (int shift=0; ptr != end && shift < 64; shift+=7)
+    {
+        const uint8_t byte = *ptr++;
+        v |= uint64_t(byte & 0x7F) << shift;
+
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+
+    return false;
+}
+
 inline uint32_t
 swapUInt32(uint32_t val)
 {
@@ -81,6 +81,25 @@ sdistance(const double * const v1,
     return ssum;
 }
 
+// Same as above, in single precision
+template <typename T>
+inline float
+sdistance(const float * const v1,
+          const float * const v2,
+          const T cols)
+{
+    const uint size = uint(cols);
+    float ssum = 0.0f;
+
+    for (uint i=0;i!=size;++i)
+    {
+        const float v = v1[i] - v2[i];
+        ssum += v * v;
+    }
+
+    return ssum;
+}
+
 inline double
 distance(const double * const v1,
          const double * const v2,
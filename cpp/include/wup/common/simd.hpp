@@ -0,0 +1,695 @@
+#ifndef __WUP_SIMD_HPP
+#define __WUP_SIMD_HPP
+
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+// Hides a value from the optimizer. Placed between a product and the
+// addition that uses it, it keeps them from being fused into an FMA, which
+// rounds differently. GCC fuses by default (-ffp-contract=fast) whenever the
+// target has FMA, as with -march=native.
+#if defined(__GNUC__) && defined(__x86_64__)
+#define WUP_NO_CONTRACT(v) __asm__("" : "+v"(v))
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define WUP_NO_CONTRACT(v) __asm__("" : "+w"(v))
+#elif defined(__GNUC__)
+#define WUP_NO_CONTRACT(v) __asm__("" : "+m"(v))
+#else
+#define WUP_NO_CONTRACT(v)
+#endif
+
+// The vector versions are compiled for each instruction set with the target
+// attribute and picked at runtime, so the binary still runs on older CPUs.
+// Define WUP_NO_SIMD to keep only the scalar version.
+#if !defined(WUP_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) && \
+        (defined(__x86_64__) || defined(__i386__))
+#define WUP_SIMD_X86
+#include <immintrin.h>
+#endif
+
+namespace wup {
+
+namespace simd {
+
+// Kernels are packed in blocks of Lanes kernels. Inside a block the values
+// of each dimension are stored together, so a single vector operation works
+// on every kernel of the block:
+//
+//     block[d * Lanes + lane] = kernel[block * Lanes + lane][d]
+const uint Lanes = 8;
+
+// Alignment of the packed blocks, one AVX-512 register
+const size_t Alignment = 64;
+
+enum Level { Scalar, SSE2, AVX2, AVX512 };
+
+inline const char *
+name(const Level level)
+{
+    switch (level)
+    {
+    case SSE2:   return "sse2";
+    case AVX2:   return "avx2";
+    case AVX512: return "avx512";
+    default:     return "scalar";
+    }
+}
+
+// Best instruction set supported by this CPU
+inline Level
+detect()
+{
+#ifdef WUP_SIMD_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f"))
+        return AVX512;
+
+    if (__builtin_cpu_supports("avx2"))
+        return AVX2;
+
+    if (__builtin_cpu_supports("sse2"))
+        return SSE2;
+#endif
+
+    return Scalar;
+}
+
+// Same as detect, evaluated once
+inline Level
+best()
+{
+    static const Level level = detect();
+    return level;
+}
+
+// Packs the rows of a row major matrix in blocks of Lanes rows, as described
+// above. The last block is padded with zeros. Returns the first block, inside
+// storage and aligned to Alignment. T is double or float, a float block is
+// half as large and one vector operation covers twice as many of its kernels.
+template <typename T>
+inline T *
+packBlocks(const T * const rows, const uint numRows, const uint dims,
+    std::vector<T> & storage)
+{
+    const uint numBlocks = (numRows + Lanes - 1) / Lanes;
+    const size_t extra = Alignment / sizeof(T);
+
+    storage.assign(size_t(numBlocks) * dims * Lanes + extra, T(0));
+
+    T * blocks = storage.data();
+    while (uintptr_t(blocks) % Alignment != 0)
+        ++blocks;
+
+    for (uint i=0; i!=numRows; ++i)
+    {
+        T * const block = blocks + size_t(i / Lanes) * dims * Lanes;
+
+        for (uint d=0; d!=dims; ++d)
+            block[d * Lanes + i % Lanes] = rows[size_t(i) * dims + d];
+    }
+
+    return blocks;
+}
+
+// Squared euclidean distance between two points. Adds the terms in order and
+// keeps the products apart from the additions with WUP_NO_CONTRACT, as every
+// version of sdistances does, so they all give the same results.
+template <typename T>
+inline T
+sdistance(const T * const a, const T * const b, const uint dims)
+{
+    T sum = 0;
+
+    for (uint d=0; d!=dims; ++d)
+    {
+        const T v = a[d] - b[d];
+        T square = v * v;
+        WUP_NO_CONTRACT(square);
+        sum += square;
+    }
+
+    return sum;
+}
+
+// Squared euclidean distances from pattern to the kernels of numBlocks blocks,
+// Lanes values per block are written to out, each one as sdistance gives it.
+template <typename T>
+inline void
+sdistancesScalar(const T * const pattern, const T * blocks,
+    const uint dims, const uint numBlocks, T * out)
+{
+    for (uint b=0; b!=numBlocks; ++b, blocks+=dims*Lanes, out+=Lanes)
+    {
+        T acc[Lanes] = {};
+
+        for (uint d=0; d!=dims; ++d)
+        {
+            for (uint l=0; l!=Lanes; ++l)
+            {
+                const T v = pattern[d] - blocks[d * Lanes + l];
+                T square = v * v;
+                WUP_NO_CONTRACT(square);
+                acc[l] += square;
+            }
+        }
+
+        for (uint l=0; l!=Lanes; ++l)
+            out[l] = acc[l];
+    }
+}
+
+#ifdef WUP_SIMD_X86
+
+__attribute__((target("sse2")))
+inline void
+sdistancesSSE2(const double * const pattern, const double * blocks,
+    const uint dims, const uint numBlocks, double * out)
+{
+    for (uint b=0; b!=numBlocks; ++b, blocks+=dims*Lanes, out+=Lanes)
+    {
+        __m128d a0 = _mm_setzero_pd();
+        __m128d a1 = _mm_setzero_pd();
+        __m128d a2 = _mm_setzero_pd();
+        __m128d a3 = _mm_setzero_pd();
+
+        for (uint d=0; d!=dims; ++d)
+        {
+            const __m128d p = _mm_set1_pd(pattern[d]);
+            const double * const k = blocks + d * Lanes;
+
+            const __m128d v0 = _mm_sub_pd(p, _mm_load_pd(k));
+            const __m128d v1 = _mm_sub_pd(p, _mm_load_pd(k + 2));
+            const __m128d v2 = _mm_sub_pd(p, _mm_load_pd(k + 4));
+            const __m128d v3 = _mm_sub_pd(p, _mm_load_pd(k + 6));
+
+            __m128d s0 = _mm_mul_pd(v0, v0);
+            __m128d s1 = _mm_mul_pd(v1, v1);
+            __m128d s2 = _mm_mul_pd(v2, v2);
+            __m128d s3 = _mm_mul_pd(v3, v3);
+            WUP_NO_CONTRACT(s0);
+            WUP_NO_CONTRACT(s1);
+            WUP_NO_CONTRACT(s2);
+            WUP_NO_CONTRACT(s3);
+
+            a0 = _mm_add_pd(a0, s0);
+            a1 = _mm_add_pd(a1, s1);
+            a2 = _mm_add_pd(a2, s2);
+            a3 = _mm_add_pd(a3, s3);
+        }
+
+        _mm_storeu_pd(out,     a0);
+        _mm_storeu_pd(out + 2, a1);
+        _mm_storeu_pd(out + 4, a2);
+        _mm_storeu_pd(out + 6, a3);
+    }
+}
+
+__attribute__((target("avx2")))
+inline void
+sdistancesAVX2(const double * const pattern, const double * blocks,
+    const uint dims, const uint numBlocks, double * out)
+{
+    for (uint b=0; b!=numBlocks; ++b, blocks+=dims*Lanes, out+=Lanes)
+    {
+        __m256d a0 = _mm256_setzero_pd();
+        __m256d a1 = _mm256_setzero_pd();
+
+        for (uint d=0; d!=dims; ++d)
+        {
+            const __m256d p = _mm256_set1_pd(pattern[d]);
+            const double * const k = blocks + d * Lanes;
+
+            const __m256d v0 = _mm256_sub_pd(p, _mm256_load_pd(k));
+            const __m256d v1 = _mm256_sub_pd(p, _mm256_load_pd(k + 4));
+
+            __m256d s0 = _mm256_mul_pd(v0, v0);
+            __m256d s1 = _mm256_mul_pd(v1, v1);
+            WUP_NO_CONTRACT(s0);
+            WUP_NO_CONTRACT(s1);
+
+            a0 = _mm256_add_pd(a0, s0);
+            a1 = _mm256_add_pd(a1, s1);
+        }
+
+        _mm256_storeu_pd(out,     a0);
+        _mm256_storeu_pd(out + 4, a1);
+    }
+}
+
+__attribute__((target("avx512f")))
+inline void
+sdistancesAVX512(const double * const pattern, const double * blocks,
+    const uint dims, const uint numBlocks, double * out)
+{
+    const size_t stride = size_t(dims) * Lanes;
+    uint b = 0;
+
+    // Two blocks at a time, so the additions of one hide the latency of
+    // the other
+    for (; b + 2 <= numBlocks; b+=2, blocks+=2*stride, out+=2*Lanes)
+    {
+        __m512d a0 = _mm512_setzero_pd();
+        __m512d a1 = _mm512_setzero_pd();
+
+        for (uint d=0; d!=dims; ++d)
+        {
+            const __m512d p = _mm512_set1_pd(pattern[d]);
+
+            const __m512d v0 = _mm512_sub_pd(p, _mm512_load_pd(blocks + d * Lanes));
+            const __m512d v1 = _mm512_sub_pd(p, _mm512_load_pd(blocks + stride + d * Lanes));
+
+            __m512d s0 = _mm512_mul_pd(v0, v0);
+            __m512d s1 = _mm512_mul_pd(v1, v1);
+            WUP_NO_CONTRACT(s0);
+            WUP_NO_CONTRACT(s1);
+
+            a0 = _mm512_add_pd(a0, s0);
+            a1 = _mm512_add_pd(a1, s1);
+        }
+
+        _mm512_storeu_pd(out,         a0);
+        _mm512_storeu_pd(out + Lanes, a1);
+    }
+
+    if (b != numBlocks)
+    {
+        __m512d a0 = _mm512_setzero_pd();
+
+        for (uint d=0; d!=dims; ++d)
+        {
+            const __m512d v0 = _mm512_sub_pd(_mm512_set1_pd(pattern[d]),
+                    _mm512_load_pd(blocks + d * Lanes));
+
+            __m512d s0 = _mm512_mul_pd(v0, v0);
+            WUP_NO_CONTRACT(s0);
+
+            a0 = _mm512_add_pd(a0, s0);
+        }
+
+        _mm512_storeu_pd(out, a0);
+    }
+}
+
+// The float versions, a row of a block is a single AVX2 register
+
+__attribute__((target("sse2")))
+inline void
+sdistancesSSE2(const float * const pattern, const float * blocks,
+    const uint dims, const uint numBlocks, float * out)
+{
+    for (uint b=0; b!=numBlocks; ++b, blocks+=dims*Lanes, out+=Lanes)
+    {
+        __m128 a0 = _mm_setzero_ps();
+        __m128 a1 = _mm_setzero_ps();
+
+        for (uint d=0; d!=dims; ++d)
+        {
+            const __m128 p = _mm_set1_ps(pattern[d]);
+            const float * const k = blocks + d * Lanes;
+
+            const __m128 v0 = _mm_sub_ps(p, _mm_load_ps(k));
+            const __m128 v1 = _mm_sub_ps(p, _mm_load_ps(k + 4));
+
+            __m128 s0 = _mm_mul_ps(v0, v0);
+            __m128 s1 = _mm_mul_ps(v1, v1);
+            WUP_NO_CONTRACT(s0);
+            WUP_NO_CONTRACT(s1);
+
+            a0 = _mm_add_ps(a0, s0);
+            a1 = _mm_add_ps(a1, s1);
+        }
+
+        _mm_storeu_ps(out,     a0);
+        _mm_storeu_ps(out + 4, a1);
+    }
+}
+
+__attribute__((target("avx2")))
+inline void
+sdistancesAVX2(const float * const pattern, const float * blocks,
+    const uint dims, const uint numBlocks, float * out)
+{
+    const size_t stride = size_t(dims) * Lanes;
+    uint b = 0;
+
+    for (; b + 2 <= numBlocks; b+=2, blocks+=2*stride, out+=2*Lanes)
+    {
+        __m256 a0 = _mm256_setzero_ps();
+        __m256 a1 = _mm256_setzero_ps();
+
+        for (uint d=0; d!=dims; ++d)
+        {
+            const __m256 p = _mm256_set1_ps(pattern[d]);
+
+            const __m256 v0 = _mm256_sub_ps(p, _mm256_load_ps(blocks + d * Lanes));
+            const __m256 v1 = _mm256_sub_ps(p, _mm256_load_ps(blocks + stride + d * Lanes));
+
+            __m256 s0 = _mm256_mul_ps(v0, v0);
+            __m256 s1 = _mm256_mul_ps(v1, v1);
+            WUP_NO_CONTRACT(s0);
+            WUP_NO_CONTRACT(s1);
+
+            a0 = _mm256_add_ps(a0, s0);
+            a1 = _mm256_add_ps(a1, s1);
+        }
+
+        _mm256_storeu_ps(out,         a0);
+        _mm256_storeu_ps(out + Lanes, a1);
+    }
+
+    if (b != numBlocks)
+    {
+        __m256 a0 = _mm256_setzero_ps();
+
+        for (uint d=0; d!=dims; ++d)
+        {
+            const __m256 v0 = _mm256_sub_ps(_mm256_set1_ps(pattern[d]),
+                    _mm256_load_ps(blocks + d * Lanes));
+
+            __m256 s0 = _mm256_mul_ps(v0, v0);
+            WUP_NO_CONTRACT(s0);
+
+            a0 = _mm256_add_ps(a0, s0);
+        }
+
+        _mm256_storeu_ps(out, a0);
+    }
+}
+
+// Row d of two blocks in one register, first in the lower half
+__attribute__((target("avx512f")))
+inline __m512
+loadPair512(const float * const first, const float * const second)
+{
+    // The masked out lanes are not read
+    return _mm512_mask_loadu_ps(_mm512_maskz_loadu_ps(0x00FF, first), 0xFF00,
+            second - Lanes);
+}
+
+__attribute__((target("avx512f")))
+inline void
+sdistancesAVX512(const float * const pattern, const float * blocks,
+    const uint dims, const uint numBlocks, float * out)
+{
+    const size_t stride = size_t(dims) * Lanes;
+    uint b = 0;
+
+    // Four blocks at a time, two per register. Consecutive blocks are also
+    // consecutive in out.
+    for (; b + 4 <= numBlocks; b+=4, blocks+=4*stride, out+=4*Lanes)
+    {
+        __m512 a0 = _mm512_setzero_ps();
+        __m512 a1 = _mm512_setzero_ps();
+
+        for (uint d=0; d!=dims; ++d)
+        {
+            const __m512 p = _mm512_set1_ps(pattern[d]);
+            const float * const k = blocks + d * Lanes;
+
+            const __m512 v0 = _mm512_sub_ps(p, loadPair512(k, k + stride));
+            const __m512 v1 = _mm512_sub_ps(p, loadPair512(k + 2 * stride, k + 3 * stride));
+
+            __m512 s0 = _mm512_mul_ps(v0, v0);
+            __m512 s1 = _mm512_mul_ps(v1, v1);
+            WUP_NO_CONTRACT(s0);
+            WUP_NO_CONTRACT(s1);
+
+            a0 = _mm512_add_ps(a0, s0);
+            a1 = _mm512_add_ps(a1, s1);
+        }
+
+        _mm512_storeu_ps(out,             a0);
+        _mm512_storeu_ps(out + 2 * Lanes, a1);
+    }
+
+    // Up to three blocks left, the last one may pair with itself
+    for (; b != numBlocks; b+=2, blocks+=2*stride, out+=2*Lanes)
+    {
+        const size_t next = b + 1 != numBlocks ? stride : 0;
+        __m512 a0 = _mm512_setzero_ps();
+
+        for (uint d=0; d!=dims; ++d)
+        {
+            const float * const k = blocks + d * Lanes;
+            const __m512 v0 = _mm512_sub_ps(_mm512_set1_ps(pattern[d]),
+                    loadPair512(k, k + next));
+
+            __m512 s0 = _mm512_mul_ps(v0, v0);
+            WUP_NO_CONTRACT(s0);
+
+            a0 = _mm512_add_ps(a0, s0);
+        }
+
+        if (next == 0)
+        {
+            _mm512_mask_storeu_ps(out, 0x00FF, a0);
+            break;
+        }
+
+        _mm512_storeu_ps(out, a0);
+    }
+}
+
+#endif
+
+// Doubles of kernel blocks kept hot while a batch of patterns goes through
+// them, half of a typical L1 data cache. Twice as many floats.
+const size_t GroupDoubles = 2048;
+
+// Dot products of up to four patterns with the kernels of one block,
+// out[r * stride + lane]. x holds the patterns, the missing ones repeat the
+// first. Unlike the distances, the products may use FMA, their callers only
+// need an estimate.
+template <typename T>
+inline void
+productsTileScalar(const T * const * const x, const uint rows,
+    const uint dims, const T * const block, T * const out,
+    const size_t stride)
+{
+    for (uint r=0; r!=rows; ++r)
+    {
+        T acc[Lanes] = {};
+
+        for (uint d=0; d!=dims; ++d)
+            for (uint l=0; l!=Lanes; ++l)
+                acc[l] += x[r][d] * block[d * Lanes + l];
+
+        for (uint l=0; l!=Lanes; ++l)
+            out[r * stride + l] = acc[l];
+    }
+}
+
+#ifdef WUP_SIMD_X86
+
+__attribute__((target("avx2,fma")))
+inline void
+productsTileAVX2(const double * const * const x, const uint rows,
+    const uint dims, const double * const block, double * const out,
+    const size_t stride)
+{
+    __m256d a0 = _mm256_setzero_pd();
+    __m256d a1 = _mm256_setzero_pd();
+    __m256d a2 = _mm256_setzero_pd();
+    __m256d a3 = _mm256_setzero_pd();
+    __m256d a4 = _mm256_setzero_pd();
+    __m256d a5 = _mm256_setzero_pd();
+    __m256d a6 = _mm256_setzero_pd();
+    __m256d a7 = _mm256_setzero_pd();
+
+    for (uint d=0; d!=dims; ++d)
+    {
+        const __m256d k0 = _mm256_load_pd(block + d * Lanes);
+        const __m256d k1 = _mm256_load_pd(block + d * Lanes + 4);
+
+        const __m256d x0 = _mm256_broadcast_sd(x[0] + d);
+        const __m256d x1 = _mm256_broadcast_sd(x[1] + d);
+        const __m256d x2 = _mm256_broadcast_sd(x[2] + d);
+        const __m256d x3 = _mm256_broadcast_sd(x[3] + d);
+
+        a0 = _mm256_fmadd_pd(x0, k0, a0);
+        a1 = _mm256_fmadd_pd(x0, k1, a1);
+        a2 = _mm256_fmadd_pd(x1, k0, a2);
+        a3 = _mm256_fmadd_pd(x1, k1, a3);
+        a4 = _mm256_fmadd_pd(x2, k0, a4);
+        a5 = _mm256_fmadd_pd(x2, k1, a5);
+        a6 = _mm256_fmadd_pd(x3, k0, a6);
+        a7 = _mm256_fmadd_pd(x3, k1, a7);
+    }
+
+    const __m256d acc[8] = { a0, a1, a2, a3, a4, a5, a6, a7 };
+
+    for (uint r=0; r!=rows; ++r)
+    {
+        _mm256_storeu_pd(out + r * stride,     acc[2 * r]);
+        _mm256_storeu_pd(out + r * stride + 4, acc[2 * r + 1]);
+    }
+}
+
+__attribute__((target("avx512f")))
+inline void
+productsTileAVX512(const double * const * const x, const uint rows,
+    const uint dims, const double * const block, double * const out,
+    const size_t stride)
+{
+    __m512d a0 = _mm512_setzero_pd();
+    __m512d a1 = _mm512_setzero_pd();
+    __m512d a2 = _mm512_setzero_pd();
+    __m512d a3 = _mm512_setzero_pd();
+
+    for (uint d=0; d!=dims; ++d)
+    {
+        const __m512d k = _mm512_load_pd(block + d * Lanes);
+
+        a0 = _mm512_fmadd_pd(_mm512_set1_pd(x[0][d]), k, a0);
+        a1 = _mm512_fmadd_pd(_mm512_set1_pd(x[1][d]), k, a1);
+        a2 = _mm512_fmadd_pd(_mm512_set1_pd(x[2][d]), k, a2);
+        a3 = _mm512_fmadd_pd(_mm512_set1_pd(x[3][d]), k, a3);
+    }
+
+    const __m512d acc[4] = { a0, a1, a2, a3 };
+
+    for (uint r=0; r!=rows; ++r)
+        _mm512_storeu_pd(out + r * stride, acc[r]);
+}
+
+// Even and odd dimensions go to separate accumulators, so as many
+// operations are in flight as in the double versions
+__attribute__((target("avx2,fma")))
+inline void
+productsTileAVX2(const float * const * const x, const uint rows,
+    const uint dims, const float * const block, float * const out,
+    const size_t stride)
+{
+    __m256 a0 = _mm256_setzero_ps();
+    __m256 a1 = _mm256_setzero_ps();
+    __m256 a2 = _mm256_setzero_ps();
+    __m256 a3 = _mm256_setzero_ps();
+    __m256 a4 = _mm256_setzero_ps();
+    __m256 a5 = _mm256_setzero_ps();
+    __m256 a6 = _mm256_setzero_ps();
+    __m256 a7 = _mm256_setzero_ps();
+    uint d = 0;
+
+    for (; d + 2 <= dims; d+=2)
+    {
+        const __m256 k0 = _mm256_load_ps(block + d * Lanes);
+        const __m256 k1 = _mm256_load_ps(block + d * Lanes + Lanes);
+
+        a0 = _mm256_fmadd_ps(_mm256_broadcast_ss(x[0] + d), k0, a0);
+        a1 = _mm256_fmadd_ps(_mm256_broadcast_ss(x[0] + d + 1), k1, a1);
+        a2 = _mm256_fmadd_ps(_mm256_broadcast_ss(x[1] + d), k0, a2);
+        a3 = _mm256_fmadd_ps(_mm256_broadcast_ss(x[1] + d + 1), k1, a3);
+        a4 = _mm256_fmadd_ps(_mm256_broadcast_ss(x[2] + d), k0, a4);
+        a5 = _mm256_fmadd_ps(_mm256_broadcast_ss(x[2] + d + 1), k1, a5);
+        a6 = _mm256_fmadd_ps(_mm256_broadcast_ss(x[3] + d), k0, a6);
+        a7 = _mm256_fmadd_ps(_mm256_broadcast_ss(x[3] + d + 1), k1, a7);
+    }
+
+    if (d != dims)
+    {
+        const __m256 k0 = _mm256_load_ps(block + d * Lanes);
+
+        a0 = _mm256_fmadd_ps(_mm256_broadcast_ss(x[0] + d), k0, a0);
+        a2 = _mm256_fmadd_ps(_mm256_broadcast_ss(x[1] + d), k0, a2);
+        a4 = _mm256_fmadd_ps(_mm256_broadcast_ss(x[2] + d), k0, a4);
+        a6 = _mm256_fmadd_ps(_mm256_broadcast_ss(x[3] + d), k0, a6);
+    }
+
+    const __m256 acc[4] = { _mm256_add_ps(a0, a1), _mm256_add_ps(a2, a3),
+            _mm256_add_ps(a4, a5), _mm256_add_ps(a6, a7) };
+
+    for (uint r=0; r!=rows; ++r)
+        _mm256_storeu_ps(out + r * stride, acc[r]);
+}
+
+// A register of two patterns costs more shuffles than it saves, so the
+// float products of AVX-512 are the ones of AVX2. Every CPU with AVX-512
+// also has AVX2 and FMA.
+inline void
+productsTileAVX512(const float * const * const x, const uint rows,
+    const uint dims, const float * const block, float * const out,
+    const size_t stride)
+{
+    productsTileAVX2(x, rows, dims, block, out, stride);
+}
+
+#endif
+
+// Dot products between numPatterns patterns, stored one after the other, and
+// the kernels of numBlocks blocks, a matrix product. Row p of out holds
+// numBlocks * Lanes values. The blocks are visited in groups that stay in
+// cache while every pattern goes through them, four patterns at a time.
+template <typename T>
+inline void
+products(const Level level, const T * const patterns,
+    const uint numPatterns, const T * const blocks, const uint dims,
+    const uint numBlocks, T * const out)
+{
+    typedef void (*Tile)(const T * const *, const uint, const uint,
+            const T *, T *, const size_t);
+
+    Tile tile = productsTileScalar<T>;
+
+#ifdef WUP_SIMD_X86
+    if (level == AVX512)
+        tile = productsTileAVX512;
+
+    else if (level == AVX2)
+        tile = productsTileAVX2;
+#else
+    (void) level;
+#endif
+
+    const size_t stride = size_t(numBlocks) * Lanes;
+    const size_t blockSize = size_t(dims) * Lanes;
+    const size_t groupSize = GroupDoubles * sizeof(double) / sizeof(T);
+    const uint group = blockSize < groupSize ? uint(groupSize / blockSize) : 1;
+
+    for (uint first=0; first<numBlocks; first+=group)
+    {
+        const uint last = numBlocks - first < group ? numBlocks : first + group;
+
+        for (uint p=0; p<numPatterns; p+=4)
+        {
+            const uint rows = numPatterns - p < 4 ? numPatterns - p : 4;
+            const T * x[4];
+
+            for (uint r=0; r!=4; ++r)
+                x[r] = patterns + size_t(p + (r < rows ? r : 0)) * dims;
+
+            for (uint b=first; b!=last; ++b)
+                tile(x, rows, dims, blocks + b * blockSize, out + p * stride + b * Lanes, stride);
+        }
+    }
+}
+
+// Dispatches to the version of level, which must be supported by this CPU
+template <typename T>
+inline void
+sdistances(const Level level, const T * const pattern,
+    const T * const blocks, const uint dims, const uint numBlocks,
+    T * const out)
+{
+#ifdef WUP_SIMD_X86
+    switch (level)
+    {
+    case AVX512: sdistancesAVX512(pattern, blocks, dims, numBlocks, out); return;
+    case AVX2:   sdistancesAVX2  (pattern, blocks, dims, numBlocks, out); return;
+    case SSE2:   sdistancesSSE2  (pattern, blocks, dims, numBlocks, out); return;
+    default: break;
+    }
+#else
+    (void) level;
+#endif
+
+    sdistancesScalar(pattern, blocks, dims, numBlocks, out);
+}
+
+} /* simd */
+
+} /* wup */
+
+#endif /* __WUP_SIMD_HPP */
@@ -0,0 +1,105 @@
+#ifndef __WUP_BITRETINA_HPP
+#define __WUP_BITRETINA_HPP
+
+#include <vector>
+#include <stdint.h>
+
+namespace wup {
+
+// Binary retina packed in 64 bits words, bit i lives in bit (i % 64) of
+// word (i / 64). It may be used anywhere a retina of ints is accepted, and
+// BinaryDecoder gathers the address of a RAM from the packed words directly.
+class BitRetina {
+public:
+
+    BitRetina() :
+        _size(0)
+    {
+
+    }
+
+    BitRetina(const uint size) :
+        _words((size + 63) / 64, 0),
+        _size(size)
+    {
+
+    }
+
+    template <typename Retina>
+    BitRetina(const Retina & retina, const uint size) :
+        BitRetina(size)
+    {
+        assign(retina, size);
+    }
+
+    // Packs the first size elements of retina, non zero values become 1
+    template <typename Retina>
+    void
+    assign(const Retina & retina, const uint size)
+    {
+        _words.assign((size + 63) / 64, 0);
+        _size = size;
+
+        for (uint i=0;i!=size;++i)
+            if (retina[i] != 0)
+                _words[i >> 6] |= uint64_t(1) << (i & 63);
+    }
+
+    int
+    operator[](const uint index) const
+    {
+        return (_words[index >> 6] >> (index & 63)) & 1;
+    }
+
+    void
+    set(const uint index, const bool value)
+    {
+        const uint64_t bit = uint64_t(1) << (index & 63);
+
+        if (value)
+            _words[index >> 6] |= bit;
+        else
+            _words[index >> 6] &= ~bit;
+    }
+
+    void
+    clear()
+    {
+        _words.assign(_words.size(), 0);
+    }
+
+    uint
+    size() const
+    {
+        return _size;
+    }
+
+    uint
+    numWords() const
+    {
+        return _words.size();
+    }
+
+    const uint64_t *
+    words() const
+    {
+        return _words.data();
+    }
+
+    uint64_t *
+    words()
+    {
+        return _words.data();
+    }
+
+private:
+
+    std::vector<uint64_t> _words;
+
+    uint _size;
+
+};
+
+} /* wup */
+
+#endif /* __WUP_BITRETINA_HPP */
@@ -0,0 +1,139 @@
+#ifndef __WUP_BLEACHING_HPP
+#define __WUP_BLEACHING_HPP
+
+#include <vector>
+#include <algorithm>
+#include <climits>
+
+namespace wup {
+
+// Best classes of a read and its confidence. Used by BaseWisard, one per
+// InferenceContext, and by the read only WiSARD variants.
+class Ranking {
+public:
+
+    Ranking() :
+        k1(0),
+        k2(0),
+        k3(0),
+        confidence(1.0)
+    {
+
+    }
+
+    // Used when the model knows no class
+    int
+    reset()
+    {
+        k1 = 0;
+        k2 = k3 = -1;
+        confidence = 0.0;
+        return 0;
+    }
+
+    // Selects the three most activated classes, ties go to the first one
+    template <typename T>
+    int
+    select(const T & a, const int length)
+    {
+        k1 = -1;
+        k2 = -1;
+        k3 = -1;
+
+        for (int i=0;i<length;++i)
+            if (k1 == -1 || a[i] > a[k1])
+                k1 = i;
+
+        for (int i=0;i<length;++i)
+            if (i != k1 && (k2 == -1 || a[i] > a[k2]))
+                k2 = i;
+
+        for (int i=0;i<length;++i)
+            if (i != k1 && i != k2 && (k3 == -1 || a[i] > a[k3]))
+                k3 = i;
+
+        confidence = k1 == -1 || k2 == -1
+                ? 1.0
+                : (float) (a[k1] - a[k2]) / (a[k1]);
+
+        return k1;
+    }
+
+    // Applies the bleaching over the (hits, class) pairs of a pattern, sorted
+    // by hits. Thresholds that can not change the activations are skipped.
+    // Returns the selected class and leaves its activations in a.
+    int
+    bleach(const std::vector<std::pair<int, int> > & hits, int * const a,
+        const int length, const int maxBleaching, const int step,
+        const float minConfidence)
+    {
+        for (int i=0;i!=length;++i)
+            a[i] = 0;
+
+        for (auto & h : hits)
+            ++a[h.second];
+
+        const int numHits = hits.size();
+        int next = 0;
+
+        int bestBleach       = 1;
+        float bestConfidence = 0;
+
+        for (int t=1;t<=maxBleaching;)
+        {
+            while (next != numHits && hits[next].first < t)
+                --a[hits[next++].second];
+
+            const int predicted = select(a, length);
+
+            if (confidence > minConfidence)
+                return predicted;
+
+            if (confidence > bestConfidence)
+            {
+                bestConfidence = confidence;
+                bestBleach     = t;
+            }
+
+            if (next == numHits)
+                break;
+
+            t += step * ((hits[next].first - t) / step + 1);
+        }
+
+        return gather(hits, a, length, bestBleach);
+    }
+
+    // Activations of the classes counting only the pairs with at least
+    // threshold hits, hits sorted as in bleach. Returns the selected class.
+    int
+    gather(const std::vector<std::pair<int, int> > & hits, int * const a,
+        const int length, const int threshold)
+    {
+        for (int i=0;i!=length;++i)
+            a[i] = 0;
+
+        auto it = std::lower_bound(hits.begin(), hits.end(),
+                std::make_pair(threshold, INT_MIN));
+
+        for (; it!=hits.end(); ++it)
+            ++a[it->second];
+
+        return select(a, length);
+    }
+
+public:
+
+    int k1;
+
+    int k2;
+
+    int k3;
+
+    float confidence;
+
+};
+
+} /* wup */
+
+#endif /* __WUP_BLEACHING_HPP */
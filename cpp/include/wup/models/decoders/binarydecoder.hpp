@@ -3,33 +3,86 @@
 
 #include <cstring>
 #include <cstdlib>
+#include <memory>
+#include <vector>
 
 #include <wup/common/bits.hpp>
 #include <wup/common/generic.hpp>
 #include <wup/common/exceptions.hpp>
 #include <wup/models/decoders/basedecoder.hpp>
+#include <wup/models/bitretina.hpp>
 
 namespace wup {
 
 class BinaryDecoder : public BaseDecoder {
 public:
 
+    typedef uint64_t key_type;
+
     BinaryDecoder() :
-        BaseDecoder()
+        BaseDecoder(),
+        _key(0),
+        _unpacked(true)
     {
 
     }
     
     BinaryDecoder(const uint * const indexes, const uint inputSize) :
-        BaseDecoder(indexes, inputSize, inputSize)
+        BaseDecoder(indexes, inputSize, inputSize),
+        _key(0),
+        _unpacked(true)
     {
-
+        if (inputSize <= sizeof(key_type) * CHAR_BIT)
+            _plan = makePlan(indexes, inputSize);
     }
     
     BinaryDecoder(const BinaryDecoder & other) :
-        BaseDecoder(other)
+        BaseDecoder(other),
+        _key(other._key),
+        _plan(other._plan),
+        _unpacked(true)
+    {
+        // Copies are used as keys by MapRam, so they always hold the pattern
+        if (!other._unpacked)
+            unpack();
+    }
+
+    BinaryDecoder &
+    operator=(const BinaryDecoder & other)
     {
+        BaseDecoder::operator=(other);
 
+        _key = other._key;
+        _plan = other._plan;
+        _unpacked = true;
+
+        if (!other._unpacked)
+            unpack();
+
+        return *this;
+    }
+
+    // Word parallel read. The address bits are gathered from the packed
+    // retina with one extractBits per word touched by this RAM and the
+    // pattern is only rebuilt when someone asks for it.
+    void read(const BitRetina & retina)
+    {
+        if (!_plan)
+        {
+            read<BitRetina>(retina);
+            return;
+        }
+
+        const uint64_t * const words = retina.words();
+        key_type k = 0;
+
+        for (const Segment & s : *_plan)
+            k |= extractBits(words[s.word], s.mask) << s.offset;
+
+        _key = k;
+        _unpacked = false;
+        hash(mixBits(k));
+        isZero(k == 0);
     }
 
     template <typename Retina>
@@ -38,6 +91,7 @@ public:
         if (indexes() == NULL)
             throw WUPException();
         
+        _unpacked = true;
         isZero(true);
         
         for (uint i=0;i<inputSize();++i)
@@ -63,9 +117,29 @@ public:
         for (int i=0;i<_size;++i)
             _hash = 13 * _hash + (_pattern[i] ? 7 : 11);*/
 
+        const int * const p = BaseDecoder::pattern();
+        key_type k = 0;
+
+        // The packed key keeps the first bit in the least significant position
+        for (uint i=0;i<patternSize() && i<sizeof(key_type) * CHAR_BIT;++i)
+            if (p[i])
+                k |= key_type(1) << i;
+
+        _key = k;
+        _unpacked = true;
+
+        // Short patterns are hashed from the packed key, in one step, so
+        // reads from a BitRetina get the same hash
+        if (patternSize() <= sizeof(key_type) * CHAR_BIT)
+        {
+            hash(mixBits(k));
+            return;
+        }
+
         size_t h = 0;
+
         for (uint i=0;i<patternSize();++i)
-            h = rotateLeft(h,3) ^ (pattern()[i]?2:3);
+            h = rotateLeft(h,3) ^ (p[i]?2:3);
 
         /*_hash = 1;
         for (int i=0;i<_size;++i)
@@ -74,6 +148,119 @@ public:
         hash(h);
     }
 
+    const int *
+    pattern() const
+    {
+        if (!_unpacked)
+            unpack();
+
+        return BaseDecoder::pattern();
+    }
+
+    int *
+    pattern()
+    {
+        if (!_unpacked)
+            unpack();
+
+        return BaseDecoder::pattern();
+    }
+
+    bool
+    operator==(const BinaryDecoder & other) const
+    {
+        if (patternSize() <= sizeof(key_type) * CHAR_BIT)
+            return inputSize() == other.inputSize() &&
+                    patternSize() == other.patternSize() &&
+                    _key == other._key;
+
+        return BaseDecoder::operator==(other);
+    }
+
+    // Packed address, valid while keyBits() fits inside key_type
+    key_type
+    key() const
+    {
+        return _key;
+    }
+
+    // Restores the pattern from a packed address
+    void
+    key(const key_type k)
+    {
+        for (uint i=0;i<patternSize();++i)
+            pattern()[i] = (k >> i) & 1;
+
+        updateHash();
+        isZero(k == 0);
+    }
+
+    uint
+    keyBits() const
+    {
+        return patternSize();
+    }
+
+private:
+
+    // Bits [offset, offset + popcount(mask)) of the key come from the bits
+    // of retina word selected by mask
+    struct Segment {
+        uint word;
+        uint offset;
+        uint64_t mask;
+    };
+
+    typedef std::vector<Segment> Plan;
+
+    // Splits the indexes in runs of increasing positions inside the same
+    // retina word, each run is gathered by a single extractBits. Sorted
+    // indexes, as created by BaseWisard, touch each word only once.
+    static std::shared_ptr<const Plan>
+    makePlan(const uint * const indexes, const uint inputSize)
+    {
+        std::shared_ptr<Plan> plan(new Plan());
+
+        for (uint i=0;i<inputSize;++i)
+        {
+            const uint word = indexes[i] >> 6;
+            const uint64_t bit = uint64_t(1) << (indexes[i] & 63);
+
+            if (!plan->empty() && plan->back().word == word &&
+                    plan->back().mask < bit)
+            {
+                plan->back().mask |= bit;
+            }
+            else
+            {
+                Segment s = { word, i, bit };
+                plan->push_back(s);
+            }
+        }
+
+        return plan;
+    }
+
+    // Rebuilds the pattern from the packed key
+    void
+    unpack() const
+    {
+        int * const p = const_cast<BinaryDecoder*>(this)->BaseDecoder::pattern();
+
+        for (uint i=0;i<patternSize();++i)
+            p[i] = (_key >> i) & 1;
+
+        _unpacked = true;
+    }
+
+private:
+
+    key_type _key;
+
+    std::shared_ptr<const Plan> _plan;
+
+    mutable bool _unpacked;
+
 };
 
 } /* wup */
@@ -3,15 +3,27 @@
 
 #include <cstdlib>
 #include <cstring>
+#include <climits>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
 
+#include <wup/common/bits.hpp>
 #include <wup/common/exceptions.hpp>
 #include <wup/models/decoders/basedecoder.hpp>
 
+// RAMs up to this size rank their pixels by counting, larger ones sort them
+#ifndef WUP_GRAY_COUNTING_MAX_INPUTS
+#define WUP_GRAY_COUNTING_MAX_INPUTS 16
+#endif
+
 namespace wup {
 
 class GrayDecoder : public BaseDecoder {
 public:
 
+    typedef size_t key_type;
+
     GrayDecoder() :
         BaseDecoder(),
         _hashPattern(NULL),
@@ -47,31 +59,41 @@ public:
     {
         if (indexes() == NULL)
             throw WUPException();
-        
-        // For each gray pixel
-        for (uint i=0;i<inputSize();++i) {
-            uint n = 0;
-            const int current = retina[indexes()[i]];
-            
-            // Calculate the number of other gray pixels that are bigger than the current one
-            // If the pixel value is the same, consider their position instead
-            for (uint j=0;j<inputSize();++j) {
-                const int visiting = retina[indexes()[j]];
-                
-                if ((current < visiting) || (current == visiting && i < j))
-                    n += 1;
-
-                //if ((abs(current - visiting) < 20 && i < j) || (current < visiting))
-                //    n += 1;
-                    
-                // TODO Make the minimum distance a parameter
-                //if ((abs(current-visiting)<10 && i < j) || (current < visiting))
-                //    n += 1;
+
+        const uint size = inputSize();
+        int * const ranks = pattern();
+
+        // The rank of a gray pixel is the number of other pixels that are
+        // bigger than it. If the pixel value is the same, consider their
+        // position instead. Value and position are packed in one integer, so
+        // both rules become a single comparison.
+        _order.resize(size);
+
+        for (uint i=0;i<size;++i) {
+            const uint32_t value = uint32_t(int(retina[indexes()[i]])) ^ 0x80000000u;
+            _order[i] = (uint64_t(value) << 32) | i;
+        }
+
+        if (size <= WUP_GRAY_COUNTING_MAX_INPUTS) {
+            // Branchless counting, vectorized by the compiler
+            for (uint i=0;i<size;++i) {
+                const uint64_t current = _order[i];
+                uint n = 0;
+
+                for (uint j=0;j<size;++j)
+                    n += _order[j] > current;
+
+                ranks[i] = n;
             }
-            
-            pattern()[i] = n;
         }
-        
+        else {
+            // In ascending order the last pixel has rank 0
+            std::sort(_order.begin(), _order.end());
+
+            for (uint p=0;p<size;++p)
+                ranks[uint32_t(_order[p])] = size - 1 - p;
+        }
+
         updateHash();
     }
 
@@ -95,6 +117,9 @@ public:
     void
     updateHash()
     {
+        if (lehmerHash())
+            return;
+
         std::copy(pattern(), pattern() + inputSize(), _hashPattern);
 
         size_t h = 0;
@@ -112,8 +137,91 @@ public:
         hash(h);
     }
 
+    // The permutation index is also a perfect key while inputSize() <= 20
+    key_type
+    key() const
+    {
+        return hash();
+    }
+
+    // Restores the ranks from a permutation index
+    void
+    key(const key_type k)
+    {
+        if (inputSize() == 0)
+            return;
+
+        pattern()[0] = 0;
+
+        for (uint n=1; n!=inputSize(); ++n) {
+            const int digit = int((k / _factorials[n]) % (n + 1));
+
+            for (uint j=0; j!=n; ++j) {
+                if (pattern()[j] >= digit) {
+                    ++pattern()[j];
+                }
+            }
+
+            pattern()[n] = digit;
+        }
+
+        updateHash();
+    }
+
+    uint
+    keyBits() const
+    {
+        // n! overflows key_type for n > 20
+        if (inputSize() > 20)
+            return sizeof(key_type) * CHAR_BIT + 1;
+
+        key_type last = 1;
+        for (uint i=2; i<=inputSize(); ++i)
+            last *= i;
+        last -= 1;
+
+        uint bits = 0;
+        while (last >> bits)
+            ++bits;
+
+        return bits;
+    }
+
 private:
 
+    // Permutation index of the ranks in O(n) for up to 64 inputs. The
+    // digit of position n is the number of earlier ranks smaller than its
+    // own (Lehmer code), the same digits the loop of updateHash finds by
+    // relabeling. Returns false if the pattern is not a permutation.
+    bool
+    lehmerHash()
+    {
+        const uint size = inputSize();
+
+        if (size > 64)
+            return false;
+
+        const int * const ranks = pattern();
+        uint64_t seen = 0;
+        size_t h = 0;
+
+        for (uint n=0; n!=size; ++n) {
+            if (uint(ranks[n]) >= size)
+                return false;
+
+            const uint64_t bit = uint64_t(1) << ranks[n];
+
+            if (seen & bit)
+                return false;
+
+            h += size_t(countBits(seen & (bit - 1))) * _factorials[n];
+            seen |= bit;
+        }
+
+        hash(h);
+        return true;
+    }
+
     size_t * createFactorials(const uint inputSize)
     {
         size_t * f = new size_t[inputSize];
@@ -131,6 +239,8 @@ private:
 
     size_t * _factorials;
 
+    std::vector<uint64_t> _order;
+
 };
 
 } /* wup */
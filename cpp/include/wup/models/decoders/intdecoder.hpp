@@ -2,89 +2,343 @@
 #define __WUP_INTDECODER_HPP
 
 #include <cstdlib>
+#include <climits>
+#include <vector>
 #include <functional>
+#include <stdint.h>
 
-namespace wup 
+#include <wup/common/bits.hpp>
+#include <wup/common/msgs.hpp>
+#include <wup/common/exceptions.hpp>
+
+namespace wup
 {
 
-class IntDecoder 
+// Address of up to 128 inputs, lo holds the first 64 of them
+struct IntAddress128
 {
-public:
+    uint64_t lo;
 
-    const uint * _indexes;
-    
-    int _inputSize;
-    
-    long _address;
-    
+    uint64_t hi;
+
+    IntAddress128() :
+        lo(0),
+        hi(0)
+    {
+
+    }
+
+    IntAddress128(const uint64_t lo, const uint64_t hi=0) :
+        lo(lo),
+        hi(hi)
+    {
+
+    }
+
+    bool
+    operator==(const IntAddress128 & other) const
+    {
+        return lo == other.lo && hi == other.hi;
+    }
+
+    bool
+    operator!=(const IntAddress128 & other) const
+    {
+        return !(*this == other);
+    }
+
+    bool
+    operator<(const IntAddress128 & other) const
+    {
+        return hi < other.hi || (hi == other.hi && lo < other.lo);
+    }
+
+    // Folds the high half into the low one, addresses that fit in 64 bits
+    // are kept as they are. Used by the storages to hash the address.
+    explicit operator uint64_t() const
+    {
+        return lo ^ mixBits(hi);
+    }
+};
+
+// Builds an address of any supported width from its two halves
+template <typename Address>
+inline Address
+intAddress(const uint64_t lo, const uint64_t /*hi*/)
+{
+    return Address(lo);
+}
+
+template <>
+inline IntAddress128
+intAddress<IntAddress128>(const uint64_t lo, const uint64_t hi)
+{
+    return IntAddress128(lo, hi);
+}
+
+template <typename Address>
+inline uint64_t
+lowBits(const Address & address)
+{
+    return uint64_t(address);
+}
+
+template <>
+inline uint64_t
+lowBits<IntAddress128>(const IntAddress128 & address)
+{
+    return address.lo;
+}
+
+template <typename Address>
+inline uint64_t
+highBits(const Address & /*address*/)
+{
+    return 0;
+}
+
+template <>
+inline uint64_t
+highBits<IntAddress128>(const IntAddress128 & address)
+{
+    return address.hi;
+}
+
+// Decoder that keeps the address as a single integer, the bit i holds the
+// input i. The address is also the key, so storages that work with packed
+// keys never hold a pointer or a pattern per address. The pattern is only
+// rebuilt when export or import ask for it.
+template <typename Address>
+class BaseIntDecoder
+{
 public:
-    
-    IntDecoder() :
-        _indexes(nullptr),
-        _inputSize(0)
+
+    typedef Address key_type;
+
+    BaseIntDecoder() :
+        _indexes(NULL),
+        _inputSize(0),
+        _address(),
+        _unpacked(false)
     {
 
     }
-    
-    IntDecoder(const uint * const indexes, const uint inputSize) : 
+
+    BaseIntDecoder(const uint * const indexes, const uint inputSize) :
         _indexes(indexes),
-        _inputSize(inputSize)
+        _inputSize(inputSize),
+        _address(),
+        _unpacked(false)
     {
-        
+        checkSize();
     }
-    
-    IntDecoder(const uint * const first, const uint * const last) : 
+
+    BaseIntDecoder(const uint * const first, const uint * const last) :
         _indexes(first),
-        _inputSize(last-first)
+        _inputSize(last-first),
+        _address(),
+        _unpacked(false)
+    {
+        checkSize();
+    }
+
+    // Copies are used as keys by MapRam, the scratch pattern stays behind
+    BaseIntDecoder(const BaseIntDecoder & other) :
+        _indexes(other._indexes),
+        _inputSize(other._inputSize),
+        _address(other._address),
+        _unpacked(false)
     {
 
     }
-    
-    bool 
-    operator==(const IntDecoder & other) const
+
+    BaseIntDecoder &
+    operator=(const BaseIntDecoder & other)
+    {
+        _indexes = other._indexes;
+        _inputSize = other._inputSize;
+        _address = other._address;
+        _unpacked = false;
+        return *this;
+    }
+
+    bool
+    operator==(const BaseIntDecoder & other) const
     {
         return _address == other._address;
     }
 
-    bool 
-    operator<(const IntDecoder & other) const
+    bool
+    operator<(const BaseIntDecoder & other) const
     {
         return _address < other._address;
     }
 
     template <typename Retina>
-    void 
+    void
     read(const Retina & retina)
     {
-        _address = 0;
-        for (const uint * index = _indexes; index != _indexes + _inputSize; ++index)
-            _address = (_address << 1) | retina[*index];
+        const uint split = _inputSize < 64 ? _inputSize : 64;
+
+        _address = intAddress<Address>(gather(retina, 0, split),
+                _inputSize > 64 ? gather(retina, 64, _inputSize) : 0);
+        _unpacked = false;
     }
 
     bool
     isZero() const
     {
-        return _address == 0;
+        return _address == Address();
+    }
+
+    size_t
+    hash() const
+    {
+        return size_t(mixBits(lowBits(_address) ^ mixBits(highBits(_address))));
     }
 
+    key_type
+    key() const
+    {
+        return _address;
+    }
+
+    void
+    key(const key_type k)
+    {
+        _address = k;
+        _unpacked = false;
+    }
+
+    uint
+    keyBits() const
+    {
+        return _inputSize;
+    }
+
+    const uint *
+    indexes() const
+    {
+        return _indexes;
+    }
+
+    uint
+    inputSize() const
+    {
+        return _inputSize;
+    }
+
+    uint
+    patternSize() const
+    {
+        return _inputSize;
+    }
+
+    const int *
+    pattern() const
+    {
+        unpack();
+        return _pattern.data();
+    }
+
+    int *
+    pattern()
+    {
+        unpack();
+        return _pattern.data();
+    }
+
+    // Packs the address from a pattern written through pattern()
+    void
+    updateHash()
+    {
+        uint64_t lo = 0;
+        uint64_t hi = 0;
+
+        for (uint i=0;i!=_inputSize;++i)
+            if (_pattern[i] != 0)
+                (i < 64 ? lo : hi) |= uint64_t(1) << (i & 63);
+
+        _address = intAddress<Address>(lo, hi);
+    }
+
+private:
+
+    void
+    checkSize() const
+    {
+        if (_inputSize > sizeof(Address) * CHAR_BIT)
+            throw WUPException(cat("This integer decoder supports up to ",
+                    sizeof(Address) * CHAR_BIT, " inputs, received ", _inputSize));
+    }
+
+    // Bits of the inputs [first, last) starting at the least significant one
+    template <typename Retina>
+    uint64_t
+    gather(const Retina & retina, const uint first, const uint last) const
+    {
+        uint64_t bits = 0;
+
+        for (uint i=first;i!=last;++i)
+            bits |= uint64_t(retina[_indexes[i]] != 0) << (i - first);
+
+        return bits;
+    }
+
+    void
+    unpack() const
+    {
+        if (_unpacked)
+            return;
+
+        const uint64_t lo = lowBits(_address);
+        const uint64_t hi = highBits(_address);
+
+        _pattern.resize(_inputSize);
+
+        for (uint i=0;i!=_inputSize;++i)
+            _pattern[i] = ((i < 64 ? lo : hi) >> (i & 63)) & 1;
+
+        _unpacked = true;
+    }
+
+private:
+
+    const uint * _indexes;
+
+    uint _inputSize;
+
+    Address _address;
+
+    mutable std::vector<int> _pattern;
+
+    // Whether _pattern holds the current address
+    mutable bool _unpacked;
+
 };
 
+typedef BaseIntDecoder<uint32_t> IntDecoder32;
+typedef BaseIntDecoder<uint64_t> IntDecoder64;
+typedef BaseIntDecoder<IntAddress128> IntDecoder128;
+
+// Accepts any RAM up to 128 inputs, IntRam stores its addresses with the
+// narrowest of the widths above
+typedef IntDecoder128 IntDecoder;
+
 } /* wup */
 
-namespace std 
+namespace std
 {
 
-//    class std::hash<long> h;
-
-    template <> struct hash<wup::IntDecoder>
+    template <typename Address>
+    struct hash<wup::BaseIntDecoder<Address> >
     {
-        std::size_t operator()(const wup::IntDecoder & k) const
+        std::size_t operator()(const wup::BaseIntDecoder<Address> & k) const
         {
-            return hash<long>().operator()(k._address);
+            return k.hash();
         }
     };
 
 } /* std */
 
 #endif /* __WUP_INTDECODER_HPP */
-
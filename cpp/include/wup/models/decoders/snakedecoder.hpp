@@ -14,20 +14,25 @@ namespace wup {
 class SnakeDecoder : public BaseDecoder {
 public:
 
+    typedef uint64_t key_type;
+
     SnakeDecoder() :
-        BaseDecoder()
+        BaseDecoder(),
+        _key(0)
     {
 
     }
 
     SnakeDecoder(const uint * const indexes, const uint inputSize) :
-        BaseDecoder(indexes, inputSize, inputSize-1)
+        BaseDecoder(indexes, inputSize, inputSize-1),
+        _key(0)
     {
 
     }
 
     SnakeDecoder(const SnakeDecoder & other) :
-        BaseDecoder(other)
+        BaseDecoder(other),
+        _key(other._key)
     {
 
     }
@@ -59,12 +64,48 @@ public:
     updateHash()
     {
         size_t h = 0;
+        key_type k = 0;
+
         for (uint i=0;i<patternSize();++i)
+        {
             h = rotateLeft(h,3) ^ (pattern()[i]?2:3);
 
+            // Each symbol (0, 1 or 2) takes two bits of the packed key
+            if (2 * i < sizeof(key_type) * CHAR_BIT)
+                k |= key_type(pattern()[i]) << (2 * i);
+        }
+
         hash(h);
+        _key = k;
+    }
+
+    // Packed address, valid while keyBits() fits inside key_type
+    key_type
+    key() const
+    {
+        return _key;
+    }
+
+    // Restores the pattern from a packed address
+    void
+    key(const key_type k)
+    {
+        for (uint i=0;i<patternSize();++i)
+            pattern()[i] = (k >> (2 * i)) & 3;
+
+        updateHash();
     }
 
+    uint
+    keyBits() const
+    {
+        return 2 * patternSize();
+    }
+
+private:
+
+    key_type _key;
+
 };
 
 } /* wup */
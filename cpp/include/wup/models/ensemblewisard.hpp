@@ -0,0 +1,397 @@
+#ifndef __WUP_ENSEMBLEWISARD_HPP
+#define __WUP_ENSEMBLEWISARD_HPP
+
+#include <vector>
+#include <algorithm>
+#include <exception>
+
+#include <wup/common/exceptions.hpp>
+#include <wup/common/threads.hpp>
+#include <wup/models/wisard.hpp>
+#include <wup/models/bitretina.hpp>
+#include <wup/models/bleaching.hpp>
+
+namespace wup
+{
+
+// Group of WiSARDs reading the same input through different random
+// mappings. Each retina is packed once in a BitRetina that every member
+// reads, and their answers are combined by votes or by the sum of their
+// activations. Members own their RAMs and only read the shared BitRetina,
+// so each one can be trained and read in its own thread. The single sample
+// methods are serial by default, starting threads for one sample only pays
+// off with large members.
+template <typename Member=Wisard>
+class EnsembleWisard
+{
+public:
+
+    // Vote: each member gives one vote to its prediction
+    // Sum: the activations of all members are added
+    enum Rule { Vote, Sum };
+
+    EnsembleWisard(const int numMembers, const int numInputBits,
+        const int numRamBits, const int numClasses=2) :
+            _numInputBits(numInputBits),
+            _members(numMembers, NULL),
+            _contexts(numMembers)
+    {
+        if (numMembers <= 0)
+            throw WUPException("An ensemble needs at least one member");
+
+        // Each member draws its own shuffling
+        for (auto & member : _members)
+            member = new Member(numInputBits, numRamBits, numClasses);
+    }
+
+    ~EnsembleWisard()
+    {
+        for (auto & member : _members)
+            delete member;
+    }
+
+    int
+    numMembers() const
+    {
+        return _members.size();
+    }
+
+    Member &
+    memberAt(const int index)
+    {
+        return *_members[index];
+    }
+
+    int
+    numDiscriminators() const
+    {
+        return _labels.size();
+    }
+
+    // Known labels in ascending order, same as BaseWisard::targets
+    const std::vector<int> &
+    targets() const
+    {
+        return _labels;
+    }
+
+    // Trains every member, each one in its own thread (0 uses all cores)
+    template <typename Retina>
+    void
+    learn(const Retina & retina, const int target, const uint threads=1)
+    {
+        addLabel(target);
+        _packed.assign(retina, _numInputBits);
+
+        forEachMember(threads, [&](const int m)
+        {
+            _members[m]->learn(_packed, target);
+        });
+    }
+
+    // Packs all patterns once and trains each member in its own thread
+    // (0 uses all cores)
+    template <typename T>
+    void
+    learnBatch(const T * const patterns, const int numPatterns,
+        const int stride, const int * const targets, const uint threads=1)
+    {
+        for (int i=0;i!=numPatterns;++i)
+            addLabel(targets[i]);
+
+        pack(patterns, numPatterns, stride);
+
+        forEachMember(threads, [&](const int m)
+        {
+            for (int i=0;i!=numPatterns;++i)
+                _members[m]->learn(_batch[i], targets[i]);
+        });
+    }
+
+    // The single sample reads also take the number of threads of learn
+    template <typename Retina>
+    int
+    readCounts(const Retina & retina, const Rule rule=Sum, const uint threads=1)
+    {
+        _packed.assign(retina, _numInputBits);
+
+        return combine(rule, threads, [this](Member & member, typename Member::InferenceContext & ctx)
+        {
+            return member.readCounts(_packed, ctx);
+        });
+    }
+
+    template <typename Retina>
+    int
+    readBinary(const Retina & retina, const int threshold=1, const Rule rule=Sum,
+        const uint threads=1)
+    {
+        _packed.assign(retina, _numInputBits);
+
+        return combine(rule, threads, [this, threshold](Member & member,
+                typename Member::InferenceContext & ctx)
+        {
+            return member.readBinary(_packed, ctx, threshold);
+        });
+    }
+
+    template <typename Retina>
+    int
+    readBleaching(const Retina & retina, const Rule rule=Sum, const uint threads=1)
+    {
+        _packed.assign(retina, _numInputBits);
+
+        return combine(rule, threads, [this](Member & member, typename Member::InferenceContext & ctx)
+        {
+            return member.readBleaching(_packed, ctx);
+        });
+    }
+
+    // Batch version of readBinary. Packs all patterns once, each member
+    // reads them in its own thread (0 uses all cores) and the answers are
+    // combined with rule. Confidences are optional.
+    template <typename T>
+    void
+    readBatch(const T * const patterns, const int numPatterns, const int stride,
+        int * const predictions, float * const confidences=NULL,
+        const Rule rule=Sum, const int threshold=1, const uint threads=1)
+    {
+        const int numLabels = _labels.size();
+        const int numMembers = _members.size();
+
+        if (numLabels == 0)
+        {
+            for (int i=0;i!=numPatterns;++i)
+            {
+                predictions[i] = 0;
+
+                if (confidences != NULL)
+                    confidences[i] = 0.0;
+            }
+
+            return;
+        }
+
+        pack(patterns, numPatterns, stride);
+
+        // Scores of each member, one row of labels per pattern
+        std::vector<int> scores(size_t(numMembers) * numPatterns * numLabels, 0);
+
+        forEachMember(threads, [&](const int m)
+        {
+            Member & member = *_members[m];
+            typename Member::InferenceContext & ctx = _contexts[m];
+
+            for (int i=0;i!=numPatterns;++i)
+            {
+                const int predicted = member.readBinary(_batch[i], ctx, threshold);
+                score(rule, member, ctx, predicted,
+                        &scores[(size_t(m) * numPatterns + i) * numLabels]);
+            }
+        });
+
+        for (int i=0;i!=numPatterns;++i)
+        {
+            clearScores();
+
+            for (int m=0;m!=numMembers;++m)
+            {
+                const int * const row = &scores[(size_t(m) * numPatterns + i) * numLabels];
+
+                for (int l=0;l!=numLabels;++l)
+                    _scores[l] += row[l];
+            }
+
+            predictions[i] = _labels[_ranking.select(_scores.data(), numLabels)];
+
+            if (confidences != NULL)
+                confidences[i] = _ranking.confidence;
+        }
+    }
+
+    float
+    getConfidence() const
+    {
+        return _ranking.confidence;
+    }
+
+    // Combined score of target in the last read
+    int
+    getExcitation(const int target) const
+    {
+        const auto it = std::lower_bound(_labels.begin(), _labels.end(), target);
+
+        if (it == _labels.end() || *it != target)
+            return 0;
+
+        return _scores[it - _labels.begin()];
+    }
+
+    int
+    getFirstBestPrediction() const
+    {
+        return _ranking.k1 == -1 ? -1 : _labels[_ranking.k1];
+    }
+
+    int
+    getSecondBestPrediction() const
+    {
+        return _ranking.k2 == -1 ? -1 : _labels[_ranking.k2];
+    }
+
+    int
+    getThirdBestPrediction() const
+    {
+        return _ranking.k3 == -1 ? -1 : _labels[_ranking.k3];
+    }
+
+private:
+
+    EnsembleWisard(const EnsembleWisard &);
+
+    EnsembleWisard & operator=(const EnsembleWisard &);
+
+    void
+    addLabel(const int target)
+    {
+        const auto it = std::lower_bound(_labels.begin(), _labels.end(), target);
+
+        if (it == _labels.end() || *it != target)
+        {
+            _labels.insert(it, target);
+            _scores.resize(_labels.size(), 0);
+        }
+    }
+
+    template <typename T>
+    void
+    pack(const T * const patterns, const int numPatterns, const int stride)
+    {
+        _batch.resize(numPatterns);
+
+        for (int i=0;i!=numPatterns;++i)
+            _batch[i].assign(patterns + size_t(i) * stride, _numInputBits);
+    }
+
+    // Calls f(m) for every member. Like BaseWisard::runJobs, the first
+    // exception of a worker is rethrown here after the threads join.
+    template <typename F>
+    void
+    forEachMember(uint threads, F f)
+    {
+        if (threads == 0)
+            threads = math::max(std::thread::hardware_concurrency(), 1u);
+
+        threads = math::min(threads, uint(_members.size()));
+
+        if (threads <= 1)
+        {
+            for (int m=0;m!=int(_members.size());++m)
+                f(m);
+
+            return;
+        }
+
+        std::vector<std::exception_ptr> errors(threads);
+
+        parallel(threads, _members.size(), [&f, &errors](const int tid, const int m)
+        {
+            if (errors[tid])
+                return;
+
+            try
+            {
+                f(m);
+            }
+            catch (...)
+            {
+                errors[tid] = std::current_exception();
+            }
+        });
+
+        for (const std::exception_ptr & e : errors)
+            if (e)
+                std::rethrow_exception(e);
+    }
+
+    void
+    clearScores()
+    {
+        for (auto & s : _scores)
+            s = 0;
+    }
+
+    // Adds the contribution of a member that predicted predicted to scores,
+    // indexed like _labels
+    void
+    score(const Rule rule, const Member & member,
+        const typename Member::InferenceContext & ctx, const int predicted,
+        int * const scores) const
+    {
+        if (rule == Vote)
+        {
+            const auto it = std::lower_bound(_labels.begin(), _labels.end(), predicted);
+
+            if (it != _labels.end() && *it == predicted)
+                ++scores[it - _labels.begin()];
+        }
+        else
+        {
+            for (size_t l=0;l!=_labels.size();++l)
+                scores[l] += member.getExcitation(ctx, _labels[l]);
+        }
+    }
+
+    // Each member scores its own row, the rows are added in member order
+    template <typename F>
+    int
+    combine(const Rule rule, const uint threads, F read)
+    {
+        if (_labels.empty())
+            return _ranking.reset();
+
+        const int numLabels = _labels.size();
+        _memberScores.assign(_members.size() * numLabels, 0);
+
+        forEachMember(threads, [&](const int m)
+        {
+            const int predicted = read(*_members[m], _contexts[m]);
+            score(rule, *_members[m], _contexts[m], predicted,
+                    &_memberScores[size_t(m) * numLabels]);
+        });
+
+        clearScores();
+
+        for (size_t m=0;m!=_members.size();++m)
+            for (int l=0;l!=numLabels;++l)
+                _scores[l] += _memberScores[m * numLabels + l];
+
+        return _labels[_ranking.select(_scores.data(), numLabels)];
+    }
+
+private:
+
+    int _numInputBits;
+
+    std::vector<Member*> _members;
+
+    std::vector<typename Member::InferenceContext> _contexts;
+
+    std::vector<int> _labels;
+
+    std::vector<int> _scores;
+
+    // Scores of each member in the last single sample read
+    std::vector<int> _memberScores;
+
+    BitRetina _packed;
+
+    std::vector<BitRetina> _batch;
+
+    Ranking _ranking;
+
+};
+
+} /* wup */
+
+#endif /* __WUP_ENSEMBLEWISARD_HPP */
@@ -9,288 +9,507 @@
 #define INCLUDE_WUP_MODELS_KERNELCANVAS_HPP_
 
 #include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <limits>
+#include <utility>
+#include <iterator>
+#include <algorithm>
 
 // #include <wup/common/generate.hpp>
 #include <wup/common/exceptions.hpp>
 #include <wup/common/io.hpp>
 #include <wup/common/generic.hpp>
 #include <wup/common/bundle.hpp>
+#include <wup/common/bits.hpp>
+#include <wup/common/simd.hpp>
+#include <wup/common/threads.hpp>
 
 namespace wup 
 {
 
-// class HashedKernelSpace
-// {
-// private:
-
-//     size_t _numKernels;
-//     size_t _dims;
-//     size_t _numPivots;
-//     // double * _tmp;
-//     double ** _kernels;
-//     int * _selections;
-//     size_t _k;
-//     int _distanceSlices;
-//     double _norm;
-//     int _hashSize;
-
-// public:
-
-//     HashedKernelSpace(const size_t numKernels, 
-//                       const size_t dims,
-//     		          const double act, 
-//                       double ** kernels) :
-                      
-//         _numKernels(numKernels),
-// 		_dims(dims),
-//         _numPivots(dims+1),
-//         // _tmp(nullptr),
-// 		_kernels(kernels),
-//         _selections(nullptr),
-//         _distanceSlices(0),
-//         _norm(0.0)
-
-//     {
-//         _k = size_t(act);
-
-//         if (_k == 0)
-//             _k = 1;
-        
-//         int minimumKernels = _k * _numPivots;
-//         _distanceSlices = 10;
-//         _norm = _distanceSlices / (2 * sqrt(_dims));
-//         _hashSize = _numKernels / _k;
-
-//         debug("Creating HashedKernelSpace.");
-//         debug("  dims =", _dims);
-//         debug("  act =", act);
-//         debug("  k =", _k);
-//         debug("  numKernels =", _numKernels);
-//         debug("  numPivots =", _numPivots);
-//         debug("  minimumKernels =", minimumKernels);
-//         debug("  distanceSlices =", _distanceSlices);
-//         debug("  norm =", _norm);
-//         debug("  hashSize =", _hashSize);
-
-//         if (numKernels < minimumKernels)
-//             throw WUPException(cat("Too few kernels in HashedKernelSpace:", numKernels, "<", minimumKernels));
-
-//         if (_kernels == nullptr)
-// 	        // kernelgens::createRandomKernels(_dims, _numKernels, _kernels);
-//             kernelgens::createBestCandidateKernels(_dims, 16, _numKernels, _kernels);
-
-//         // _tmp = new double[dims];
-//         _selections = new int[_numKernels];
-//     }
-
-//     HashedKernelSpace (IntReader & reader) :
-//             _numKernels(0),
-//             _dims(0),
-//             _numPivots(0),
-//             // _tmp(nullptr),
-//             _kernels(nullptr),
-//             _selections(nullptr),
-//             _distanceSlices(0),
-//             _norm(0.0),
-//             _hashSize(0)
-//     {
-//     	reader.getMilestone();
-
-//         kernelgens::importKernels(reader, _dims, _numKernels, _kernels);
-
-//         _numPivots = reader.getUInt32();
-//         _k = reader.getUInt32();
-        
-//         reader.getMilestone();
-        
-//         // _tmp = new double[_dims];
-//         _selections = new int[_numKernels];
-        
-//         _distanceSlices = 10;
-//         _norm = _distanceSlices / (2 * sqrt(_dims));
-//         _hashSize = _numKernels / _k;
-
-//     }
-
-//     void
-//     exportTo(wup::IntWriter &writer)
-//     {
-//     	writer.putMilestone();
-
-//         kernelgens::exportKernels(writer, _dims, _numKernels, _kernels);
-
-//         writer.putUInt32(_numPivots);
-//         writer.putUInt32(_k);
-
-//         writer.putMilestone();
-//     }
-
-//     virtual
-//     ~HashedKernelSpace()
-//     {
-//         for (uint i=0; i!=_numKernels; ++i)
-//             delete [] _kernels[i];
-
-//         delete [] _selections;
-//         delete [] _kernels;
-//         // delete [] _tmp;
-//     }
-
-//     const int *
-// 	select(double const * const pattern)
-//     {
-//         for (size_t p=0;p<_k;++p)
-//             _selections[p] = p * _hashSize + calculateHKC(pattern, &_kernels[p * _numPivots]);
-//         return _selections;
-//     }
-
-//     uint
-//     k() const
-//     {
-//         return _k;
-//     }
-
-//     uint
-//     dims() const
-//     {
-//         return _dims;
-//     }
-
-//     uint
-//     numKernels() const
-//     {
-//         return _numKernels;
-//     }
-
-//     bool
-//     operator !=(HashedKernelSpace const& other) const
-//     {
-//     	return !(*this == other);
-//     }
-
-//     bool
-//     operator ==(HashedKernelSpace const& other) const
-//     {
-//         if (_numKernels != other._numKernels)
-//             return false;
-
-//         if (_dims != other._dims)
-//             return false;
-
-//         if (_k != other._k)
-//             return false;
-
-//         if (_numPivots != other._numPivots)
-//             return false;
-
-//         if (_norm != other._norm)
-//             return false;
-
-//         if (_distanceSlices != other._distanceSlices)
-//             return false;
-
-//         for (uint i=0; i!=_numKernels; ++i)
-//         {
-//  			auto v1 = _kernels[i];
-//  			auto v2 = other._kernels[i];
-
-//             for (uint j=0; j!=_dims; ++j)
-//             {
-//                 if (v1[j] != v2[j])
-//                     return false;
-// 			}
-//  		}
-
-//  		return true;
-//  	}
-
-// private:
-
-//     int
-//     calculateHKC(double const * const query,
-//                  double const * const * const pivots) const 
-//     {
-//         size_t sum = 0;
-//         for (size_t p=0;p!=_numPivots;++p)
-//             sum = sum * _distanceSlices + int(wup::math::distance(query, pivots[p], _dims) * _norm);
-//         return sum % _hashSize;
-//     }
-
-// };
-
-class EuclideanKernelSpace
+// Approximate kernel selection in time that does not grow with the number
+// of kernels. Each of numTables tables hashes a point by its distances to
+// dims + 1 pivot kernels, cut in slices. select only looks at the kernels
+// in the buckets of the pattern and at the pivots, and returns the k
+// nearest among them in the order EuclideanKernelSpace would. More tables
+// find more of the true k nearest and take longer, examples/test10 measures
+// both. When the buckets hold fewer than k kernels select falls back to
+// every kernel.
+class HashedKernelSpace
 {
 private:
 
     wup::Bundle<double> _kernels;
     int * _selections;
     size_t _k;
-    BOX *_boxes;
+    uint _numTables;
+    uint _numPivots;
+    uint _slices;
+    uint _numBuckets;
+
+    // Pivot kernels of each table
+    std::vector<int> _pivots;
+
+    // Slice of a distance to a pivot is (distance - offset) * scale
+    std::vector<double> _offsets;
+    std::vector<double> _scales;
+
+    // Kernels of bucket b of table t are _members[starts[b], starts[b + 1]),
+    // where starts = &_starts[t * (_numBuckets + 1)]
+    std::vector<uint> _starts;
+    std::vector<int> _members;
+
+    // Marks the kernels already seen by the current select
+    std::vector<uint> _stamps;
+    uint _stamp;
+
+    std::vector<std::pair<double, int> > _candidates;
 
 public:
 
-    EuclideanKernelSpace (const double act, wup::Bundle<double> & kernels) :
+    HashedKernelSpace(const double act, wup::Bundle<double> & kernels,
+        const uint numTables=4) :
 
-		_kernels(std::move(kernels)),
+        _kernels(std::move(kernels)),
         _selections(nullptr),
-        _boxes(nullptr)
+        _numTables(numTables)
     {
         _k = size_t(ceil(_kernels.rows() * act));
 
         if (_k == 0)
             _k = 1;
 
-    	_boxes = new BOX[_kernels.rows()];
-        _selections = new int[_kernels.rows()];
+        init();
+    }
+
+    HashedKernelSpace(IntReader & reader) :
+        _kernels(reader),
+        _selections(nullptr)
+    {
+        _k = reader.getUInt32();
+        _numTables = reader.getUInt32();
+        reader.getMilestone();
+
+        init();
     }
 
     virtual
-    ~EuclideanKernelSpace ()
+    ~HashedKernelSpace()
     {
         delete [] _selections;
-        delete [] _boxes;
     }
 
-    EuclideanKernelSpace (IntReader & reader) :
-            _kernels(reader),
+    void
+    exportTo(wup::IntWriter &writer)
+    {
+        _kernels.exportTo(writer);
+        writer.putUInt32(_k);
+        writer.putUInt32(_numTables);
+        writer.putMilestone();
+    }
+
+    // Ids of k kernels near the pattern, the nearest first
+    const int *
+    select(double const * const pattern)
+    {
+        if (++_stamp == 0)
+        {
+            std::fill(_stamps.begin(), _stamps.end(), 0);
+            _stamp = 1;
+        }
+
+        _candidates.clear();
+
+        for (uint t=0; t!=_numTables; ++t)
+        {
+            const uint * const start = &_starts[size_t(t) * (_numBuckets + 1) + bucket(t, pattern)];
+
+            for (uint i=start[0]; i!=start[1]; ++i)
+                visit(_members[i], pattern);
+
+            for (uint p=0; p!=_numPivots; ++p)
+                visit(_pivots[t * _numPivots + p], pattern);
+        }
+
+        // Rare, the buckets had fewer than k kernels
+        if (_candidates.size() < _k)
+            for (uint j=0; j!=_kernels.rows(); ++j)
+                visit(int(j), pattern);
+
+        std::partial_sort(_candidates.begin(), _candidates.begin() + _k,
+                _candidates.end());
+
+        for (uint i=0; i!=_k; ++i)
+            _selections[i] = _candidates[i].second;
+
+        return _selections;
+    }
+
+    uint
+    k() const
+    {
+        return _k;
+    }
+
+    uint
+    dims() const
+    {
+        return _kernels.cols();
+    }
+
+    uint
+    numKernels() const
+    {
+        return _kernels.rows();
+    }
+
+    uint
+    numTables() const
+    {
+        return _numTables;
+    }
+
+    bool
+    operator !=(HashedKernelSpace const& other) const
+    {
+        return !(*this == other);
+    }
+
+    bool
+    operator ==(HashedKernelSpace const& other) const
+    {
+        if (_k != other._k)
+            return false;
+
+        if (_numTables != other._numTables)
+            return false;
+
+        return _kernels == other._kernels;
+    }
+
+private:
+
+    HashedKernelSpace(const HashedKernelSpace &);
+
+    HashedKernelSpace & operator=(const HashedKernelSpace &);
+
+    void
+    init()
+    {
+        const uint numKernels = _kernels.rows();
+        const uint dims = _kernels.cols();
+
+        if (numKernels == 0)
+            throw WUPException("HashedKernelSpace requires at least one kernel");
+
+        if (_numTables == 0)
+            throw WUPException("HashedKernelSpace requires at least one table");
+
+        if (_k > numKernels)
+            _k = numKernels;
+
+        _selections = new int[_k];
+        _numPivots = dims + 1;
+
+        // About 2k kernels per bucket, so that few selects fall back
+        _slices = uint(round(pow(numKernels / (2.0 * _k), 1.0 / math::max(dims, 1u))));
+        _slices = math::max(_slices, 2u);
+
+        _numBuckets = 1;
+        while (_numBuckets < numKernels)
+            _numBuckets *= 2;
+
+        // Pivots spread over the kernels, the same ones after an import
+        _pivots.resize(_numTables * _numPivots);
+
+        for (uint i=0; i!=_pivots.size(); ++i)
+            _pivots[i] = int(mixBits(i + 1) % numKernels);
+
+        _offsets.assign(_pivots.size(), 0.0);
+        _scales.assign(_pivots.size(), 0.0);
+
+        for (uint i=0; i!=_pivots.size(); ++i)
+        {
+            const double * const pivot = &_kernels(_pivots[i], 0u);
+            double lo = 0.0;
+            double hi = 0.0;
+
+            for (uint j=0; j!=numKernels; ++j)
+            {
+                const double d = math::distance(pivot, &_kernels(j, 0u), dims);
+                lo = j == 0 ? d : math::min(lo, d);
+                hi = j == 0 ? d : math::max(hi, d);
+            }
+
+            _offsets[i] = lo;
+            _scales[i] = hi > lo ? _slices / (hi - lo) : 0.0;
+        }
+
+        // Groups the kernels by bucket, table by table
+        std::vector<uint> buckets(numKernels);
+        _starts.assign(size_t(_numTables) * (_numBuckets + 1), 0);
+        _members.resize(size_t(_numTables) * numKernels);
+
+        for (uint t=0; t!=_numTables; ++t)
+        {
+            uint * const starts = &_starts[size_t(t) * (_numBuckets + 1)];
+            starts[0] = t * numKernels;
+
+            for (uint j=0; j!=numKernels; ++j)
+            {
+                buckets[j] = bucket(t, &_kernels(j, 0u));
+                ++starts[buckets[j] + 1];
+            }
+
+            for (uint b=0; b!=_numBuckets; ++b)
+                starts[b + 1] += starts[b];
+
+            std::vector<uint> next(starts, starts + _numBuckets);
+
+            for (uint j=0; j!=numKernels; ++j)
+                _members[next[buckets[j]]++] = j;
+        }
+
+        _stamps.assign(numKernels, 0);
+        _stamp = 0;
+        _candidates.reserve(size_t(_numTables) * (_k + _numPivots));
+    }
+
+    // Bucket of point in table t
+    uint
+    bucket(const uint t, const double * const point) const
+    {
+        const uint dims = _kernels.cols();
+        uint64_t key = 0;
+
+        for (uint p=0; p!=_numPivots; ++p)
+        {
+            const uint i = t * _numPivots + p;
+            const double d = math::distance(point, &_kernels(_pivots[i], 0u), dims);
+            const double s = (d - _offsets[i]) * _scales[i];
+            const uint slice = !(s >= 0.0) ? 0 : s < _slices ? uint(s) : _slices - 1;
+
+            key = key * _slices + slice;
+        }
+
+        return uint(mixBits(key) & (_numBuckets - 1));
+    }
+
+    void
+    visit(const int id, const double * const pattern)
+    {
+        if (_stamps[id] == _stamp)
+            return;
+
+        _stamps[id] = _stamp;
+        _candidates.push_back(std::make_pair(math::sdistance(pattern,
+                &_kernels(id, 0u), _kernels.cols()), id));
+    }
+
+};
+
+// Selects the k kernels nearest to a pattern. The kernels are also kept
+// packed in blocks (see simd.hpp) so the distances are computed several
+// kernels at a time, with the best instruction set of the CPU. Instead of
+// sorting every kernel, a histogram of the distances finds the few that
+// may be among the k nearest and only those are sorted.
+//
+// T is the scalar type of the kernels, the patterns and the distances. With
+// float the kernels take half the memory and a vector operation covers
+// twice as many of them, but kernels at about the same distance may be
+// selected differently than in double precision. The validation mode counts
+// how often that happens. Files always hold the kernels in double
+// precision, so spaces of both types read the same files.
+template <typename T>
+class BaseEuclideanKernelSpace
+{
+public:
+
+    // Counts of the validation mode
+    struct Validation
+    {
+        // Selections compared to the double precision reference
+        size_t selections;
+
+        // Selections that differ from the reference in any position
+        size_t mismatches;
+
+        // Kernels selected by the reference and missing from the selections
+        size_t missedKernels;
+    };
+
+private:
+
+    template <typename> friend class BaseEuclideanKernelSpace;
+
+    // Scratch of a selection, select and each thread of selectMany have
+    // their own
+    struct SelectContext
+    {
+        std::vector<uint> counts;
+        std::vector<std::pair<T, int> > candidates;
+        std::vector<T> estimates;
+    };
+
+    wup::Bundle<T> _kernels;
+    int * _selections;
+    size_t _k;
+    std::vector<T> _storage;
+    T * _blocks;
+    std::vector<T> _norms;
+    T _maxNorm;
+    std::vector<T> _distances;
+    std::vector<T> _pattern;
+    SelectContext _context;
+    simd::Level _level;
+
+    // Double precision space with the same kernels, in validation mode
+    BaseEuclideanKernelSpace<double> * _reference;
+    mutable Validation _validation;
+
+public:
+
+    // With validate set every selection is made again by a double precision
+    // space and compared, see validation. Takes more than twice the time
+    // and memory, it is meant to check if float kernels suit a model.
+    BaseEuclideanKernelSpace (const double act, wup::Bundle<double> & kernels,
+        const bool validate=false) :
+
+        _selections(nullptr),
+        _blocks(nullptr),
+        _level(simd::best()),
+        _reference(nullptr),
+        _validation()
+    {
+        size_t k = size_t(ceil(kernels.rows() * act));
+
+        if (k == 0)
+            k = 1;
+
+        init(kernels, k, validate);
+    }
+
+    virtual
+    ~BaseEuclideanKernelSpace ()
+    {
+        delete [] _selections;
+        delete _reference;
+    }
+
+    BaseEuclideanKernelSpace (IntReader & reader, const bool validate=false) :
             _selections(nullptr),
-            _boxes(nullptr)
+            _blocks(nullptr),
+            _level(simd::best()),
+            _reference(nullptr),
+            _validation()
     {
-        _k = reader.get();
+        wup::Bundle<double> kernels(reader);
+        const size_t k = reader.get();
         reader.getMilestone();
 
-        _boxes = new BOX[_kernels.rows()];
-        _selections = new int[_kernels.rows()];
+        init(kernels, k, validate);
     }
 
     void
     exportTo(wup::IntWriter &writer)
     {
-        _kernels.exportTo(writer);
+        exportKernels(_kernels, writer);
         writer.putUInt32(_k);
         writer.putMilestone();
     }
 
+    // Ids of the k nearest kernels, the nearest first. On ties the lowest
+    // ids come first.
     const int *
-	select(double const * const pattern)
+	select(T const * const pattern)
     {
-        double const * kernel = _kernels.begin();
+        selectOne(pattern);
 
-        for (uint i=0; i!=_kernels.rows(); ++i)
-        {
-            _boxes[i].w = -math::sdistance(pattern, kernel, _kernels.cols());
-            _boxes[i].id = i;
-            kernel += _kernels.cols();
-        }
+        if (_reference != nullptr)
+            validate(pattern, _selections, 1);
+
+        return _selections;
+    }
 
-        wup::halfqsort(_boxes, 0, _kernels.rows()-1, _kernels.rows()-1);
+    // Same as above for patterns of another type, converted to T first
+    template <typename S>
+    const int *
+    select(S const * const pattern)
+    {
+        _pattern.assign(pattern, pattern + _kernels.cols());
+        selectOne(_pattern.data());
 
-        for (size_t i=0; i!=_kernels.rows(); ++i)
-            _selections[i] = _boxes[i].id;
+        if (_reference != nullptr)
+            validate(pattern, _selections, 1);
 
         return _selections;
     }
 
+    // Batch version of select for n patterns stored one after the other. Row
+    // i of selections receives the k ids select gives for pattern i.
+    //
+    // The distances of a chunk of patterns come from |x|^2 - 2 x.k + |k|^2,
+    // with the dot products computed as a blocked matrix product. Only the
+    // kernels this estimate can not tell apart from the k nearest have their
+    // distance computed again as in select, so both return the same ids.
+    // Chunks are distributed among threads, 0 uses all cores.
+    void
+    selectMany(const T * const patterns, const uint n,
+        int * const selections, const uint threads=1) const
+    {
+        selectBatch(patterns, n, selections, threads);
+
+        if (_reference != nullptr)
+            validate(patterns, selections, n);
+    }
+
+    template <typename S>
+    void
+    selectMany(const S * const patterns, const uint n,
+        int * const selections, const uint threads=1) const
+    {
+        const std::vector<T> converted(patterns, patterns + size_t(n) * _kernels.cols());
+
+        selectBatch(converted.data(), n, selections, threads);
+
+        if (_reference != nullptr)
+            validate(patterns, selections, n);
+    }
+
+    // Counts of the validation mode since the construction or the last
+    // resetValidation, zeros when it is off
+    const Validation &
+    validation() const
+    {
+        return _validation;
+    }
+
+    void
+    resetValidation()
+    {
+        _validation = Validation();
+    }
+
+    bool
+    validating() const
+    {
+        return _reference != nullptr;
+    }
+
+    // Instruction set used by select, limited to the ones this CPU supports
+    void
+    simdLevel(const simd::Level level)
+    {
+        _level = level < simd::best() ? level : simd::best();
+    }
+
+    simd::Level
+    simdLevel() const
+    {
+        return _level;
+    }
+
     uint
     k() const
     {
@@ -309,14 +528,329 @@ public:
         return _kernels.rows();
     }
 
+private:
+
+    BaseEuclideanKernelSpace(const BaseEuclideanKernelSpace &);
+
+    BaseEuclideanKernelSpace & operator=(const BaseEuclideanKernelSpace &);
+
+    // Reference of a validation, keeps k as it is
+    BaseEuclideanKernelSpace (wup::Bundle<double> & kernels, const size_t k) :
+            _selections(nullptr),
+            _blocks(nullptr),
+            _level(simd::best()),
+            _reference(nullptr),
+            _validation()
+    {
+        init(kernels, k, false);
+    }
+
+    void
+    init(wup::Bundle<double> & kernels, const size_t k, const bool validate)
+    {
+        if (kernels.rows() == 0)
+            throw WUPException("EuclideanKernelSpace requires at least one kernel");
+
+        if (validate)
+        {
+            wup::Bundle<double> copy(kernels);
+            _reference = new BaseEuclideanKernelSpace<double>(copy, k);
+        }
+
+        convertKernels(kernels, _kernels);
+
+        const uint numKernels = _kernels.rows();
+        _k = k > numKernels ? numKernels : k;
+
+        _blocks = simd::packBlocks(_kernels.begin(), numKernels, _kernels.cols(), _storage);
+        _distances.resize((numKernels + simd::Lanes - 1) / simd::Lanes * simd::Lanes);
+        _selections = new int[_k];
+
+        _norms.resize(numKernels);
+        _maxNorm = 0;
+
+        for (uint i=0; i!=numKernels; ++i)
+        {
+            _norms[i] = norm(_kernels.begin() + size_t(i) * _kernels.cols());
+            _maxNorm = math::max(_maxNorm, _norms[i]);
+        }
+    }
+
+    // Takes the kernels when T is double and converts them otherwise
+    static void
+    convertKernels(wup::Bundle<double> & src, wup::Bundle<double> & dst)
+    {
+        dst = std::move(src);
+    }
+
+    template <typename S>
+    static void
+    convertKernels(wup::Bundle<double> & src, wup::Bundle<S> & dst)
+    {
+        dst = wup::Bundle<S>(src.rows(), src.cols());
+        std::copy(src.begin(), src.end(), dst.begin());
+    }
+
+    static void
+    exportKernels(wup::Bundle<double> & kernels, wup::IntWriter & writer)
+    {
+        kernels.exportTo(writer);
+    }
+
+    template <typename S>
+    static void
+    exportKernels(wup::Bundle<S> & kernels, wup::IntWriter & writer)
+    {
+        wup::Bundle<double> wide(kernels.rows(), kernels.cols());
+        std::copy(kernels.begin(), kernels.end(), wide.begin());
+        wide.exportTo(writer);
+    }
+
+    T
+    norm(const T * const v) const
+    {
+        T sum = 0;
+
+        for (uint d=0; d!=_kernels.cols(); ++d)
+            sum += v[d] * v[d];
+
+        return sum;
+    }
+
+    void
+    selectOne(T const * const pattern)
+    {
+        const uint numKernels = _kernels.rows();
+
+        simd::sdistances(_level, pattern, _blocks, _kernels.cols(),
+                (numKernels + simd::Lanes - 1) / simd::Lanes, _distances.data());
+
+        // Every kernel in the bucket of the k-th distance or before it
+        double lo, scale;
+        const uint last = kthBucket(_context, _distances.data(), numKernels, lo, scale);
+
+        std::pair<T, int> * const candidates = _context.candidates.data();
+        uint count = 0;
+
+        for (uint i=0; i!=numKernels; ++i)
+        {
+            candidates[count] = std::make_pair(_distances[i], int(i));
+            count += bucket(_distances[i], lo, scale, numKernels) <= last;
+        }
+
+        sortCandidates(_context, count, _selections);
+    }
+
+    void
+    selectBatch(const T * const patterns, const uint n,
+        int * const selections, uint threads) const
+    {
+        const uint chunkSize = 32;
+        const uint numChunks = (n + chunkSize - 1) / chunkSize;
+
+        if (threads == 0)
+            threads = math::max(std::thread::hardware_concurrency(), 1u);
+
+        threads = math::min(threads, math::max(numChunks, 1u));
+
+        std::vector<SelectContext> contexts(threads);
+
+        auto job = [&](const int tid, const int chunk)
+        {
+            const uint first = chunk * chunkSize;
+            const uint count = math::min(first + chunkSize, n) - first;
+
+            selectChunk(contexts[tid], patterns + size_t(first) * dims(), count,
+                    selections + size_t(first) * _k);
+        };
+
+        if (threads == 1)
+        {
+            for (uint c=0; c!=numChunks; ++c)
+                job(0, c);
+        }
+        else
+        {
+            parallel(threads, numChunks, job);
+        }
+    }
+
+    // Compares the selections of n patterns, stored one after the other, to
+    // the ones of the reference
+    template <typename S>
+    void
+    validate(const S * const patterns, const int * const selections,
+        const uint n) const
+    {
+        const uint dims = _kernels.cols();
+        std::vector<double> pattern(dims);
+        std::vector<int> expected(_k);
+        std::vector<int> selected(_k);
+        std::vector<int> common;
+
+        for (uint i=0; i!=n; ++i)
+        {
+            std::copy(patterns + size_t(i) * dims, patterns + size_t(i + 1) * dims,
+                    pattern.begin());
+
+            const int * const reference = _reference->select(pattern.data());
+            const int * const current = selections + size_t(i) * _k;
+
+            ++_validation.selections;
+            _validation.mismatches += !std::equal(current, current + _k, reference);
+
+            expected.assign(reference, reference + _k);
+            selected.assign(current, current + _k);
+            std::sort(expected.begin(), expected.end());
+            std::sort(selected.begin(), selected.end());
+
+            common.clear();
+            std::set_intersection(expected.begin(), expected.end(),
+                    selected.begin(), selected.end(), std::back_inserter(common));
+
+            _validation.missedKernels += _k - common.size();
+        }
+    }
+
+    // Bucket of value among numBuckets buckets starting at lo. Never
+    // decreases as value grows, NaN goes to the last bucket.
+    static uint
+    bucket(const double value, const double lo, const double scale,
+        const uint numBuckets)
+    {
+        const double b = (value - lo) * scale;
+        return b < numBuckets ? uint(b) : numBuckets;
+    }
+
+    // Spreads the count values over count buckets between their minimum and
+    // maximum and returns the bucket of the k-th smallest one. There are no
+    // branches per value, unlike a heap or nth_element, which mispredict
+    // most of their comparisons on distances.
+    uint
+    kthBucket(SelectContext & ctx, const T * const values, const uint count,
+        double & lo, double & scale) const
+    {
+        lo = values[0];
+        double hi = values[0];
+
+        for (uint i=1; i!=count; ++i)
+        {
+            lo = values[i] < lo ? values[i] : lo;
+            hi = values[i] > hi ? values[i] : hi;
+        }
+
+        scale = hi > lo ? count / (hi - lo) : 0.0;
+
+        ctx.counts.assign(count + 1, 0);
+        ctx.candidates.resize(count);
+
+        for (uint i=0; i!=count; ++i)
+            ++ctx.counts[bucket(values[i], lo, scale, count)];
+
+        uint b = 0;
+
+        for (uint sum=ctx.counts[0]; sum < _k; sum+=ctx.counts[++b]);
+
+        return b;
+    }
+
+    // Writes the ids of the k first candidates by distance and id
+    void
+    sortCandidates(SelectContext & ctx, const uint count, int * const out) const
+    {
+        std::sort(ctx.candidates.begin(), ctx.candidates.begin() + count);
+
+        for (uint i=0; i!=_k; ++i)
+            out[i] = ctx.candidates[i].second;
+    }
+
+    void
+    selectChunk(SelectContext & ctx, const T * const patterns,
+        const uint count, int * const selections) const
+    {
+        const uint dims = _kernels.cols();
+        const uint numKernels = _kernels.rows();
+        const uint numBlocks = (numKernels + simd::Lanes - 1) / simd::Lanes;
+        const size_t stride = size_t(numBlocks) * simd::Lanes;
+
+        ctx.estimates.resize(count * stride);
+
+        simd::products(_level, patterns, count, _blocks, dims, numBlocks,
+                ctx.estimates.data());
+
+        // Bounds the error of an estimate relative to |x|^2 + |k|^2, with
+        // room for the rounding of the exact distance as well
+        const T slack = (8 * dims + 16) * std::numeric_limits<T>::epsilon();
+
+        for (uint p=0; p!=count; ++p)
+        {
+            const T * const pattern = patterns + size_t(p) * dims;
+            T * const estimates = &ctx.estimates[p * stride];
+            const T patternNorm = norm(pattern);
+
+            for (uint i=0; i!=numKernels; ++i)
+                estimates[i] = patternNorm - 2 * estimates[i] + _norms[i];
+
+            // At least k estimates are not above largest, so the k-th exact
+            // distance is not above threshold. Kernels whose estimate is
+            // farther than that by more than its error can not be among the
+            // k nearest.
+            double lo, scale;
+            const uint last = kthBucket(ctx, estimates, numKernels, lo, scale);
+            T largest = -std::numeric_limits<T>::infinity();
+
+            for (uint i=0; i!=numKernels; ++i)
+            {
+                const bool inside = bucket(estimates[i], lo, scale, numKernels) <= last;
+                largest = inside && estimates[i] > largest ? estimates[i] : largest;
+            }
+
+            const T threshold = largest + slack * (patternNorm + _maxNorm);
+
+            std::pair<T, int> * const candidates = ctx.candidates.data();
+            uint found = 0;
+
+            for (uint i=0; i!=numKernels; ++i)
+            {
+                candidates[found].second = i;
+                found += estimates[i] - slack * (patternNorm + _norms[i]) <= threshold;
+            }
+
+            // Exact distances from the same kernel as select, a block at a
+            // time. Candidates are in the order of their ids, so the ones
+            // sharing a block are next to each other.
+            const size_t blockSize = size_t(dims) * simd::Lanes;
+            T distances[simd::Lanes];
+            uint block = numBlocks;
+
+            for (uint i=0; i!=found; ++i)
+            {
+                const uint id = candidates[i].second;
+
+                if (id / simd::Lanes != block)
+                {
+                    block = id / simd::Lanes;
+                    simd::sdistances(_level, pattern, _blocks + block * blockSize,
+                            dims, 1, distances);
+                }
+
+                candidates[i].first = distances[id % simd::Lanes];
+            }
+
+            sortCandidates(ctx, found, selections + size_t(p) * _k);
+        }
+    }
+
+public:
+
     bool
-    operator !=(EuclideanKernelSpace const& other) const
+    operator !=(BaseEuclideanKernelSpace const& other) const
     {
     	return !(*this == other);
     }
 
     bool
-    operator ==(EuclideanKernelSpace const& other) const
+    operator ==(BaseEuclideanKernelSpace const& other) const
     {
         if (_k != other._k)
             return false;
@@ -326,6 +860,319 @@ public:
 
 };
 
+typedef BaseEuclideanKernelSpace<double> EuclideanKernelSpace;
+typedef BaseEuclideanKernelSpace<float> FloatEuclideanKernelSpace;
+
+// Same selections as EuclideanKernelSpace, for kernel spaces with few
+// dimensions. The kernels are kept in a KD-tree, each node holding the
+// bounding box of its kernels, and select only visits the nodes whose box
+// may hold one of the k nearest. Pays off while k is a small fraction of
+// the kernels and there are up to about six dimensions, examples/test9
+// compares both. Uses the file format of EuclideanKernelSpace, the tree is
+// built again when loading.
+class IndexedKernelSpace
+{
+private:
+
+    struct TreeNode
+    {
+        // Range of the node in _points
+        uint first;
+
+        uint last;
+
+        // Children in _nodes, zero for leaves
+        uint left;
+
+        uint right;
+    };
+
+    // Kernels per leaf
+    static const uint LeafSize = 8;
+
+    wup::Bundle<double> _kernels;
+    int * _selections;
+    size_t _k;
+    std::vector<double> _points;
+    std::vector<int> _ids;
+    std::vector<TreeNode> _nodes;
+    std::vector<double> _boxes;
+    std::vector<std::pair<double, int> > _nearest;
+
+public:
+
+    IndexedKernelSpace (const double act, wup::Bundle<double> & kernels) :
+        _kernels(std::move(kernels)),
+        _selections(nullptr)
+    {
+        _k = size_t(ceil(_kernels.rows() * act));
+
+        if (_k == 0)
+            _k = 1;
+
+        init();
+    }
+
+    IndexedKernelSpace (IntReader & reader) :
+        _kernels(reader),
+        _selections(nullptr)
+    {
+        _k = reader.get();
+        reader.getMilestone();
+
+        init();
+    }
+
+    virtual
+    ~IndexedKernelSpace ()
+    {
+        delete [] _selections;
+    }
+
+    void
+    exportTo(wup::IntWriter &writer)
+    {
+        _kernels.exportTo(writer);
+        writer.putUInt32(_k);
+        writer.putMilestone();
+    }
+
+    // Ids of the k nearest kernels, the nearest first. On ties the lowest
+    // ids come first.
+    const int *
+    select(double const * const pattern)
+    {
+        _nearest.clear();
+        search(0, pattern);
+
+        // The heap keeps the farthest on top
+        std::sort_heap(_nearest.begin(), _nearest.end());
+
+        for (uint i=0; i!=_k; ++i)
+            _selections[i] = _nearest[i].second;
+
+        return _selections;
+    }
+
+    uint
+    k() const
+    {
+        return _k;
+    }
+
+    uint
+    dims() const
+    {
+        return _kernels.cols();
+    }
+
+    uint
+    numKernels() const
+    {
+        return _kernels.rows();
+    }
+
+    bool
+    operator !=(IndexedKernelSpace const& other) const
+    {
+        return !(*this == other);
+    }
+
+    bool
+    operator ==(IndexedKernelSpace const& other) const
+    {
+        if (_k != other._k)
+            return false;
+
+        return _kernels == other._kernels;
+    }
+
+private:
+
+    IndexedKernelSpace(const IndexedKernelSpace &);
+
+    IndexedKernelSpace & operator=(const IndexedKernelSpace &);
+
+    void
+    init()
+    {
+        const uint numKernels = _kernels.rows();
+
+        if (numKernels == 0)
+            throw WUPException("IndexedKernelSpace requires at least one kernel");
+
+        if (_k > numKernels)
+            _k = numKernels;
+
+        _selections = new int[_k];
+        _nearest.reserve(_k);
+
+        _ids.resize(numKernels);
+        for (uint i=0; i!=numKernels; ++i)
+            _ids[i] = i;
+
+        _nodes.clear();
+        _boxes.clear();
+        build(0, numKernels);
+
+        // Kernels in the order of the leaves
+        const uint dims = _kernels.cols();
+        _points.resize(size_t(numKernels) * dims);
+
+        for (uint i=0; i!=numKernels; ++i)
+            std::copy(_kernels.begin() + size_t(_ids[i]) * dims,
+                    _kernels.begin() + size_t(_ids[i] + 1) * dims,
+                    _points.begin() + size_t(i) * dims);
+    }
+
+    // Builds the node of the kernels _ids[first, last) and returns its index.
+    // Splits at the median of the dimension where the box is widest.
+    uint
+    build(const uint first, const uint last)
+    {
+        const uint dims = _kernels.cols();
+        const uint index = _nodes.size();
+
+        TreeNode node;
+        node.first = first;
+        node.last = last;
+        node.left = 0;
+        node.right = 0;
+
+        _nodes.push_back(node);
+        _boxes.resize(_boxes.size() + 2 * dims);
+
+        double * const lo = &_boxes[size_t(index) * 2 * dims];
+        double * const hi = lo + dims;
+
+        for (uint d=0; d!=dims; ++d)
+        {
+            lo[d] = hi[d] = _kernels(_ids[first], d);
+
+            for (uint i=first+1; i!=last; ++i)
+            {
+                lo[d] = math::min(lo[d], _kernels(_ids[i], d));
+                hi[d] = math::max(hi[d], _kernels(_ids[i], d));
+            }
+        }
+
+        if (last - first <= LeafSize)
+            return index;
+
+        uint split = 0;
+
+        for (uint d=1; d!=dims; ++d)
+            if (hi[d] - lo[d] > hi[split] - lo[split])
+                split = d;
+
+        // Every kernel is at the same place
+        if (!(hi[split] > lo[split]))
+            return index;
+
+        const uint middle = first + (last - first) / 2;
+        const Bundle<double> & kernels = _kernels;
+
+        std::nth_element(_ids.begin() + first, _ids.begin() + middle,
+                _ids.begin() + last, [&kernels, split](const int a, const int b)
+        {
+            return kernels(a, split) < kernels(b, split);
+        });
+
+        const uint left = build(first, middle);
+        const uint right = build(middle, last);
+
+        _nodes[index].left = left;
+        _nodes[index].right = right;
+
+        return index;
+    }
+
+    // Smallest distance from pattern to a point of the box of a node. Adds
+    // the same terms as simd::sdistance in the same order, each one not
+    // larger, so it never exceeds the distance computed to a kernel inside
+    // it.
+    double
+    lowerBound(const uint index, const double * const pattern) const
+    {
+        const uint dims = _kernels.cols();
+        const double * const lo = &_boxes[size_t(index) * 2 * dims];
+        const double * const hi = lo + dims;
+
+        double sum = 0.0;
+
+        for (uint d=0; d!=dims; ++d)
+        {
+            const double v = pattern[d] < lo[d] ? pattern[d] - lo[d] :
+                    pattern[d] > hi[d] ? pattern[d] - hi[d] : 0.0;
+            double square = v * v;
+            WUP_NO_CONTRACT(square);
+            sum += square;
+        }
+
+        return sum;
+    }
+
+    // Whether the k nearest so far are known and the candidate would not
+    // replace the farthest of them
+    bool
+    worse(const double distance, const int id) const
+    {
+        return _nearest.size() == _k &&
+                !(std::make_pair(distance, id) < _nearest.front());
+    }
+
+    void
+    search(const uint index, const double * const pattern)
+    {
+        const TreeNode & node = _nodes[index];
+
+        if (node.left == 0)
+        {
+            const uint dims = _kernels.cols();
+
+            for (uint i=node.first; i!=node.last; ++i)
+            {
+                const double distance = simd::sdistance(pattern,
+                        &_points[size_t(i) * dims], dims);
+
+                if (worse(distance, _ids[i]))
+                    continue;
+
+                if (_nearest.size() == _k)
+                {
+                    std::pop_heap(_nearest.begin(), _nearest.end());
+                    _nearest.pop_back();
+                }
+
+                _nearest.push_back(std::make_pair(distance, _ids[i]));
+                std::push_heap(_nearest.begin(), _nearest.end());
+            }
+
+            return;
+        }
+
+        double near = lowerBound(node.left, pattern);
+        double far = lowerBound(node.right, pattern);
+        uint first = node.left;
+        uint second = node.right;
+
+        if (far < near)
+        {
+            std::swap(near, far);
+            std::swap(first, second);
+        }
+
+        // A box at the distance of the farthest may still hold a kernel
+        // with a lower id
+        if (!worse(near, -1))
+            search(first, pattern);
+
+        if (!worse(far, -1))
+            search(second, pattern);
+    }
+
+};
+
 template <typename KernelSpace=EuclideanKernelSpace>
 class KernelCanvas 
 {
@@ -335,25 +1182,31 @@ private:
     KernelSpace _kernelSpace;
     std::vector<int> _outputFreq;
     std::vector<int> _outputBits;
+    std::vector<int> _selected;
 
 public:
 
+    // Extra arguments go to the KernelSpace, like the number of tables of
+    // a HashedKernelSpace
+    template <typename... Args>
     KernelCanvas(const double act,
                  const uint term_bits, 
-                 wup::Bundle<double> & kernels) :
+                 wup::Bundle<double> & kernels,
+                 Args... args) :
 
         _term_bits(term_bits),
-        _kernelSpace(act, kernels),
+        _kernelSpace(act, kernels, args...),
         _outputFreq(_kernelSpace.numKernels()),
         _outputBits(_kernelSpace.numKernels() * term_bits)
     {
 
     }
 
-    KernelCanvas(IntReader & reader) :
+    template <typename... Args>
+    KernelCanvas(IntReader & reader, Args... args) :
 
             _term_bits(reader.getUInt32()),
-            _kernelSpace(reader),
+            _kernelSpace(reader, args...),
             _outputFreq(_kernelSpace.numKernels()),
             _outputBits(_kernelSpace.numKernels() * _term_bits)
     {
@@ -379,13 +1232,26 @@ public:
             _outputFreq[i] = 0;
     }
 
-    void read(const double * pattern)
+    // Patterns may be of any type the KernelSpace selects with
+    template <typename P>
+    void read(const P * pattern)
     {
         const int * const ids = _kernelSpace.select(pattern);
         for (uint i=0; i!=_kernelSpace.k(); ++i)
             _outputFreq[ids[i]] = 1;
     }
 
+    // Same as calling read for n patterns stored one after the other
+    template <typename P>
+    void readMany(const P * patterns, const uint n, const uint threads=1)
+    {
+        _selected.resize(size_t(n) * _kernelSpace.k());
+        _kernelSpace.selectMany(patterns, n, _selected.data(), threads);
+
+        for (const int id : _selected)
+            _outputFreq[id] = 1;
+    }
+
     std::vector<int> const & binary_output()
     {
         const int len = _kernelSpace.numKernels();
@@ -0,0 +1,560 @@
+#ifndef __WUP_MAPPEDWISARD_HPP
+#define __WUP_MAPPEDWISARD_HPP
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <wup/common/bits.hpp>
+#include <wup/common/exceptions.hpp>
+#include <wup/common/io.hpp>
+#include <wup/models/wisard.hpp>
+#include <wup/models/bleaching.hpp>
+
+namespace wup
+{
+
+// Read only WiSARD queried in place from a memory mapped file. Opening a
+// model only validates the header, the pages are loaded on demand by the
+// operating system and shared by every process mapping the same file. Each
+// instance keeps its own scratch memory, so threads should open their own
+// instance, which is cheap. Files are written by MappedWisard::convert from
+// a BinaryDecoder model or from a file written by Wisard::exportTo.
+//
+// Layout, little endian and 8 bytes aligned:
+//
+//     Header
+//     uint32_t shuffling[numInputBits]
+//     int32_t  labels[numClasses]                 outer label of each class
+//     RamEntry rams[numRams]                      offset and size of each table
+//     tables of Slot, one per RAM
+//
+// Each table is an open addressing hash table with a power of two capacity,
+// indexed by mixBits(key) and probed linearly. A slot holds the packed
+// address (as in BinaryDecoder::key) and one counter per class, unused
+// slots have all bits of the key set.
+class MappedWisard
+{
+public:
+
+    static const uint32_t Version = 1;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrder;
+        int32_t numInputBits;
+        int32_t numRamBits;
+        int32_t numRams;
+        int32_t numClasses;
+        int32_t maxBleaching;
+        int32_t slotSize;
+        uint64_t shufflingOffset;
+        uint64_t labelsOffset;
+        uint64_t ramsOffset;
+        uint64_t fileSize;
+    };
+
+    struct RamEntry {
+        uint64_t offset;
+        uint64_t capacity;
+    };
+
+    MappedWisard(const std::string & filepath) :
+        _fd(-1),
+        _data(NULL),
+        _size(0),
+        _header(NULL),
+        _shuffling(NULL),
+        _labels(NULL),
+        _rams(NULL)
+    {
+        _fd = open(filepath.c_str(), O_RDONLY);
+        if (_fd == -1)
+            throw WUPException(cat("Could not open ", filepath));
+
+        struct stat st;
+        if (fstat(_fd, &st) == -1 || size_t(st.st_size) < sizeof(Header))
+        {
+            close(_fd);
+            throw WUPException(cat("Invalid mapped WiSARD file: ", filepath));
+        }
+
+        _size = st.st_size;
+        void * data = mmap(NULL, _size, PROT_READ, MAP_SHARED, _fd, 0);
+
+        if (data == MAP_FAILED)
+        {
+            close(_fd);
+            throw WUPException(cat("Could not map ", filepath));
+        }
+
+        _data = (const uint8_t *) data;
+
+        try
+        {
+            validate();
+        }
+        catch (WUPException &)
+        {
+            munmap((void*) _data, _size);
+            close(_fd);
+            throw;
+        }
+
+        _header    = (const Header *) _data;
+        _shuffling = (const uint32_t *) (_data + _header->shufflingOffset);
+        _labels    = (const int32_t *) (_data + _header->labelsOffset);
+        _rams      = (const RamEntry *) (_data + _header->ramsOffset);
+
+        _lastRamBits = _header->numInputBits -
+                (_header->numRams - 1) * _header->numRamBits;
+
+        _shifts.resize(_header->numRams);
+        for (int r=0;r<_header->numRams;++r)
+        {
+            _shifts[r] = 64;
+            for (uint64_t c=_rams[r].capacity; c>1; c>>=1)
+                --_shifts[r];
+        }
+
+        _activations.resize(math::max(_header->numClasses, 1), 0);
+    }
+
+    ~MappedWisard()
+    {
+        munmap((void*) _data, _size);
+        close(_fd);
+    }
+
+    // Writes model into filepath using the mapped layout
+    template <bool IgnoreZeroAddress, typename Ram>
+    static void
+    convert(const BaseWisard<BinaryDecoder, IgnoreZeroAddress, Ram> & model,
+        const std::string & filepath)
+    {
+        if (model._numRamBits >= 64)
+            throw WUPException("MappedWisard supports RAMs with up to 63 bits");
+
+        const int numClasses = model.numDiscriminators();
+        const int slotSize = align(sizeof(uint64_t) + sizeof(int32_t) * numClasses);
+
+        // Classes are renumbered keeping the order of the inner targets
+        std::vector<int> slotOf(model._activationsCapacity, -1);
+        std::vector<int32_t> labels;
+
+        for (auto & pair : model._innerToOutter)
+        {
+            slotOf[pair.first] = labels.size();
+            labels.push_back(pair.second);
+        }
+
+        Header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "WUPMWIS", 8);
+        header.version = Version;
+        header.byteOrder = 0x01020304;
+        header.numInputBits = model._numInputBits;
+        header.numRamBits = model._numRamBits;
+        header.numRams = model._numRams;
+        header.numClasses = numClasses;
+        header.maxBleaching = model._maxBleaching;
+        header.slotSize = slotSize;
+        header.shufflingOffset = align(sizeof(Header));
+        header.labelsOffset = align(header.shufflingOffset + sizeof(uint32_t) * header.numInputBits);
+        header.ramsOffset = align(header.labelsOffset + sizeof(int32_t) * numClasses);
+
+        std::vector<RamEntry> rams(header.numRams);
+        uint64_t offset = header.ramsOffset + sizeof(RamEntry) * header.numRams;
+
+        for (int r=0;r<header.numRams;++r)
+        {
+            uint64_t capacity = 16;
+            while (capacity < model._rams[r].numAddresses() * 2)
+                capacity *= 2;
+
+            rams[r].offset = offset;
+            rams[r].capacity = capacity;
+            offset += capacity * slotSize;
+        }
+
+        header.fileSize = offset;
+
+        FILE * file = fopen(filepath.c_str(), "wb");
+        if (file == NULL)
+            throw WUPException(cat("Could not create ", filepath));
+
+        std::vector<uint8_t> block;
+
+        block.assign(header.ramsOffset, 0);
+        memcpy(&block[0], &header, sizeof(header));
+        for (int i=0;i!=header.numInputBits;++i)
+            ((uint32_t *) &block[header.shufflingOffset])[i] = model._shuffling[i];
+        if (numClasses != 0)
+            memcpy(&block[header.labelsOffset], labels.data(), sizeof(int32_t) * numClasses);
+
+        write(file, block);
+
+        block.assign(sizeof(RamEntry) * header.numRams, 0);
+        if (header.numRams != 0)
+            memcpy(&block[0], rams.data(), block.size());
+
+        write(file, block);
+
+        for (int r=0;r<header.numRams;++r)
+        {
+            const uint64_t capacity = rams[r].capacity;
+            const uint64_t mask = capacity - 1;
+
+            int shift = 64;
+            for (uint64_t c=capacity; c>1; c>>=1)
+                --shift;
+
+            block.assign(capacity * slotSize, 0);
+            for (uint64_t s=0;s!=capacity;++s)
+                *(uint64_t *) &block[s * slotSize] = empty();
+
+            model._rams[r].forEach([&](const uint64_t & k,
+                    const int * const counters, const int classes)
+            {
+                uint64_t s = mixBits(k) >> shift;
+                while (*(uint64_t *) &block[s * slotSize] != empty())
+                    s = (s+1) & mask;
+
+                *(uint64_t *) &block[s * slotSize] = k;
+                int32_t * const hits = (int32_t *) &block[s * slotSize + sizeof(uint64_t)];
+
+                const int n = math::min(classes, int(slotOf.size()));
+                for (int i=0;i!=n;++i)
+                    if (slotOf[i] != -1)
+                        hits[slotOf[i]] = counters[i];
+            });
+
+            write(file, block);
+        }
+
+        fclose(file);
+    }
+
+    // Converts a file written by Wisard::exportTo
+    static void
+    convert(IntReader & reader, const std::string & filepath)
+    {
+        FlatWisard model(reader);
+        convert(model, filepath);
+    }
+
+    int
+    numDiscriminators() const
+    {
+        return _header->numClasses;
+    }
+
+    int
+    numRamBits() const
+    {
+        return _header->numRamBits;
+    }
+
+    int
+    numRams() const
+    {
+        return _header->numRams;
+    }
+
+    int
+    numInputBits() const
+    {
+        return _header->numInputBits;
+    }
+
+    template <typename Retina>
+    int readCounts(const Retina & retina)
+    {
+        if (numDiscriminators() == 0)
+            return _ranking.reset();
+
+        clearActivations();
+
+        for (int r=0;r<numRams();++r)
+        {
+            const int32_t * const hits = find(r, address(retina, r));
+
+            if (hits != NULL)
+                for (int i=0;i!=numDiscriminators();++i)
+                    _activations[i] += hits[i];
+        }
+
+        return _labels[_ranking.select(_activations.data(), numDiscriminators())];
+    }
+
+    template <typename Retina>
+    int readBinary(const Retina & retina, const int threshold=1)
+    {
+        if (numDiscriminators() == 0)
+            return _ranking.reset();
+
+        clearActivations();
+
+        for (int r=0;r<numRams();++r)
+        {
+            const int32_t * const hits = find(r, address(retina, r));
+
+            if (hits != NULL)
+                for (int i=0;i!=numDiscriminators();++i)
+                    _activations[i] += hits[i] >= threshold;
+        }
+
+        return _labels[_ranking.select(_activations.data(), numDiscriminators())];
+    }
+
+    template <typename Retina>
+    int readBleaching(const Retina & retina, const int step=1,
+        const float minConfidence=0.0)
+    {
+        if (numDiscriminators() == 0)
+            return _ranking.reset();
+
+        if (step <= 0)
+            throw WUPException("step must be larger than 0");
+
+        if (minConfidence < 0.0 || minConfidence > 1.0)
+            throw WUPException("minConfidence must be between 0.0 and 1.0");
+
+        _hits.clear();
+
+        for (int r=0;r<numRams();++r)
+        {
+            const int32_t * const hits = find(r, address(retina, r));
+
+            if (hits != NULL)
+                for (int i=0;i!=numDiscriminators();++i)
+                    if (hits[i] != 0)
+                        _hits.push_back(std::make_pair(int(hits[i]), i));
+        }
+
+        std::sort(_hits.begin(), _hits.end());
+
+        const int predicted = _ranking.bleach(_hits, _activations.data(),
+                numDiscriminators(), _header->maxBleaching, step, minConfidence);
+
+        return _labels[predicted];
+    }
+
+    float
+    getConfidence() const
+    {
+        return _ranking.confidence;
+    }
+
+    int
+    getExcitation(const int target) const
+    {
+        for (int i=0;i!=numDiscriminators();++i)
+            if (_labels[i] == target)
+                return _activations[i];
+
+        return 0;
+    }
+
+    int
+    getFirstBestPrediction() const
+    {
+        return _ranking.k1 == -1 ? -1 : _labels[_ranking.k1];
+    }
+
+    int
+    getSecondBestPrediction() const
+    {
+        return _ranking.k2 == -1 ? -1 : _labels[_ranking.k2];
+    }
+
+    int
+    getThirdBestPrediction() const
+    {
+        return _ranking.k3 == -1 ? -1 : _labels[_ranking.k3];
+    }
+
+private:
+
+    MappedWisard(const MappedWisard &);
+
+    MappedWisard & operator=(const MappedWisard &);
+
+    static uint64_t
+    empty()
+    {
+        return ~uint64_t(0);
+    }
+
+    static uint64_t
+    align(const uint64_t offset)
+    {
+        return (offset + 7) & ~uint64_t(7);
+    }
+
+    static void
+    write(FILE * const file, const std::vector<uint8_t> & block)
+    {
+        if (!block.empty() && fwrite(block.data(), 1, block.size(), file) != block.size())
+        {
+            fclose(file);
+            throw WUPException("Could not write the mapped WiSARD file");
+        }
+    }
+
+    // True when count items of itemSize bytes starting at offset are inside
+    // the file, without overflowing
+    bool
+    inside(const uint64_t offset, const uint64_t count, const uint64_t itemSize) const
+    {
+        if (count != 0 && itemSize > _size / count)
+            return false;
+
+        return offset <= _size - count * itemSize;
+    }
+
+    // The only guard against corrupted files, every field used by find and
+    // address is checked here, before anything is read through it
+    void
+    validate() const
+    {
+        const Header * const h = (const Header *) _data;
+
+        if (memcmp(h->magic, "WUPMWIS", 8) != 0)
+            throw WUPException("Invalid mapped WiSARD file");
+
+        if (h->version != Version)
+            throw WUPException(cat("Unsupported mapped WiSARD version ", h->version));
+
+        if (h->byteOrder != 0x01020304)
+            throw WUPException("Mapped WiSARD file has a different byte order");
+
+        if (h->fileSize != _size)
+            throw WUPException("Mapped WiSARD file is truncated");
+
+        // Same limits as convert, the key of an empty slot is never an address
+        if (h->numRamBits < 1 || h->numRamBits > 63)
+            throw WUPException(cat("Invalid number of RAM bits in mapped WiSARD file: ",
+                    h->numRamBits));
+
+        if (h->numInputBits < 1 || h->numRams < 1 ||
+                int64_t(h->numRams - 1) * h->numRamBits >= h->numInputBits ||
+                int64_t(h->numRams) * h->numRamBits < h->numInputBits)
+            throw WUPException("Mapped WiSARD file has inconsistent input and RAM sizes");
+
+        if (h->numClasses < 0 || h->maxBleaching < 0 || h->slotSize % 8 != 0 ||
+                h->slotSize < int64_t(sizeof(uint64_t)) + int64_t(sizeof(int32_t)) * h->numClasses)
+            throw WUPException("Mapped WiSARD file has an invalid slot layout");
+
+        if (h->shufflingOffset % sizeof(uint32_t) != 0 ||
+                !inside(h->shufflingOffset, h->numInputBits, sizeof(uint32_t)) ||
+                h->labelsOffset % sizeof(int32_t) != 0 ||
+                !inside(h->labelsOffset, h->numClasses, sizeof(int32_t)) ||
+                h->ramsOffset % 8 != 0 ||
+                !inside(h->ramsOffset, h->numRams, sizeof(RamEntry)))
+            throw WUPException("Mapped WiSARD file has sections outside of it");
+
+        const uint32_t * const shuffling = (const uint32_t *) (_data + h->shufflingOffset);
+
+        for (int i=0;i!=h->numInputBits;++i)
+            if (shuffling[i] >= uint32_t(h->numInputBits))
+                throw WUPException(cat("Invalid input index in mapped WiSARD file: ",
+                        shuffling[i]));
+
+        const RamEntry * const rams = (const RamEntry *) (_data + h->ramsOffset);
+
+        for (int r=0;r<h->numRams;++r)
+            if (rams[r].capacity < 2 || (rams[r].capacity & (rams[r].capacity - 1)) != 0 ||
+                    rams[r].offset % 8 != 0 ||
+                    !inside(rams[r].offset, rams[r].capacity, h->slotSize))
+                throw WUPException(cat("Invalid table of RAM ", r, " in mapped WiSARD file"));
+    }
+
+    template <typename Retina>
+    uint64_t
+    address(const Retina & retina, const int r) const
+    {
+        const uint32_t * const indexes = _shuffling + size_t(r) * numRamBits();
+        const int bits = r == numRams() - 1 ? _lastRamBits : numRamBits();
+
+        uint64_t k = 0;
+
+        for (int i=0;i!=bits;++i)
+            k |= uint64_t(retina[indexes[i]] != 0) << i;
+
+        return k;
+    }
+
+    const int32_t *
+    find(const int r, const uint64_t k) const
+    {
+        const RamEntry & ram = _rams[r];
+        const uint8_t * const table = _data + ram.offset;
+        const uint64_t mask = ram.capacity - 1;
+        const int slotSize = _header->slotSize;
+
+        // Probes at most every slot once, a corrupted table may have no
+        // empty slot
+        uint64_t s = mixBits(k) >> _shifts[r];
+
+        for (uint64_t i=0;i!=ram.capacity;++i,s=(s+1)&mask)
+        {
+            const uint64_t key = *(const uint64_t *) (table + s * slotSize);
+
+            if (key == k)
+                return (const int32_t *) (table + s * slotSize + sizeof(uint64_t));
+
+            if (key == empty())
+                return NULL;
+        }
+
+        return NULL;
+    }
+
+    void
+    clearActivations()
+    {
+        for (auto & a : _activations)
+            a = 0;
+    }
+
+private:
+
+    int _fd;
+
+    const uint8_t * _data;
+
+    size_t _size;
+
+    const Header * _header;
+
+    const uint32_t * _shuffling;
+
+    const int32_t * _labels;
+
+    const RamEntry * _rams;
+
+    int _lastRamBits;
+
+    std::vector<int> _shifts;
+
+    std::vector<int> _activations;
+
+    std::vector<std::pair<int, int> > _hits;
+
+    Ranking _ranking;
+
+};
+
+} /* wup */
+
+#endif /* __WUP_MAPPEDWISARD_HPP */
@@ -0,0 +1,277 @@
+#ifndef __WUP_RAMS_AUTORAM_HPP
+#define __WUP_RAMS_AUTORAM_HPP
+
+#include <climits>
+
+#include <wup/common/io.hpp>
+#include <wup/models/rams/denseram.hpp>
+#include <wup/models/rams/flatram.hpp>
+
+// Maximum amount of bytes that all dense RAMs of a model may use together
+#ifndef WUP_DENSE_RAM_BUDGET
+#define WUP_DENSE_RAM_BUDGET (512ul * 1024ul * 1024ul)
+#endif
+
+namespace wup {
+
+// Picks the storage of each RAM from the address width and the number of
+// classes. Small address spaces use a DenseRam while the counters of all RAMs
+// fit in WUP_DENSE_RAM_BUDGET, everything else goes to a FlatRam. A dense RAM
+// that would outgrow its share of the budget when new classes arrive is
+// migrated to a FlatRam, and so is one that prune leaves with fewer counters
+// than a FlatRam would hold in the same space.
+template <typename Decoder>
+class AutoRam {
+public:
+
+    typedef typename Decoder::key_type Key;
+
+    AutoRam() :
+        _isDense(false),
+        _budget(0)
+    {
+
+    }
+
+    void
+    setup(const Decoder & decoder, const int numClasses, const int numRams)
+    {
+        _budget = WUP_DENSE_RAM_BUDGET / math::max(numRams, 1);
+
+        _isDense = decoder.keyBits() <= WUP_DENSE_RAM_MAX_BITS &&
+                DenseRam<Decoder>::requiredBytes(decoder.keyBits(),
+                        math::max(numClasses, 1)) <= _budget;
+
+        if (_isDense)
+            _dense.setup(decoder, numClasses, numRams);
+        else
+            _flat.setup(decoder, numClasses, numRams);
+    }
+
+    bool
+    isDense() const
+    {
+        return _isDense;
+    }
+
+    int
+    learn(const Decoder & decoder, const int target, const int weight=1)
+    {
+        if (_isDense && target >= _dense.numClasses())
+            checkBudget(decoder, target + 1);
+
+        return _isDense
+                ? _dense.learn(decoder, target, weight)
+                : _flat.learn(decoder, target, weight);
+    }
+
+    void
+    forget(const Decoder & decoder, const int target)
+    {
+        if (_isDense)
+            _dense.forget(decoder, target);
+        else
+            _flat.forget(decoder, target);
+    }
+
+    void
+    erase(const Decoder & decoder, const int target)
+    {
+        if (_isDense)
+            _dense.erase(decoder, target);
+        else
+            _flat.erase(decoder, target);
+    }
+
+    void
+    forgetClass(const int target)
+    {
+        if (_isDense)
+            _dense.forgetClass(target);
+        else
+            _flat.forgetClass(target);
+    }
+
+    void
+    prefetch(const Decoder & decoder) const
+    {
+        if (_isDense)
+            _dense.prefetch(decoder);
+        else
+            _flat.prefetch(decoder);
+    }
+
+    template <typename F>
+    void
+    read(const Decoder & decoder, F f) const
+    {
+        if (_isDense)
+            _dense.read(decoder, f);
+        else
+            _flat.read(decoder, f);
+    }
+
+    // Calls f(key, counters, numClasses) for each address in use
+    template <typename F>
+    void
+    forEach(F f) const
+    {
+        if (_isDense)
+            _dense.forEach(f);
+        else
+            _flat.forEach(f);
+    }
+
+    // Adds the counters of other, class i of other becomes classMap[i].
+    // Returns the largest counter that was changed.
+    int
+    merge(const Decoder & decoder, const AutoRam & other,
+        const std::vector<int> & classMap)
+    {
+        if (_isDense)
+        {
+            int classes = 0;
+            for (const int target : classMap)
+                classes = math::max(classes, target + 1);
+
+            if (classes > _dense.numClasses())
+                checkBudget(decoder, classes);
+        }
+
+        return _isDense
+                ? _dense.merge(decoder, other, classMap)
+                : _flat.merge(decoder, other, classMap);
+    }
+
+    size_t
+    numAddresses() const
+    {
+        return _isDense ? _dense.numAddresses() : _flat.numAddresses();
+    }
+
+    size_t
+    prune(const int minCount)
+    {
+        if (!_isDense)
+            return _flat.prune(minCount);
+
+        // The dense array is only released once empty, so the counters that
+        // stay move to a FlatRam when it is the smaller of the two
+        size_t addresses = 0;
+
+        _dense.forEach([&addresses, minCount](const Key &, const int * c, const int classes)
+        {
+            for (int i=0; i!=classes; ++i)
+            {
+                if (c[i] != 0 && c[i] >= minCount)
+                {
+                    ++addresses;
+                    break;
+                }
+            }
+        });
+
+        if (addresses == 0 || FlatRam<Decoder>::requiredBytes(addresses,
+                _dense.numClasses()) >= _dense.numBytes())
+            return _dense.prune(minCount);
+
+        const size_t before = numBytes();
+        toFlat(_dense.numClasses(), minCount);
+        return before - numBytes();
+    }
+
+    size_t
+    numBytes() const
+    {
+        return _isDense ? _dense.numBytes() : _flat.numBytes();
+    }
+
+    // Bytes left by a prune that keeps the given number of addresses and
+    // positions, see prune
+    size_t
+    prunedBytes(const size_t addresses, const long positions) const
+    {
+        return _isDense
+                ? math::min(_dense.prunedBytes(addresses, positions),
+                        FlatRam<Decoder>::requiredBytes(addresses, _dense.numClasses()))
+                : _flat.prunedBytes(addresses, positions);
+    }
+
+    // Largest value a counter holds
+    static int
+    maxCounter()
+    {
+        return INT_MAX;
+    }
+
+    long
+    numPositions() const
+    {
+        return _isDense ? _dense.numPositions() : _flat.numPositions();
+    }
+
+    void
+    exportTo(IntWriter & writer, Decoder & decoder) const
+    {
+        if (_isDense)
+            _dense.exportTo(writer, decoder);
+        else
+            _flat.exportTo(writer, decoder);
+    }
+
+    void
+    importFrom(IntReader & reader, Decoder & decoder)
+    {
+        if (_isDense)
+            _dense.importFrom(reader, decoder);
+        else
+            _flat.importFrom(reader, decoder);
+    }
+
+private:
+
+    void
+    checkBudget(const Decoder & decoder, const int numClasses)
+    {
+        const int grown = math::max(numClasses, _dense.numClasses() * 2);
+
+        if (DenseRam<Decoder>::requiredBytes(decoder.keyBits(), grown) <= _budget)
+            return;
+
+        toFlat(grown, 1);
+    }
+
+    // Moves the counters from minCount up to a FlatRam with room for
+    // numClasses and releases the dense array
+    void
+    toFlat(const int numClasses, const int minCount)
+    {
+        FlatRam<Decoder> & flat = _flat;
+        flat.reserve(numClasses);
+
+        _dense.forEach([&flat, minCount](const Key & k, const int * c, const int classes)
+        {
+            for (int i=0; i!=classes; ++i)
+                if (c[i] != 0 && c[i] >= minCount)
+                    flat.assign(k, i, c[i]);
+        });
+
+        _dense = DenseRam<Decoder>();
+        _isDense = false;
+    }
+
+private:
+
+    DenseRam<Decoder> _dense;
+
+    FlatRam<Decoder> _flat;
+
+    bool _isDense;
+
+    size_t _budget;
+
+};
+
+} /* wup */
+
+#endif /* __WUP_RAMS_AUTORAM_HPP */
@@ -0,0 +1,280 @@
+#ifndef __WUP_RAMS_COMPACTCODEC_HPP
+#define __WUP_RAMS_COMPACTCODEC_HPP
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+#include <wup/common/bits.hpp>
+#include <wup/common/exceptions.hpp>
+
+namespace wup {
+
+// Converts the records written by the exportTo method of the RAM storages
+// into the compact representation used by BaseWisard::exportCompactTo, and
+// back. The records of a RAM are
+//
+//     numKeys, { pattern[patternSize], length, { class, hits }[length] }[numKeys]
+//
+// In the compact form the symbols of a pattern are packed with the number of
+// bits of the largest one, keys are sorted and stored as the difference to
+// the previous key, and every other number is a varint.
+class CompactRamCodec {
+public:
+
+    static void
+    encode(const std::vector<int32_t> & records, const uint patternSize,
+        std::vector<uint8_t> & out)
+    {
+        const int32_t * const begin = records.data();
+        const int32_t * const end = begin + records.size();
+
+        if (begin == end)
+            throw WUPException("Empty RAM records");
+
+        const uint numKeys = uint(begin[0]);
+
+        // Finds where each key starts and whether negative symbols exist
+        std::vector<size_t> starts(numKeys);
+        bool negative = false;
+
+        const int32_t * p = begin + 1;
+        for (uint k=0; k!=numKeys; ++k)
+        {
+            if (end - p < ptrdiff_t(patternSize) + 1)
+                throw WUPException("Truncated RAM records");
+
+            starts[k] = p - begin;
+
+            for (uint i=0; i!=patternSize; ++i)
+                if (p[i] < 0)
+                    negative = true;
+
+            const int32_t length = p[patternSize];
+
+            if (length < 0 || end - p < ptrdiff_t(patternSize) + 1 + 2 * length)
+                throw WUPException("Truncated RAM records");
+
+            p += patternSize + 1 + 2 * length;
+        }
+
+        uint32_t largest = 0;
+        for (uint k=0; k!=numKeys; ++k)
+            for (uint i=0; i!=patternSize; ++i)
+                largest = std::max(largest, symbol(begin[starts[k] + i], negative));
+
+        uint width = 0;
+        while (width != 32 && (largest >> width) != 0)
+            ++width;
+
+        const uint numLimbs = limbsFor(patternSize, width);
+
+        std::vector<uint64_t> keys(size_t(numKeys) * numLimbs, 0);
+
+        for (uint k=0; k!=numKeys; ++k)
+            for (uint i=0; i!=patternSize; ++i)
+                pack(&keys[size_t(k) * numLimbs], i * width, width,
+                        symbol(begin[starts[k] + i], negative));
+
+        std::vector<uint> order(numKeys);
+        for (uint k=0; k!=numKeys; ++k)
+            order[k] = k;
+
+        std::sort(order.begin(), order.end(), [&keys, numLimbs](const uint a, const uint b)
+        {
+            const uint64_t * const ka = &keys[size_t(a) * numLimbs];
+            const uint64_t * const kb = &keys[size_t(b) * numLimbs];
+
+            for (uint j=numLimbs; j--!=0;)
+                if (ka[j] != kb[j])
+                    return ka[j] < kb[j];
+
+            return false;
+        });
+
+        putVarint(out, numKeys);
+        putVarint(out, width);
+        putVarint(out, negative ? 1 : 0);
+
+        std::vector<uint64_t> previous(numLimbs, 0);
+
+        for (uint k : order)
+        {
+            const uint64_t * const key = &keys[size_t(k) * numLimbs];
+
+            if (numLimbs == 1)
+            {
+                putVarint(out, key[0] - previous[0]);
+            }
+            else
+            {
+                // Limbs shared with the previous key, from the most
+                // significant one, then the difference of the first limb
+                // that changed and the remaining limbs as they are
+                uint shared = 0;
+                while (shared != numLimbs && key[numLimbs - 1 - shared] ==
+                        previous[numLimbs - 1 - shared])
+                    ++shared;
+
+                putVarint(out, shared);
+
+                if (shared != numLimbs)
+                {
+                    const uint j = numLimbs - 1 - shared;
+                    putVarint(out, key[j] - previous[j]);
+
+                    for (uint l=j; l--!=0;)
+                        putVarint(out, key[l]);
+                }
+            }
+
+            std::copy(key, key + numLimbs, previous.begin());
+
+            const int32_t * const boxes = begin + starts[k] + patternSize;
+            const int32_t length = boxes[0];
+
+            putVarint(out, uint32_t(length));
+
+            uint32_t lastClass = 0;
+            for (int32_t t=0; t!=length; ++t)
+            {
+                const uint32_t target = uint32_t(boxes[1 + 2 * t]);
+
+                putVarint(out, uint32_t(target - lastClass));
+                putVarint(out, uint32_t(boxes[2 + 2 * t]));
+
+                lastClass = target;
+            }
+        }
+    }
+
+    static void
+    decode(const uint8_t * const data, const size_t size, const uint patternSize,
+        std::vector<int32_t> & records)
+    {
+        const uint8_t * p = data;
+        const uint8_t * const end = data + size;
+
+        const uint numKeys  = uint(next(p, end));
+        const uint width    = uint(next(p, end));
+        const bool negative = next(p, end) != 0;
+
+        if (width > 32)
+            throw WUPException("Corrupted compact RAM");
+
+        const uint numLimbs = limbsFor(patternSize, width);
+        const uint64_t mask = width == 0 ? 0 : (~uint64_t(0)) >> (64 - width);
+
+        std::vector<uint64_t> key(numLimbs, 0);
+
+        records.clear();
+        records.push_back(int32_t(numKeys));
+
+        for (uint k=0; k!=numKeys; ++k)
+        {
+            if (numLimbs == 1)
+            {
+                key[0] += next(p, end);
+            }
+            else
+            {
+                const uint64_t shared = next(p, end);
+
+                if (shared > numLimbs)
+                    throw WUPException("Corrupted compact RAM");
+
+                if (shared != numLimbs)
+                {
+                    const uint j = numLimbs - 1 - uint(shared);
+                    key[j] += next(p, end);
+
+                    for (uint l=j; l--!=0;)
+                        key[l] = next(p, end);
+                }
+            }
+
+            for (uint i=0; i!=patternSize; ++i)
+            {
+                const uint32_t s = uint32_t(unpack(key.data(), i * width, width) & mask);
+                records.push_back(negative ? int32_t((s >> 1) ^ -(s & 1)) : int32_t(s));
+            }
+
+            const uint32_t length = uint32_t(next(p, end));
+            records.push_back(int32_t(length));
+
+            uint32_t lastClass = 0;
+            for (uint32_t t=0; t!=length; ++t)
+            {
+                lastClass += uint32_t(next(p, end));
+
+                records.push_back(int32_t(lastClass));
+                records.push_back(int32_t(uint32_t(next(p, end))));
+            }
+        }
+
+        if (p != end)
+            throw WUPException("Corrupted compact RAM");
+    }
+
+private:
+
+    static uint32_t
+    symbol(const int32_t value, const bool negative)
+    {
+        // Zig-zag keeps small negative symbols small
+        return negative
+                ? (uint32_t(value) << 1) ^ uint32_t(value >> 31)
+                : uint32_t(value);
+    }
+
+    static uint
+    limbsFor(const uint patternSize, const uint width)
+    {
+        return std::max(1u, (patternSize * width + 63) / 64);
+    }
+
+    static void
+    pack(uint64_t * const limbs, const uint bit, const uint width, const uint32_t value)
+    {
+        if (width == 0)
+            return;
+
+        const uint offset = bit & 63;
+
+        limbs[bit >> 6] |= uint64_t(value) << offset;
+
+        if (offset + width > 64)
+            limbs[(bit >> 6) + 1] |= uint64_t(value) >> (64 - offset);
+    }
+
+    static uint64_t
+    unpack(const uint64_t * const limbs, const uint bit, const uint width)
+    {
+        if (width == 0)
+            return 0;
+
+        const uint offset = bit & 63;
+        uint64_t value = limbs[bit >> 6] >> offset;
+
+        if (offset + width > 64)
+            value |= limbs[(bit >> 6) + 1] << (64 - offset);
+
+        return value;
+    }
+
+    static uint64_t
+    next(const uint8_t *& p, const uint8_t * const end)
+    {
+        uint64_t v;
+
+        if (!getVarint(p, end, v))
+            throw WUPException("Corrupted compact RAM");
+
+        return v;
+    }
+
+};
+
+} /* wup */
+
+#endif /* __WUP_RAMS_COMPACTCODEC_HPP */
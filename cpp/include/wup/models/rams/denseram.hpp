@@ -0,0 +1,357 @@
+#ifndef __WUP_RAMS_DENSERAM_HPP
+#define __WUP_RAMS_DENSERAM_HPP
+
+#include <vector>
+#include <climits>
+#include <stdint.h>
+
+#include <wup/common/io.hpp>
+#include <wup/common/bits.hpp>
+#include <wup/common/math.hpp>
+#include <wup/common/exceptions.hpp>
+
+// Largest address width accepted by DenseRam
+#ifndef WUP_DENSE_RAM_MAX_BITS
+#define WUP_DENSE_RAM_MAX_BITS 24
+#endif
+
+namespace wup {
+
+// Direct addressed RAM storage. The packed key produced by the decoder is
+// used as an index into a preallocated array holding the counters of every
+// possible address, so there is no hashing and no probing. Only suitable for
+// small address spaces, see AutoRam for the automatic selection.
+//
+// Layout: counters[key * numClasses + target]
+template <typename Decoder>
+class DenseRam {
+public:
+
+    typedef typename Decoder::key_type Key;
+
+    DenseRam() :
+        _keyBits(0),
+        _classes(0)
+    {
+
+    }
+
+    void
+    setup(const Decoder & decoder, const int numClasses, const int /*numRams*/)
+    {
+        if (decoder.keyBits() > WUP_DENSE_RAM_MAX_BITS)
+            throw WUPException(cat("DenseRam addresses are limited to ",
+                    WUP_DENSE_RAM_MAX_BITS, " bits, this decoder requires ",
+                    decoder.keyBits()));
+
+        _keyBits = decoder.keyBits();
+
+        if (numClasses > _classes)
+            resizeClasses(numClasses);
+    }
+
+    // Adds weight to the counter of target at the address held by decoder
+    // and returns its new value
+    int
+    learn(const Decoder & decoder, const int target, const int weight=1)
+    {
+        if (target >= _classes)
+            resizeClasses(math::max(target + 1, _classes * 2));
+
+        if (_counters.empty())
+            _counters.resize(numKeys() * _classes, 0);
+
+        return _counters[size_t(decoder.key()) * _classes + target] += weight;
+    }
+
+    void
+    forget(const Decoder & decoder, const int target)
+    {
+        if (target >= _classes || _counters.empty())
+            return;
+
+        int & hits = _counters[size_t(decoder.key()) * _classes + target];
+
+        if (hits != 0)
+            --hits;
+    }
+
+    // Zeroes the counter of target at the address held by decoder
+    void
+    erase(const Decoder & decoder, const int target)
+    {
+        if (target < _classes && !_counters.empty())
+            _counters[size_t(decoder.key()) * _classes + target] = 0;
+    }
+
+    void
+    forgetClass(const int target)
+    {
+        if (target >= _classes)
+            return;
+
+        for (size_t i=target; i<_counters.size(); i+=_classes)
+            _counters[i] = 0;
+    }
+
+    // Starts loading the counters of the address held by decoder
+    void
+    prefetch(const Decoder & decoder) const
+    {
+        if (!_counters.empty())
+            prefetchLine(&_counters[size_t(decoder.key()) * _classes]);
+    }
+
+    // Calls f(target, hits) for each class stored at the address held by decoder
+    template <typename F>
+    void
+    read(const Decoder & decoder, F f) const
+    {
+        if (_counters.empty())
+            return;
+
+        const int * const c = &_counters[size_t(decoder.key()) * _classes];
+
+        for (int i=0; i!=_classes; ++i)
+            if (c[i] != 0)
+                f(i, c[i]);
+    }
+
+    // Calls f(key, counters, numClasses) for each address with at least one
+    // non zero counter
+    template <typename F>
+    void
+    forEach(F f) const
+    {
+        for (size_t k=0; k<_counters.size(); k+=_classes)
+        {
+            const int * const c = &_counters[k];
+
+            for (int i=0; i!=_classes; ++i)
+            {
+                if (c[i] != 0)
+                {
+                    f(Key(k / _classes), c, _classes);
+                    break;
+                }
+            }
+        }
+    }
+
+    // Adds the counters of other, any storage with forEach, class i of
+    // other becomes classMap[i]. Returns the largest counter that was changed.
+    template <typename Other>
+    int
+    merge(const Decoder & /*decoder*/, const Other & other,
+        const std::vector<int> & classMap)
+    {
+        int largest = 0;
+
+        other.forEach([&](const Key & k, const int * const c, const int classes)
+        {
+            for (int i=0; i!=classes; ++i)
+            {
+                if (c[i] == 0)
+                    continue;
+
+                const int target = classMap[i];
+
+                if (target >= _classes)
+                    resizeClasses(math::max(target + 1, _classes * 2));
+
+                if (_counters.empty())
+                    _counters.resize(numKeys() * _classes, 0);
+
+                const int hits = _counters[size_t(k) * _classes + target] += c[i];
+
+                if (hits > largest)
+                    largest = hits;
+            }
+        });
+
+        return largest;
+    }
+
+    size_t
+    numAddresses() const
+    {
+        size_t sum = 0;
+        forEach([&sum](const Key &, const int *, const int) { ++sum; });
+        return sum;
+    }
+
+    // Clears the counters below minCount, the array is only released when
+    // no counter is left. Returns the bytes released.
+    size_t
+    prune(const int minCount)
+    {
+        bool empty = true;
+
+        for (int & hits : _counters)
+        {
+            if (hits < minCount)
+                hits = 0;
+            else if (hits != 0)
+                empty = false;
+        }
+
+        if (!empty)
+            return 0;
+
+        const size_t before = numBytes();
+        std::vector<int>().swap(_counters);
+        return before;
+    }
+
+    size_t
+    numBytes() const
+    {
+        return _counters.capacity() * sizeof(int);
+    }
+
+    // Bytes left by a prune that keeps the given number of addresses
+    size_t
+    prunedBytes(const size_t addresses, const long /*positions*/) const
+    {
+        return addresses == 0 ? 0 : numBytes();
+    }
+
+    // Largest value a counter holds
+    static int
+    maxCounter()
+    {
+        return INT_MAX;
+    }
+
+    long
+    numPositions() const
+    {
+        long sum = 0;
+        for (const int & hits : _counters)
+            if (hits != 0)
+                ++sum;
+        return sum;
+    }
+
+    // Bytes required by the counters of a RAM
+    static size_t
+    requiredBytes(const uint keyBits, const int numClasses)
+    {
+        return (size_t(1) << keyBits) * numClasses * sizeof(int);
+    }
+
+    size_t
+    numKeys() const
+    {
+        return size_t(1) << _keyBits;
+    }
+
+    int
+    numClasses() const
+    {
+        return _classes;
+    }
+
+    void
+    exportTo(IntWriter & writer, Decoder & decoder) const
+    {
+        int numKeys = numAddresses();
+        writer.put(numKeys);
+
+        forEach([&writer, &decoder](const Key & k, const int * c, const int classes)
+        {
+            // Rebuilds the pattern from the packed key, keeping the file
+            // format of MapRam
+            decoder.key(k);
+
+            for (uint i=0;i<decoder.patternSize();++i)
+                writer.put(decoder.pattern()[i]);
+
+            int length = 0;
+            for (int i=0; i!=classes; ++i)
+                if (c[i] != 0)
+                    ++length;
+
+            writer.put(length);
+
+            for (int i=0; i!=classes; ++i)
+            {
+                if (c[i] != 0)
+                {
+                    writer.put(i);
+                    writer.put(c[i]);
+                }
+            }
+        });
+    }
+
+    void
+    importFrom(IntReader & reader, Decoder & decoder)
+    {
+        int numKeys, length, discriminator, hits;
+
+        reader.get(numKeys);
+
+        for (int k=0; k<numKeys; ++k)
+        {
+            for (uint i=0;i<decoder.patternSize();++i)
+                reader.get(decoder.pattern()[i]);
+            decoder.updateHash();
+
+            reader.get(length);
+
+            for (int t=0; t!=length; ++t)
+            {
+                reader.get(discriminator);
+                reader.get(hits);
+                assign(decoder.key(), discriminator, hits);
+            }
+        }
+    }
+
+    // Sets the counter of target at a given key
+    void
+    assign(const Key & k, const int target, const int hits)
+    {
+        if (target >= _classes)
+            resizeClasses(target + 1);
+
+        if (_counters.empty())
+            _counters.resize(numKeys() * _classes, 0);
+
+        _counters[size_t(k) * _classes + target] = hits;
+    }
+
+private:
+
+    void
+    resizeClasses(const int classes)
+    {
+        if (!_counters.empty())
+        {
+            std::vector<int> counters(numKeys() * classes, 0);
+
+            for (size_t k=0; k!=numKeys(); ++k)
+                std::copy(&_counters[k * _classes],
+                          &_counters[k * _classes] + _classes,
+                          &counters[k * classes]);
+
+            _counters.swap(counters);
+        }
+
+        _classes = classes;
+    }
+
+private:
+
+    std::vector<int> _counters;
+
+    uint _keyBits;
+
+    int _classes;
+
+};
+
+} /* wup */
+
+#endif /* __WUP_RAMS_DENSERAM_HPP */
@@ -0,0 +1,593 @@
+#ifndef __WUP_RAMS_FLATRAM_HPP
+#define __WUP_RAMS_FLATRAM_HPP
+
+#include <vector>
+#include <cstring>
+#include <climits>
+#include <limits>
+#include <type_traits>
+#include <stdint.h>
+
+#include <wup/common/io.hpp>
+#include <wup/common/bits.hpp>
+#include <wup/common/math.hpp>
+#include <wup/common/exceptions.hpp>
+
+namespace wup {
+
+// Open addressing RAM storage. Addresses are the packed keys produced by the
+// decoder (Decoder::key()) and the class counters are stored inline, right
+// after the key, so a lookup touches a single slot of a contiguous table.
+//
+// Slot layout: [ Key key | int used | Counter counters[numClasses] ]
+//
+// Counter may be a narrower type, like uint8_t or uint16_t, to cut the size
+// of the table. Narrow counters saturate at their largest value, so reads
+// see at most maxCounter() hits and forget is not exact after that.
+template <typename Decoder, typename Counter=int>
+class FlatRam {
+public:
+
+    typedef typename Decoder::key_type Key;
+
+    static_assert(std::is_integral<Counter>::value && sizeof(Counter) <= sizeof(int),
+            "FlatRam counters must be integers not wider than int");
+
+    FlatRam() :
+        _capacity(0),
+        _size(0),
+        _classes(0),
+        _stride(0),
+        _shift(0)
+    {
+
+    }
+
+    // Hints the number of classes so that slots are created with the right
+    // amount of counters
+    void
+    setup(const Decoder & /*decoder*/, const int numClasses, const int /*numRams*/)
+    {
+        reserve(numClasses);
+    }
+
+    // Makes room for numClasses counters in every slot
+    void
+    reserve(const int numClasses)
+    {
+        if (numClasses > _classes)
+            resizeClasses(numClasses);
+    }
+
+    // Adds weight to the counter of target at the address held by decoder
+    // and returns its new value
+    int
+    learn(const Decoder & decoder, const int target, const int weight=1)
+    {
+        if (target >= _classes)
+            resizeClasses(math::max(target + 1, _classes * 2));
+
+        if (_capacity == 0)
+            allocate(decoder);
+
+        Counter & hits = counters(insert(decoder.key()))[target];
+        hits = saturate(int64_t(hits) + weight);
+
+        return hits;
+    }
+
+    void
+    forget(const Decoder & decoder, const int target)
+    {
+        if (target >= _classes)
+            return;
+
+        const long slot = find(decoder.key());
+
+        if (slot == -1)
+            return;
+
+        Counter & hits = counters(slot)[target];
+
+        if (hits != 0)
+            --hits;
+    }
+
+    // Zeroes the counter of target at the address held by decoder
+    void
+    erase(const Decoder & decoder, const int target)
+    {
+        if (target >= _classes)
+            return;
+
+        const long slot = find(decoder.key());
+
+        if (slot != -1)
+            counters(slot)[target] = 0;
+    }
+
+    void
+    forgetClass(const int target)
+    {
+        if (target >= _classes)
+            return;
+
+        for (size_t s=0; s!=_capacity; ++s)
+            if (used(s))
+                counters(s)[target] = 0;
+    }
+
+    // Starts loading the home slot of the address held by decoder
+    void
+    prefetch(const Decoder & decoder) const
+    {
+        if (_capacity != 0)
+            prefetchLine(&_data[home(decoder.key()) * _stride]);
+    }
+
+    // Calls f(target, hits) for each class stored at the address held by decoder
+    template <typename F>
+    void
+    read(const Decoder & decoder, F f) const
+    {
+        const long slot = find(decoder.key());
+
+        if (slot == -1)
+            return;
+
+        const Counter * const c = counters(slot);
+
+        for (int i=0; i!=_classes; ++i)
+            if (c[i] != 0)
+                f(i, int(c[i]));
+    }
+
+    // Calls f(key, counters, numClasses) for each address in the table
+    template <typename F>
+    void
+    forEach(F f) const
+    {
+        // Narrow counters are widened to int first
+        std::vector<int> widened(std::is_same<Counter, int>::value ? 0 : _classes);
+
+        for (size_t s=0; s!=_capacity; ++s)
+        {
+            if (!used(s))
+                continue;
+
+            if (widened.empty())
+            {
+                f(key(s), (const int*) counters(s), _classes);
+            }
+            else
+            {
+                std::copy(counters(s), counters(s) + _classes, widened.begin());
+                f(key(s), widened.data(), _classes);
+            }
+        }
+    }
+
+    // Sets the counter of target at a given key, used when migrating from
+    // other storages
+    void
+    assign(const Key & k, const int target, const int hits)
+    {
+        if (target >= _classes)
+            resizeClasses(target + 1);
+
+        if (_capacity == 0)
+            resizeTable(16);
+
+        counters(insert(k))[target] = saturate(hits);
+    }
+
+    // Adds the counters of other, any storage with forEach, class i of
+    // other becomes classMap[i]. Returns the largest counter that was changed.
+    template <typename Other>
+    int
+    merge(const Decoder & decoder, const Other & other,
+        const std::vector<int> & classMap)
+    {
+        int largest = 0;
+
+        other.forEach([&](const Key & k, const int * const c, const int classes)
+        {
+            if (_capacity == 0)
+                allocate(decoder);
+
+            for (int i=0; i!=classes; ++i)
+            {
+                if (c[i] == 0)
+                    continue;
+
+                const int target = classMap[i];
+
+                if (target >= _classes)
+                    resizeClasses(math::max(target + 1, _classes * 2));
+
+                Counter & counter = counters(insert(k))[target];
+                const int hits = saturate(int64_t(counter) + c[i]);
+                counter = hits;
+
+                if (hits > largest)
+                    largest = hits;
+            }
+        });
+
+        return largest;
+    }
+
+    size_t
+    numAddresses() const
+    {
+        return _size;
+    }
+
+    // Clears the counters below minCount and drops the addresses left
+    // empty, then shrinks the table to fit. Returns the bytes released.
+    size_t
+    prune(const int minCount)
+    {
+        const size_t before = numBytes();
+        const size_t size = _size;
+
+        for (size_t s=0; s!=_capacity; ++s)
+        {
+            if (!used(s))
+                continue;
+
+            Counter * const c = counters(s);
+            bool empty = true;
+
+            for (int i=0; i!=_classes; ++i)
+            {
+                if (int(c[i]) < minCount)
+                    c[i] = 0;
+                else if (c[i] != 0)
+                    empty = false;
+            }
+
+            if (empty)
+            {
+                used(s, false);
+                --_size;
+            }
+        }
+
+        if (_size == 0)
+        {
+            std::vector<uint8_t>().swap(_data);
+            _capacity = 0;
+        }
+        else if (_size != size)
+        {
+            // Rebuilding also restores the probe sequences broken above
+            resizeTable(requiredBytes(_size, _classes) / _stride);
+        }
+
+        return before - numBytes();
+    }
+
+    size_t
+    numBytes() const
+    {
+        return _data.capacity();
+    }
+
+    // Bytes left by a prune that keeps the given number of addresses
+    size_t
+    prunedBytes(const size_t addresses, const long /*positions*/) const
+    {
+        return addresses == _size ? numBytes() : requiredBytes(addresses, _classes);
+    }
+
+    // Bytes of a table sized by prune for the given number of addresses
+    static size_t
+    requiredBytes(const size_t addresses, const int numClasses)
+    {
+        if (addresses == 0)
+            return 0;
+
+        size_t capacity = 16;
+        while ((addresses + 1) * 10 > capacity * 7)
+            capacity *= 2;
+
+        return capacity * slotBytes(numClasses);
+    }
+
+    // Largest value a counter holds, learn stops counting there
+    static int
+    maxCounter()
+    {
+        return int(std::numeric_limits<Counter>::max());
+    }
+
+    long
+    numPositions() const
+    {
+        long sum = 0;
+
+        for (size_t s=0; s!=_capacity; ++s)
+        {
+            if (!used(s))
+                continue;
+
+            const Counter * const c = counters(s);
+
+            for (int i=0; i!=_classes; ++i)
+                if (c[i] != 0)
+                    ++sum;
+        }
+
+        return sum;
+    }
+
+    void
+    exportTo(IntWriter & writer, Decoder & decoder) const
+    {
+        int numKeys = _size;
+        writer.put(numKeys);
+
+        for (size_t s=0; s!=_capacity; ++s)
+        {
+            if (!used(s))
+                continue;
+
+            // Rebuilds the pattern from the packed key, keeping the file
+            // format of MapRam
+            decoder.key(key(s));
+
+            for (uint i=0;i<decoder.patternSize();++i)
+                writer.put(decoder.pattern()[i]);
+
+            const Counter * const c = counters(s);
+
+            int length = 0;
+            for (int i=0; i!=_classes; ++i)
+                if (c[i] != 0)
+                    ++length;
+
+            writer.put(length);
+
+            for (int i=0; i!=_classes; ++i)
+            {
+                if (c[i] != 0)
+                {
+                    writer.put(i);
+                    writer.put(int(c[i]));
+                }
+            }
+        }
+    }
+
+    void
+    importFrom(IntReader & reader, Decoder & decoder)
+    {
+        int numKeys, length;
+        std::vector<int> boxes;
+
+        reader.get(numKeys);
+
+        if (numKeys < 0)
+            throw WUPException("Invalid WiSARD file");
+
+        for (int k=0; k<numKeys; ++k)
+        {
+            for (uint i=0;i<decoder.patternSize();++i)
+                reader.get(decoder.pattern()[i]);
+            decoder.updateHash();
+
+            // setup reserved every class of the model, a slot holds at most
+            // one counter for each
+            reader.get(length);
+
+            if (length < 0 || length > _classes)
+                throw WUPException("Invalid WiSARD file");
+
+            boxes.resize(length * 2);
+
+            for (int t=0; t!=length*2; ++t)
+            {
+                reader.get(boxes[t]);
+
+                if (t % 2 == 0 && (boxes[t] < 0 || boxes[t] >= _classes))
+                    throw WUPException("Invalid WiSARD file");
+            }
+
+            if (_capacity == 0)
+                allocate(decoder);
+
+            Counter * const c = counters(insert(decoder.key()));
+
+            for (int t=0; t!=length*2; t+=2)
+                c[boxes[t]] = saturate(boxes[t+1]);
+        }
+    }
+
+private:
+
+    bool
+    used(const size_t slot) const
+    {
+        return *(const int*)(&_data[slot * _stride + sizeof(Key)]) != 0;
+    }
+
+    void
+    used(const size_t slot, const bool value)
+    {
+        *(int*)(&_data[slot * _stride + sizeof(Key)]) = value ? 1 : 0;
+    }
+
+    const Key &
+    key(const size_t slot) const
+    {
+        return *(const Key*)(&_data[slot * _stride]);
+    }
+
+    Key &
+    key(const size_t slot)
+    {
+        return *(Key*)(&_data[slot * _stride]);
+    }
+
+    const Counter *
+    counters(const size_t slot) const
+    {
+        return (const Counter*)(&_data[slot * _stride + sizeof(Key) + sizeof(int)]);
+    }
+
+    Counter *
+    counters(const size_t slot)
+    {
+        return (Counter*)(&_data[slot * _stride + sizeof(Key) + sizeof(int)]);
+    }
+
+    static Counter
+    saturate(const int64_t hits)
+    {
+        return hits <= 0 ? Counter(0)
+                : hits >= maxCounter() ? Counter(maxCounter())
+                : Counter(hits);
+    }
+
+    size_t
+    home(const Key & k) const
+    {
+        // Fibonacci hashing, keeps consecutive addresses apart
+        return size_t((uint64_t(k) * 0x9E3779B97F4A7C15ull) >> _shift);
+    }
+
+    long
+    find(const Key & k) const
+    {
+        if (_capacity == 0)
+            return -1;
+
+        const size_t mask = _capacity - 1;
+
+        for (size_t s=home(k); used(s); s=(s+1)&mask)
+            if (key(s) == k)
+                return long(s);
+
+        return -1;
+    }
+
+    size_t
+    insert(const Key & k)
+    {
+        size_t mask = _capacity - 1;
+        size_t s = home(k);
+
+        for (; used(s); s=(s+1)&mask)
+            if (key(s) == k)
+                return s;
+
+        // Keeps the load factor below 0.7
+        if ((_size + 1) * 10 > _capacity * 7)
+        {
+            resizeTable(_capacity * 2);
+
+            mask = _capacity - 1;
+            for (s=home(k); used(s); s=(s+1)&mask);
+        }
+
+        key(s) = k;
+        used(s, true);
+        ++_size;
+
+        return s;
+    }
+
+    void
+    allocate(const Decoder & decoder)
+    {
+        if (decoder.keyBits() > sizeof(Key) * CHAR_BIT)
+            throw WUPException(cat("FlatRam keys are limited to ",
+                    sizeof(Key) * CHAR_BIT, " bits, this decoder requires ",
+                    decoder.keyBits()));
+
+        if (_classes == 0)
+            resizeClasses(1);
+
+        resizeTable(16);
+    }
+
+    void
+    resizeTable(const size_t capacity)
+    {
+        std::vector<uint8_t> old(capacity * _stride, 0);
+        old.swap(_data);
+
+        const size_t oldCapacity = _capacity;
+
+        _capacity = capacity;
+        _shift = 64;
+        for (size_t c=_capacity; c>1; c>>=1)
+            --_shift;
+
+        const size_t mask = _capacity - 1;
+
+        for (size_t o=0; o!=oldCapacity; ++o)
+        {
+            const uint8_t * const src = &old[o * _stride];
+
+            if (*(const int*)(src + sizeof(Key)) == 0)
+                continue;
+
+            size_t s = home(*(const Key*)src);
+            while (used(s))
+                s = (s+1) & mask;
+
+            memcpy(&_data[s * _stride], src, _stride);
+        }
+    }
+
+    // Size of a slot, padded so that the next key stays aligned
+    static size_t
+    slotBytes(const int classes)
+    {
+        const size_t align = sizeof(Key);
+
+        size_t stride = sizeof(Key) + sizeof(int) + sizeof(Counter) * classes;
+        if (stride % align)
+            stride += align - stride % align;
+
+        return stride;
+    }
+
+    void
+    resizeClasses(const int classes)
+    {
+        const size_t header = sizeof(Key) + sizeof(int);
+        const size_t stride = slotBytes(classes);
+
+        std::vector<uint8_t> data(_capacity * stride, 0);
+
+        for (size_t s=0; s!=_capacity; ++s)
+            memcpy(&data[s * stride], &_data[s * _stride],
+                    header + sizeof(Counter) * _classes);
+
+        _data.swap(data);
+        _stride = stride;
+        _classes = classes;
+    }
+
+private:
+
+    std::vector<uint8_t> _data;
+
+    size_t _capacity;
+
+    size_t _size;
+
+    int _classes;
+
+    size_t _stride;
+
+    int _shift;
+
+};
+
+} /* wup */
+
+#endif /* __WUP_RAMS_FLATRAM_HPP */
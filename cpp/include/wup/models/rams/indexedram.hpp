@@ -0,0 +1,351 @@
+#ifndef __WUP_RAMS_INDEXEDRAM_HPP
+#define __WUP_RAMS_INDEXEDRAM_HPP
+
+#include <vector>
+#include <algorithm>
+#include <climits>
+
+#include <wup/common/io.hpp>
+#include <wup/common/exceptions.hpp>
+#include <wup/models/rams/mapram.hpp>
+
+namespace wup {
+
+// Adds a reverse index to another storage: for each class, the packed keys
+// of the addresses where it holds a counter. forgetClass and
+// numPositions(target) only visit the addresses of that class instead of
+// walking the whole RAM. Requires a decoder with packed keys.
+//
+// Learning only appends new addresses to the index. forget, merge and prune
+// may leave stale or repeated keys behind, the lists where that happened are
+// compacted once they double in size.
+template <typename Decoder, typename Ram=MapRam<Decoder> >
+class IndexedRam {
+public:
+
+    typedef typename Decoder::key_type Key;
+
+    IndexedRam()
+    {
+
+    }
+
+    void
+    setup(const Decoder & decoder, const int numClasses, const int numRams)
+    {
+        if (decoder.keyBits() > sizeof(Key) * CHAR_BIT)
+            throw WUPException(cat("IndexedRam keys are limited to ",
+                    sizeof(Key) * CHAR_BIT, " bits, this decoder requires ",
+                    decoder.keyBits()));
+
+        // Scratch decoder, rebuilds the addresses stored in the index
+        _decoder = decoder;
+        _ram.setup(decoder, numClasses, numRams);
+
+        if (numClasses > int(_index.size()))
+            _index.resize(numClasses);
+    }
+
+    int
+    learn(const Decoder & decoder, const int target, const int weight=1)
+    {
+        const int hits = _ram.learn(decoder, target, weight);
+
+        // The counter was zero before, or it saturated
+        if (hits <= weight)
+        {
+            ClassIndex & index = classIndex(target);
+            index.keys.push_back(decoder.key());
+
+            if (hits == Ram::maxCounter())
+                index.stale = true;
+
+            compactIfNeeded(target);
+        }
+
+        return hits;
+    }
+
+    void
+    forget(const Decoder & decoder, const int target)
+    {
+        _ram.forget(decoder, target);
+
+        if (target < int(_index.size()))
+            _index[target].stale = true;
+    }
+
+    void
+    erase(const Decoder & decoder, const int target)
+    {
+        _ram.erase(decoder, target);
+
+        if (target < int(_index.size()))
+            _index[target].stale = true;
+    }
+
+    // Erases the counters of target, visiting only the addresses it wrote to
+    void
+    forgetClass(const int target)
+    {
+        if (target >= int(_index.size()))
+            return;
+
+        ClassIndex & index = _index[target];
+
+        for (const Key & k : index.keys)
+        {
+            _decoder.key(k);
+            _ram.erase(_decoder, target);
+        }
+
+        index = ClassIndex();
+    }
+
+    void
+    prefetch(const Decoder & decoder) const
+    {
+        _ram.prefetch(decoder);
+    }
+
+    template <typename F>
+    void
+    read(const Decoder & decoder, F f) const
+    {
+        _ram.read(decoder, f);
+    }
+
+    template <typename F>
+    void
+    forEach(F f) const
+    {
+        _ram.forEach(f);
+    }
+
+    // Adds the counters of other, class i of other becomes classMap[i].
+    // Returns the largest counter that was changed.
+    int
+    merge(const Decoder & decoder, const IndexedRam & other,
+        const std::vector<int> & classMap)
+    {
+        const int largest = _ram.merge(decoder, other._ram, classMap);
+
+        for (size_t i=0; i!=other._index.size() && i!=classMap.size(); ++i)
+        {
+            const std::vector<Key> & keys = other._index[i].keys;
+
+            if (keys.empty() || classMap[i] < 0)
+                continue;
+
+            // Both sides may know the same address
+            ClassIndex & index = classIndex(classMap[i]);
+            index.keys.insert(index.keys.end(), keys.begin(), keys.end());
+            index.stale = true;
+
+            compactIfNeeded(classMap[i]);
+        }
+
+        return largest;
+    }
+
+    size_t
+    numAddresses() const
+    {
+        return _ram.numAddresses();
+    }
+
+    // Prunes the storage and compacts every list of the index. Returns the
+    // bytes released.
+    size_t
+    prune(const int minCount)
+    {
+        const size_t before = numBytes();
+
+        _ram.prune(minCount);
+
+        for (size_t t=0; t!=_index.size(); ++t)
+        {
+            _index[t].stale = true;
+            compact(t);
+        }
+
+        return before - numBytes();
+    }
+
+    size_t
+    numBytes() const
+    {
+        size_t sum = _ram.numBytes() + _index.capacity() * sizeof(ClassIndex);
+
+        for (const ClassIndex & index : _index)
+            sum += index.keys.capacity() * sizeof(Key);
+
+        return sum;
+    }
+
+    // Bytes left by a prune that keeps the given number of addresses and
+    // positions, the index holds one key per position once compacted
+    size_t
+    prunedBytes(const size_t addresses, const long positions) const
+    {
+        return _ram.prunedBytes(addresses, positions) +
+                _index.capacity() * sizeof(ClassIndex) + positions * sizeof(Key);
+    }
+
+    static int
+    maxCounter()
+    {
+        return Ram::maxCounter();
+    }
+
+    long
+    numPositions() const
+    {
+        return _ram.numPositions();
+    }
+
+    // Number of addresses where target has a counter. Constant time unless
+    // forget, merge or prune touched the class since its last compaction.
+    long
+    numPositions(const int target) const
+    {
+        if (target >= int(_index.size()))
+            return 0;
+
+        const ClassIndex & index = _index[target];
+
+        if (!index.stale)
+            return index.keys.size();
+
+        std::vector<Key> keys(index.keys);
+        return live(keys, target);
+    }
+
+    void
+    exportTo(IntWriter & writer, Decoder & decoder) const
+    {
+        _ram.exportTo(writer, decoder);
+    }
+
+    void
+    importFrom(IntReader & reader, Decoder & decoder)
+    {
+        _ram.importFrom(reader, decoder);
+
+        // Rebuilds the index from the imported counters
+        std::vector<ClassIndex> & index = _index;
+
+        _ram.forEach([&index](const Key & k, const int * const counters, const int classes)
+        {
+            if (classes > int(index.size()))
+                index.resize(classes);
+
+            for (int i=0; i!=classes; ++i)
+                if (counters[i] != 0)
+                    index[i].keys.push_back(k);
+        });
+
+        for (ClassIndex & i : _index)
+            i.compacted = i.keys.size();
+    }
+
+private:
+
+    struct ClassIndex
+    {
+        ClassIndex() :
+            compacted(0),
+            stale(false)
+        {
+
+        }
+
+        // Addresses where the class wrote to
+        std::vector<Key> keys;
+
+        // Size of keys after the last compaction
+        size_t compacted;
+
+        // Whether keys may hold repeated addresses or addresses whose
+        // counter is zero now
+        bool stale;
+    };
+
+    ClassIndex &
+    classIndex(const int target)
+    {
+        if (target >= int(_index.size()))
+            _index.resize(target + 1);
+
+        return _index[target];
+    }
+
+    void
+    compactIfNeeded(const int target)
+    {
+        const ClassIndex & index = _index[target];
+
+        if (index.stale && index.keys.size() > 2 * index.compacted + 64)
+            compact(target);
+    }
+
+    // Drops the repeated and the stale keys of target
+    void
+    compact(const int target)
+    {
+        ClassIndex & index = _index[target];
+
+        if (!index.stale)
+            return;
+
+        std::vector<Key> keys;
+        keys.swap(index.keys);
+        keys.resize(live(keys, target));
+
+        // Releases the extra capacity
+        index.keys.assign(keys.begin(), keys.end());
+        index.compacted = index.keys.size();
+        index.stale = false;
+    }
+
+    // Sorts keys and moves the distinct ones where target has a counter to
+    // the front. Returns how many they are.
+    size_t
+    live(std::vector<Key> & keys, const int target) const
+    {
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+        size_t count = 0;
+
+        for (size_t i=0; i!=keys.size(); ++i)
+        {
+            bool found = false;
+
+            _decoder.key(keys[i]);
+            _ram.read(_decoder, [target, &found](const int t, const int)
+            {
+                if (t == target)
+                    found = true;
+            });
+
+            if (found)
+                keys[count++] = keys[i];
+        }
+
+        return count;
+    }
+
+private:
+
+    Ram _ram;
+
+    std::vector<ClassIndex> _index;
+
+    mutable Decoder _decoder;
+
+};
+
+} /* wup */
+
+#endif /* __WUP_RAMS_INDEXEDRAM_HPP */
@@ -0,0 +1,284 @@
+#ifndef __WUP_RAMS_INTRAM_HPP
+#define __WUP_RAMS_INTRAM_HPP
+
+#include <vector>
+#include <climits>
+#include <stdint.h>
+
+#include <wup/common/io.hpp>
+#include <wup/models/decoders/intdecoder.hpp>
+#include <wup/models/rams/flatram.hpp>
+
+namespace wup {
+
+// Storage for the integer decoders. The key width is picked in setup from
+// the number of inputs of the RAM, so RAMs up to 32 inputs store 4 bytes
+// keys, up to 64 inputs 8 bytes keys, and only wider RAMs pay for 128 bits.
+// Each width is kept in a FlatRam and the address of the decoder is narrowed
+// before reaching it.
+template <typename Decoder=IntDecoder, typename Counter=int>
+class IntRam {
+public:
+
+    typedef typename Decoder::key_type Key;
+
+    IntRam() :
+        _width(0)
+    {
+
+    }
+
+    void
+    setup(const Decoder & decoder, const int numClasses, const int numRams)
+    {
+        _width = decoder.keyBits() <= 32 ? 32 : decoder.keyBits() <= 64 ? 64 : 128;
+
+        switch (_width)
+        {
+        case 32:  _ram32.setup(narrow<Decoder32>(decoder), numClasses, numRams); break;
+        case 64:  _ram64.setup(narrow<Decoder64>(decoder), numClasses, numRams); break;
+        default: _ram128.setup(narrow<Decoder128>(decoder), numClasses, numRams); break;
+        }
+    }
+
+    // Bits of the keys stored by this RAM
+    int
+    keyWidth() const
+    {
+        return _width;
+    }
+
+    int
+    learn(const Decoder & decoder, const int target, const int weight=1)
+    {
+        switch (_width)
+        {
+        case 32:  return _ram32.learn(narrow<Decoder32>(decoder), target, weight);
+        case 64:  return _ram64.learn(narrow<Decoder64>(decoder), target, weight);
+        default: return _ram128.learn(narrow<Decoder128>(decoder), target, weight);
+        }
+    }
+
+    void
+    forget(const Decoder & decoder, const int target)
+    {
+        switch (_width)
+        {
+        case 32:  _ram32.forget(narrow<Decoder32>(decoder), target); break;
+        case 64:  _ram64.forget(narrow<Decoder64>(decoder), target); break;
+        default: _ram128.forget(narrow<Decoder128>(decoder), target); break;
+        }
+    }
+
+    void
+    erase(const Decoder & decoder, const int target)
+    {
+        switch (_width)
+        {
+        case 32:  _ram32.erase(narrow<Decoder32>(decoder), target); break;
+        case 64:  _ram64.erase(narrow<Decoder64>(decoder), target); break;
+        default: _ram128.erase(narrow<Decoder128>(decoder), target); break;
+        }
+    }
+
+    void
+    forgetClass(const int target)
+    {
+        switch (_width)
+        {
+        case 32:  _ram32.forgetClass(target); break;
+        case 64:  _ram64.forgetClass(target); break;
+        default: _ram128.forgetClass(target); break;
+        }
+    }
+
+    void
+    prefetch(const Decoder & decoder) const
+    {
+        switch (_width)
+        {
+        case 32:  _ram32.prefetch(narrow<Decoder32>(decoder)); break;
+        case 64:  _ram64.prefetch(narrow<Decoder64>(decoder)); break;
+        default: _ram128.prefetch(narrow<Decoder128>(decoder)); break;
+        }
+    }
+
+    template <typename F>
+    void
+    read(const Decoder & decoder, F f) const
+    {
+        switch (_width)
+        {
+        case 32:  _ram32.read(narrow<Decoder32>(decoder), f); break;
+        case 64:  _ram64.read(narrow<Decoder64>(decoder), f); break;
+        default: _ram128.read(narrow<Decoder128>(decoder), f); break;
+        }
+    }
+
+    // Calls f(key, counters, numClasses) for each address in use, keys are
+    // widened back to the key type of Decoder
+    template <typename F>
+    void
+    forEach(F f) const
+    {
+        switch (_width)
+        {
+        case 32:  _ram32.forEach(Widen<uint32_t, F>(f)); break;
+        case 64:  _ram64.forEach(Widen<uint64_t, F>(f)); break;
+        default: _ram128.forEach(Widen<IntAddress128, F>(f)); break;
+        }
+    }
+
+    // Adds the counters of other, class i of other becomes classMap[i].
+    // Returns the largest counter that was changed.
+    int
+    merge(const Decoder & decoder, const IntRam & other,
+        const std::vector<int> & classMap)
+    {
+        if (other._width != _width)
+            throw WUPException(cat("Can not merge RAMs with ", other._width,
+                    " and ", _width, " bits keys"));
+
+        switch (_width)
+        {
+        case 32:  return _ram32.merge(narrow<Decoder32>(decoder), other._ram32, classMap);
+        case 64:  return _ram64.merge(narrow<Decoder64>(decoder), other._ram64, classMap);
+        default: return _ram128.merge(narrow<Decoder128>(decoder), other._ram128, classMap);
+        }
+    }
+
+    size_t
+    numAddresses() const
+    {
+        switch (_width)
+        {
+        case 32:  return _ram32.numAddresses();
+        case 64:  return _ram64.numAddresses();
+        default: return _ram128.numAddresses();
+        }
+    }
+
+    size_t
+    prune(const int minCount)
+    {
+        switch (_width)
+        {
+        case 32:  return _ram32.prune(minCount);
+        case 64:  return _ram64.prune(minCount);
+        default: return _ram128.prune(minCount);
+        }
+    }
+
+    size_t
+    numBytes() const
+    {
+        switch (_width)
+        {
+        case 32:  return _ram32.numBytes();
+        case 64:  return _ram64.numBytes();
+        default: return _ram128.numBytes();
+        }
+    }
+
+    size_t
+    prunedBytes(const size_t addresses, const long positions) const
+    {
+        switch (_width)
+        {
+        case 32:  return _ram32.prunedBytes(addresses, positions);
+        case 64:  return _ram64.prunedBytes(addresses, positions);
+        default: return _ram128.prunedBytes(addresses, positions);
+        }
+    }
+
+    // Largest value a counter holds
+    static int
+    maxCounter()
+    {
+        return FlatRam<Decoder32, Counter>::maxCounter();
+    }
+
+    long
+    numPositions() const
+    {
+        switch (_width)
+        {
+        case 32:  return _ram32.numPositions();
+        case 64:  return _ram64.numPositions();
+        default: return _ram128.numPositions();
+        }
+    }
+
+    void
+    exportTo(IntWriter & writer, Decoder & decoder) const
+    {
+        switch (_width)
+        {
+        case 32:  { Decoder32 d = narrow<Decoder32>(decoder); _ram32.exportTo(writer, d); break; }
+        case 64:  { Decoder64 d = narrow<Decoder64>(decoder); _ram64.exportTo(writer, d); break; }
+        default: { Decoder128 d = narrow<Decoder128>(decoder); _ram128.exportTo(writer, d); break; }
+        }
+    }
+
+    void
+    importFrom(IntReader & reader, Decoder & decoder)
+    {
+        switch (_width)
+        {
+        case 32:  { Decoder32 d = narrow<Decoder32>(decoder); _ram32.importFrom(reader, d); break; }
+        case 64:  { Decoder64 d = narrow<Decoder64>(decoder); _ram64.importFrom(reader, d); break; }
+        default: { Decoder128 d = narrow<Decoder128>(decoder); _ram128.importFrom(reader, d); break; }
+        }
+    }
+
+private:
+
+    typedef BaseIntDecoder<uint32_t> Decoder32;
+
+    typedef BaseIntDecoder<uint64_t> Decoder64;
+
+    typedef BaseIntDecoder<IntAddress128> Decoder128;
+
+    // Same inputs and address as decoder, with a Narrow::key_type key. The
+    // caller picked a width that holds the address.
+    template <typename Narrow>
+    static Narrow
+    narrow(const Decoder & decoder)
+    {
+        const Key k = decoder.key();
+
+        Narrow n(decoder.indexes(), decoder.inputSize());
+        n.key(intAddress<typename Narrow::key_type>(lowBits(k), highBits(k)));
+
+        return n;
+    }
+
+    template <typename Stored, typename F>
+    struct Widen
+    {
+        F & f;
+
+        Widen(F & f) : f(f) { }
+
+        void
+        operator()(const Stored & k, const int * const counters, const int classes) const
+        {
+            f(intAddress<Key>(lowBits(k), highBits(k)), counters, classes);
+        }
+    };
+
+private:
+
+    FlatRam<Decoder32, Counter> _ram32;
+
+    FlatRam<Decoder64, Counter> _ram64;
+
+    FlatRam<Decoder128, Counter> _ram128;
+
+    int _width;
+
+};
+
+} /* wup */
+
+#endif /* __WUP_RAMS_INTRAM_HPP */
@@ -0,0 +1,341 @@
+#ifndef __WUP_RAMS_MAPRAM_HPP
+#define __WUP_RAMS_MAPRAM_HPP
+
+#include <unordered_map>
+#include <vector>
+#include <map>
+#include <climits>
+
+#include <wup/common/io.hpp>
+#include <wup/common/exceptions.hpp>
+
+namespace wup {
+
+// Default RAM storage. Each address is a copy of the decoder and each
+// addressed position holds a std::map from class to hits.
+template <typename Decoder>
+class MapRam {
+public:
+
+    typedef std::map<int, int> MultiDiscriminator;
+
+    typedef std::unordered_map<Decoder, MultiDiscriminator> Map;
+
+    MapRam()
+    {
+
+    }
+
+    void
+    setup(const Decoder & /*decoder*/, const int /*numClasses*/, const int /*numRams*/)
+    {
+
+    }
+
+    // Adds weight to the counter of target at the address held by decoder
+    // and returns its new value
+    int
+    learn(const Decoder & decoder, const int target, const int weight=1)
+    {
+        MultiDiscriminator &multidiscriminator = _map[decoder];
+
+        // Se a posição endereçada não foi alocada
+        auto it = multidiscriminator.find(target);
+        if (it == multidiscriminator.end())
+        {
+            multidiscriminator[target] = weight;
+            return weight;
+        }
+        else
+        {
+            return it->second += weight;
+        }
+    }
+
+    void
+    forget(const Decoder & decoder, const int target)
+    {
+        // Endereços desconhecidos não são criados
+        auto address = _map.find(decoder);
+        if (address == _map.end())
+            return;
+
+        MultiDiscriminator &multidiscriminator = address->second;
+        auto it = multidiscriminator.find(target);
+
+        // Se a posição endereçada não foi alocada
+        if (it == multidiscriminator.end())
+            return;
+
+        if (it->second == 1)
+            multidiscriminator.erase(it);
+        else
+            it->second = it->second - 1;
+
+        if (multidiscriminator.empty())
+            _map.erase(address);
+    }
+
+    // Erases the counter of target at the address held by decoder
+    void
+    erase(const Decoder & decoder, const int target)
+    {
+        auto address = _map.find(decoder);
+        if (address == _map.end())
+            return;
+
+        address->second.erase(target);
+
+        if (address->second.empty())
+            _map.erase(address);
+    }
+
+    void
+    forgetClass(const int target)
+    {
+        for (auto &pair : _map)
+        {
+            MultiDiscriminator &multidiscriminator = pair.second;
+            auto it = multidiscriminator.find(target);
+            if (it != multidiscriminator.end())
+                multidiscriminator.erase(it);
+        }
+    }
+
+    // The buckets can not be reached without loading them, nothing to do
+    void
+    prefetch(const Decoder & /*decoder*/) const
+    {
+
+    }
+
+    // Calls f(target, hits) for each class stored at the address held by decoder
+    template <typename F>
+    void
+    read(const Decoder & decoder, F f) const
+    {
+        auto it = _map.find(decoder);
+
+        // Se não contém o endereço mapeado continua
+        if (it == _map.end())
+            return;
+
+        const MultiDiscriminator &multidiscriminator = it->second;
+        for (auto it2=multidiscriminator.begin(); it2!=multidiscriminator.end(); ++it2)
+            f(it2->first, it2->second);
+    }
+
+    // Adds the counters of other, class i of other becomes classMap[i].
+    // Returns the largest counter that was changed.
+    int
+    merge(const Decoder & /*decoder*/, const MapRam & other,
+        const std::vector<int> & classMap)
+    {
+        int largest = 0;
+
+        for (auto &pair : other._map)
+        {
+            if (pair.second.empty())
+                continue;
+
+            MultiDiscriminator &multidiscriminator = _map[pair.first];
+
+            for (auto &box : pair.second)
+            {
+                const int hits = multidiscriminator[classMap[box.first]] += box.second;
+
+                if (hits > largest)
+                    largest = hits;
+            }
+        }
+
+        return largest;
+    }
+
+    // Calls f(key, counters, numClasses) for each address, only available
+    // for decoders with packed keys
+    template <typename F>
+    void
+    forEach(F f) const
+    {
+        std::vector<int> counters;
+
+        for (auto &pair : _map)
+        {
+            const MultiDiscriminator &multidiscriminator = pair.second;
+
+            if (multidiscriminator.empty())
+                continue;
+
+            counters.assign(multidiscriminator.rbegin()->first + 1, 0);
+
+            for (auto &box : multidiscriminator)
+                counters[box.first] = box.second;
+
+            f(pair.first.key(), counters.data(), int(counters.size()));
+        }
+    }
+
+    size_t
+    numAddresses() const
+    {
+        return _map.size();
+    }
+
+    // Erases the counters below minCount and the addresses left empty.
+    // Returns the bytes released.
+    size_t
+    prune(const int minCount)
+    {
+        const size_t before = numBytes();
+
+        for (auto it=_map.begin(); it!=_map.end();)
+        {
+            MultiDiscriminator &multidiscriminator = it->second;
+
+            for (auto it2=multidiscriminator.begin(); it2!=multidiscriminator.end();)
+            {
+                if (it2->second < minCount)
+                    it2 = multidiscriminator.erase(it2);
+                else
+                    ++it2;
+            }
+
+            if (multidiscriminator.empty())
+                it = _map.erase(it);
+            else
+                ++it;
+        }
+
+        // Libera os buckets que sobraram
+        _map.rehash(0);
+
+        return before - numBytes();
+    }
+
+    // Approximate heap usage: the buckets, one node per address holding a
+    // copy of the decoder and its pattern, and one tree node per class
+    size_t
+    numBytes() const
+    {
+        size_t sum = _map.bucket_count() * sizeof(void*);
+
+        for (auto &pair : _map)
+            sum += addressNode() + pair.first.patternSize() * sizeof(int) +
+                    pair.second.size() * classNode();
+
+        return sum;
+    }
+
+    // Approximate bytes left by a prune that keeps the given number of
+    // addresses and positions
+    size_t
+    prunedBytes(const size_t addresses, const long positions) const
+    {
+        if (addresses == 0)
+            return sizeof(void*);
+
+        const size_t patternSize = _map.begin()->first.patternSize();
+        const size_t buckets = size_t(addresses / _map.max_load_factor()) + 1;
+
+        return buckets * sizeof(void*) + positions * classNode() +
+                addresses * (addressNode() + patternSize * sizeof(int));
+    }
+
+    // Largest value a counter holds
+    static int
+    maxCounter()
+    {
+        return INT_MAX;
+    }
+
+    long
+    numPositions() const
+    {
+        long sum = 0;
+        for (auto &pair : _map)
+            sum += pair.second.size();
+        return sum;
+    }
+
+    void
+    exportTo(IntWriter & writer, Decoder & /*decoder*/) const
+    {
+        int numKeys = _map.size();
+        writer.put(numKeys);
+
+        // Para cada posição nela endereçada
+        for (auto it=_map.begin(); it!=_map.end(); ++it)
+        {
+            const MultiDiscriminator &multidiscriminator = it->second;
+            const Decoder & key = it->first;
+
+            for (uint i=0;i<key.patternSize();++i)
+                writer.put(key.pattern()[i]);
+            writer.put(multidiscriminator.size());
+
+            // Salva as caixas
+            for (auto it2=multidiscriminator.begin(); it2!=multidiscriminator.end(); ++it2)
+            {
+                writer.put(it2->first);
+                writer.put(it2->second);
+            }
+        }
+    }
+
+    void
+    importFrom(IntReader & reader, Decoder & decoder)
+    {
+        int numKeys, length, discriminator, hits;
+
+        // Carrega o numero de chaves na ram
+        reader.get(numKeys);
+
+        // Para cada chave nesta ram
+        for (int k=0;k<numKeys;++k)
+        {
+            // Carrega o padrão para o input e atualiza a funcao de hash
+            for (uint i=0;i<decoder.patternSize();++i)
+                reader.get(decoder.pattern()[i]);
+            decoder.updateHash();
+
+            // Carrega a posição endereçada
+            MultiDiscriminator &multidiscriminator = _map[decoder];
+
+            // Carrega o numero de discriminadores que acessaram esta posição
+            reader.get(length);
+
+            // Carrega o conteudo desta posicao endereçada
+            for (int t=0;t<length;++t)
+            {
+                reader.get(discriminator);
+                reader.get(hits);
+                multidiscriminator[discriminator] = hits;
+            }
+        }
+    }
+
+private:
+
+    // Heap usage of an address without its pattern, and of each class in it
+    static size_t
+    addressNode()
+    {
+        return 2 * sizeof(void*) + sizeof(Decoder) + sizeof(MultiDiscriminator);
+    }
+
+    static size_t
+    classNode()
+    {
+        return 4 * sizeof(void*) + sizeof(typename MultiDiscriminator::value_type);
+    }
+
+private:
+
+    Map _map;
+
+};
+
+} /* wup */
+
+#endif /* __WUP_RAMS_MAPRAM_HPP */
@@ -0,0 +1,197 @@
+#ifndef __WUP_RAMS_STATICRAMS_HPP
+#define __WUP_RAMS_STATICRAMS_HPP
+
+#include <vector>
+#include <cstring>
+#include <type_traits>
+#include <stdint.h>
+
+#include <wup/common/bits.hpp>
+#include <wup/common/math.hpp>
+#include <wup/common/exceptions.hpp>
+
+namespace wup {
+
+// Address type of a RAM with RamBits inputs. One bit is kept free so that
+// all ones can mark empty slots.
+template <int RamBits>
+struct StaticKey {
+    static_assert(RamBits > 0 && RamBits < 64, "RamBits must be between 1 and 63");
+
+    typedef typename std::conditional<(RamBits < 32), uint32_t, uint64_t>::type type;
+};
+
+// Direct addressed storage for StaticWisard, the counters of every possible
+// address are kept in a single array allocated on the first insert
+template <int RamBits, int NumClasses>
+class StaticDenseRam {
+public:
+
+    static_assert(RamBits <= 24, "StaticDenseRam is limited to 24 bits");
+
+    typedef typename StaticKey<RamBits>::type Key;
+
+    struct Counters {
+        int hits[NumClasses];
+    };
+
+    void
+    reserve(const size_t /*numKeys*/)
+    {
+
+    }
+
+    // Counters of k, zero initialized when k was never inserted
+    int *
+    insert(const Key k)
+    {
+        if (_counters.empty())
+            _counters.resize(size_t(1) << RamBits, Counters());
+
+        return _counters[k].hits;
+    }
+
+    // Counters of k or NULL when the RAM is empty
+    const int *
+    find(const Key k) const
+    {
+        return _counters.empty() ? NULL : _counters[k].hits;
+    }
+
+private:
+
+    std::vector<Counters> _counters;
+
+};
+
+// Open addressing storage for StaticWisard. Slots hold the key followed by
+// a fixed array of counters, the table is kept at most half full.
+template <int RamBits, int NumClasses>
+class StaticFlatRam {
+public:
+
+    typedef typename StaticKey<RamBits>::type Key;
+
+    struct Slot {
+        Key key;
+        int hits[NumClasses];
+    };
+
+    StaticFlatRam() :
+        _size(0),
+        _shift(64)
+    {
+
+    }
+
+    void
+    reserve(const size_t numKeys)
+    {
+        size_t capacity = 16;
+        while (capacity < numKeys * 2)
+            capacity *= 2;
+
+        if (capacity > _slots.size())
+            rehash(capacity);
+    }
+
+    // Counters of k, zero initialized when k was never inserted
+    int *
+    insert(const Key k)
+    {
+        if ((_size + 1) * 2 > _slots.size())
+            rehash(math::max(size_t(16), _slots.size() * 2));
+
+        const size_t mask = _slots.size() - 1;
+        size_t s = home(k);
+
+        for (; _slots[s].key != empty(); s=(s+1)&mask)
+            if (_slots[s].key == k)
+                return _slots[s].hits;
+
+        _slots[s].key = k;
+        ++_size;
+
+        return _slots[s].hits;
+    }
+
+    // Counters of k or NULL when k was never inserted
+    const int *
+    find(const Key k) const
+    {
+        if (_slots.empty())
+            return NULL;
+
+        const size_t mask = _slots.size() - 1;
+
+        for (size_t s=home(k); _slots[s].key != empty(); s=(s+1)&mask)
+            if (_slots[s].key == k)
+                return _slots[s].hits;
+
+        return NULL;
+    }
+
+private:
+
+    static Key
+    empty()
+    {
+        return ~Key(0);
+    }
+
+    size_t
+    home(const Key k) const
+    {
+        return size_t(mixBits(k) >> _shift);
+    }
+
+    void
+    rehash(const size_t capacity)
+    {
+        Slot blank;
+        blank.key = empty();
+        memset(blank.hits, 0, sizeof(blank.hits));
+
+        std::vector<Slot> old(capacity, blank);
+        old.swap(_slots);
+
+        _shift = 64;
+        for (size_t c=capacity; c>1; c>>=1)
+            --_shift;
+
+        const size_t mask = capacity - 1;
+
+        for (const Slot & slot : old)
+        {
+            if (slot.key == empty())
+                continue;
+
+            size_t s = home(slot.key);
+            while (_slots[s].key != empty())
+                s = (s+1) & mask;
+
+            _slots[s] = slot;
+        }
+    }
+
+private:
+
+    std::vector<Slot> _slots;
+
+    size_t _size;
+
+    int _shift;
+
+};
+
+// Default storage of StaticWisard, small address spaces are direct addressed
+template <int RamBits, int NumClasses>
+struct StaticRamFor {
+    typedef typename std::conditional<(RamBits <= 12),
+            StaticDenseRam<RamBits, NumClasses>,
+            StaticFlatRam<RamBits, NumClasses> >::type type;
+};
+
+} /* wup */
+
+#endif /* __WUP_RAMS_STATICRAMS_HPP */
@@ -0,0 +1,288 @@
+#ifndef __WUP_STATICWISARD_HPP
+#define __WUP_STATICWISARD_HPP
+
+#include <vector>
+#include <algorithm>
+
+#include <wup/common/exceptions.hpp>
+#include <wup/common/io.hpp>
+#include <wup/models/wisard.hpp>
+#include <wup/models/bleaching.hpp>
+#include <wup/models/rams/staticrams.hpp>
+
+namespace wup
+{
+
+// Inference only WiSARD with the RAM width and the maximum number of classes
+// fixed at compile time. Addresses are plain integers built by unrolled
+// loops, class counters are fixed size arrays stored next to the address and
+// the activations are a member array. It loads the files written by
+// Wisard::exportTo, or a trained BinaryDecoder model, and predicts the same
+// classes with the same confidences.
+template <int RamBits, int NumClasses,
+          typename Storage=typename StaticRamFor<RamBits, NumClasses>::type>
+class StaticWisard
+{
+public:
+
+    typedef typename Storage::Key Key;
+
+    StaticWisard(IntReader & reader) :
+        StaticWisard(FlatWisard(reader))
+    {
+
+    }
+
+    template <bool IgnoreZeroAddress, typename Ram>
+    StaticWisard(const BaseWisard<BinaryDecoder, IgnoreZeroAddress, Ram> & source) :
+        _numRams(source._numRams),
+        _numInputBits(source._numInputBits),
+        _lastRamBits(source._numInputBits - (source._numRams - 1) * RamBits),
+        _maxBleaching(source._maxBleaching),
+        _numClasses(source.numDiscriminators()),
+        _indexes(source._shuffling, source._shuffling + source._numInputBits),
+        _rams(source._numRams)
+    {
+        if (source._numRamBits != RamBits)
+            throw WUPException(cat("StaticWisard expects RAMs with ", RamBits,
+                    " bits, this model uses ", source._numRamBits));
+
+        if (_numClasses > NumClasses)
+            throw WUPException(cat("StaticWisard supports up to ", NumClasses,
+                    " classes, this model has ", _numClasses));
+
+        // Inner targets are renumbered keeping their order, so ties are
+        // broken in the same way
+        std::vector<int> slotOf(source._activationsCapacity, -1);
+
+        for (int i=0;i!=NumClasses;++i)
+            _labels[i] = -1;
+
+        int slot = 0;
+        for (auto & pair : source._innerToOutter)
+        {
+            slotOf[pair.first] = slot;
+            _labels[slot++] = pair.second;
+        }
+
+        for (int i=0;i!=NumClasses;++i)
+            _activations[i] = 0;
+
+        for (int r=0;r<_numRams;++r)
+        {
+            Storage & ram = _rams[r];
+            const Ram & src = source._rams[r];
+
+            ram.reserve(src.numAddresses());
+
+            src.forEach([&ram, &slotOf](const typename BinaryDecoder::key_type & k,
+                    const int * const counters, const int classes)
+            {
+                int * const hits = ram.insert(Key(k));
+                const int n = math::min(classes, int(slotOf.size()));
+
+                for (int i=0;i!=n;++i)
+                    if (counters[i] != 0 && slotOf[i] != -1)
+                        hits[slotOf[i]] = counters[i];
+            });
+        }
+    }
+
+    int
+    numDiscriminators() const
+    {
+        return _numClasses;
+    }
+
+    int
+    numRamBits() const
+    {
+        return RamBits;
+    }
+
+    int
+    numRams() const
+    {
+        return _numRams;
+    }
+
+    int
+    numInputBits() const
+    {
+        return _numInputBits;
+    }
+
+    template <typename Retina>
+    int readCounts(const Retina & retina)
+    {
+        if (_numClasses == 0)
+            return _ranking.reset();
+
+        clearActivations();
+
+        for (int r=0;r<_numRams;++r)
+        {
+            const int * const hits = _rams[r].find(address(retina, r));
+
+            if (hits != NULL)
+                for (int i=0;i!=NumClasses;++i)
+                    _activations[i] += hits[i];
+        }
+
+        return _labels[_ranking.select(_activations, _numClasses)];
+    }
+
+    template <typename Retina>
+    int readBinary(const Retina & retina, const int threshold=1)
+    {
+        if (_numClasses == 0)
+            return _ranking.reset();
+
+        clearActivations();
+
+        for (int r=0;r<_numRams;++r)
+        {
+            const int * const hits = _rams[r].find(address(retina, r));
+
+            if (hits != NULL)
+                for (int i=0;i!=NumClasses;++i)
+                    _activations[i] += hits[i] >= threshold;
+        }
+
+        return _labels[_ranking.select(_activations, _numClasses)];
+    }
+
+    template <typename Retina>
+    int readBleaching(const Retina & retina, const int step=1,
+        const float minConfidence=0.0)
+    {
+        if (_numClasses == 0)
+            return _ranking.reset();
+
+        if (step <= 0)
+            throw WUPException("step must be larger than 0");
+
+        if (minConfidence < 0.0 || minConfidence > 1.0)
+            throw WUPException("minConfidence must be between 0.0 and 1.0");
+
+        // Collects the counters once, sorted by hits
+        _hits.clear();
+
+        for (int r=0;r<_numRams;++r)
+        {
+            const int * const hits = _rams[r].find(address(retina, r));
+
+            if (hits != NULL)
+                for (int i=0;i!=NumClasses;++i)
+                    if (hits[i] != 0)
+                        _hits.push_back(std::make_pair(hits[i], i));
+        }
+
+        std::sort(_hits.begin(), _hits.end());
+
+        const int predicted = _ranking.bleach(_hits, _activations, _numClasses,
+                _maxBleaching, step, minConfidence);
+
+        return _labels[predicted];
+    }
+
+    float
+    getConfidence() const
+    {
+        return _ranking.confidence;
+    }
+
+    int
+    getExcitation(const int target) const
+    {
+        for (int i=0;i!=_numClasses;++i)
+            if (_labels[i] == target)
+                return _activations[i];
+
+        return 0;
+    }
+
+    int
+    getFirstBestPrediction() const
+    {
+        return _ranking.k1 == -1 ? -1 : _labels[_ranking.k1];
+    }
+
+    int
+    getSecondBestPrediction() const
+    {
+        return _ranking.k2 == -1 ? -1 : _labels[_ranking.k2];
+    }
+
+    int
+    getThirdBestPrediction() const
+    {
+        return _ranking.k3 == -1 ? -1 : _labels[_ranking.k3];
+    }
+
+private:
+
+    // Packs the bits of RAM r, the first input goes to the least significant
+    // bit like in BinaryDecoder
+    template <typename Retina>
+    Key
+    address(const Retina & retina, const int r) const
+    {
+        const uint * const indexes = &_indexes[r * RamBits];
+
+        if (r != _numRams - 1)
+        {
+            Key k = 0;
+
+            for (int i=0;i!=RamBits;++i)
+                k |= Key(retina[indexes[i]] != 0) << i;
+
+            return k;
+        }
+        else
+        {
+            Key k = 0;
+
+            for (int i=0;i!=_lastRamBits;++i)
+                k |= Key(retina[indexes[i]] != 0) << i;
+
+            return k;
+        }
+    }
+
+    void
+    clearActivations()
+    {
+        for (int i=0;i!=NumClasses;++i)
+            _activations[i] = 0;
+    }
+
+private:
+
+    int _numRams;
+
+    int _numInputBits;
+
+    int _lastRamBits;
+
+    int _maxBleaching;
+
+    int _numClasses;
+
+    Ranking _ranking;
+
+    int _activations[NumClasses];
+
+    int _labels[NumClasses];
+
+    std::vector<uint> _indexes;
+
+    std::vector<Storage> _rams;
+
+    std::vector<std::pair<int, int> > _hits;
+
+};
+
+} /* wup */
+
+#endif /* __WUP_STATICWISARD_HPP */
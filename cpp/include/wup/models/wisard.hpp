@@ -1,104 +1,239 @@
 #ifndef WISARD_HPP
 #define WISARD_HPP
 
-#include <unordered_map>
 #include <vector>
 #include <cmath>
 #include <map>
+#include <unordered_map>
+#include <functional>
+#include <algorithm>
+#include <climits>
+#include <exception>
 
 #include <wup/common/exceptions.hpp>
 #include <wup/common/io.hpp>
 #include <wup/common/random.hpp>
 #include <wup/common/math.hpp>
+#include <wup/common/bundle.hpp>
+#include <wup/common/threads.hpp>
+#include <wup/models/bleaching.hpp>
+
+#ifndef WUP_NO_ZIP
+#include <wup/common/zip.hpp>
+#endif
 #include <wup/models/decoders/binarydecoder.hpp>
 #include <wup/models/decoders/graydecoder.hpp>
 #include <wup/models/decoders/basendecoder.hpp>
 #include <wup/models/decoders/snakedecoder.hpp>
 #include <wup/models/decoders/intdecoder.hpp>
+#include <wup/models/rams/mapram.hpp>
+#include <wup/models/rams/flatram.hpp>
+#include <wup/models/rams/denseram.hpp>
+#include <wup/models/rams/autoram.hpp>
+#include <wup/models/rams/intram.hpp>
+#include <wup/models/rams/indexedram.hpp>
+#include <wup/models/rams/compactcodec.hpp>
 #include <wup/models/pattern.hpp>
 
+// Number of RAMs decoded and prefetched together by the read and learn paths
+#ifndef WUP_PREFETCH_BLOCK
+#define WUP_PREFETCH_BLOCK 16
+#endif
+
 namespace wup
 {
 
-template <typename Decoder=BinaryDecoder, bool IgnoreZeroAddress=false>
+template <typename Decoder=BinaryDecoder, bool IgnoreZeroAddress=false,
+          typename Ram=MapRam<Decoder> >
 class BaseWisard;
 
-typedef BaseWisard<IntDecoder> IntWisard;
+template <int RamBits, int NumClasses, typename Storage>
+class StaticWisard;
+
+class MappedWisard;
+
 typedef BaseWisard<BinaryDecoder> Wisard;
 typedef BaseWisard<GrayDecoder> GrayWisard;
 typedef BaseWisard<BinaryDecoder, true> Wisardz;
 typedef BaseWisard<GrayDecoder, true> GrayWisardz;
 
-template <typename Decoder, bool IgnoreZeroAddress>
+typedef BaseWisard<BinaryDecoder, false, FlatRam<BinaryDecoder> > FlatWisard;
+typedef BaseWisard<GrayDecoder, false, FlatRam<GrayDecoder> > FlatGrayWisard;
+typedef BaseWisard<BinaryDecoder, false, AutoRam<BinaryDecoder> > AutoWisard;
+
+// Hash table storage with saturating 8 and 16 bits counters
+typedef BaseWisard<BinaryDecoder, false, FlatRam<BinaryDecoder, uint8_t> > FlatWisard8;
+typedef BaseWisard<BinaryDecoder, false, FlatRam<BinaryDecoder, uint16_t> > FlatWisard16;
+
+// Integer addresses up to 128 bits, stored with the narrowest key that fits
+typedef BaseWisard<IntDecoder, false, IntRam<IntDecoder> > IntWisard;
+typedef BaseWisard<IntDecoder, true, IntRam<IntDecoder> > IntWisardz;
+
+// Keep a per class index, so forgetClass costs as much as the class data
+typedef BaseWisard<BinaryDecoder, false, IndexedRam<BinaryDecoder> > IndexedWisard;
+typedef BaseWisard<BinaryDecoder, false, IndexedRam<BinaryDecoder, FlatRam<BinaryDecoder> > > IndexedFlatWisard;
+typedef BaseWisard<IntDecoder, false, IndexedRam<IntDecoder, IntRam<IntDecoder> > > IndexedIntWisard;
+
+template <typename Decoder, bool IgnoreZeroAddress, typename Ram>
 class BaseWisard 
 {
 public:
     
+    // Scratch memory of the read methods: decoder buffers, activations and
+    // the best classes of the last read. The trained model is never written
+    // by a read that receives a context, so any number of threads may query
+    // the same model concurrently, each one with its own context, as long as
+    // nobody is learning at the same time. Methods without a context use one
+    // owned by the model.
+    class InferenceContext
+    {
+    public:
+
+        InferenceContext() :
+            _owner(NULL),
+            _earlyExit(false),
+            _decidedEarly(false)
+        {
+
+        }
+
+        float
+        getConfidence() const
+        {
+            return _ranking.confidence;
+        }
+
+        // When enabled, readCounts and readBinary stop visiting RAMs once the
+        // remaining ones can not change the winner. The prediction is the
+        // same, but the activations, the confidence and the runner ups only
+        // account for the RAMs that were read.
+        void
+        setEarlyExit(const bool enabled)
+        {
+            _earlyExit = enabled;
+        }
+
+        bool
+        earlyExit() const
+        {
+            return _earlyExit;
+        }
+
+        // True if the last read stopped before the last RAM
+        bool
+        decidedEarly() const
+        {
+            return _decidedEarly;
+        }
+
+    private:
+
+        const BaseWisard * _owner;
+
+        std::vector<Decoder> _decoders;
+
+        std::vector<int> _activations;
+
+        std::vector<std::pair<int, int> > _bleachingHits;
+
+        std::vector<int> _batchActivations;
+
+        std::vector<std::vector<std::pair<int, int> > > _batchHits;
+
+        Ranking _ranking;
+
+        bool _earlyExit;
+
+        bool _decidedEarly;
+
+        friend class BaseWisard;
+
+    };
+    
     random r;
-    typedef std::map<int, int> MultiDiscriminator;
-    typedef std::unordered_map<Decoder, MultiDiscriminator> Ram;
 
     BaseWisard(const int inputBits, const int ramBits) :
             BaseWisard(inputBits, ramBits, 2)
     { }
     
     BaseWisard(const int numInputBits, const int numRamBits, const int numClasses) :
-            _confidence(1.0), 
             _rams(NULL),
             _maxBleaching(1), 
-            _activations(NULL), 
             _activationsCapacity(numClasses),
-            _k1(0), 
-            _k2(0), 
-            _k3(0), 
             _numRams((int) ceil(numInputBits / float(numRamBits))),
             _shuffling(NULL), 
             _decoders(NULL),
             _numInputBits(numInputBits),
             _numRamBits(numRamBits)
     {
-        _rams = new Ram[_numRams]();
-        _activations = new int[_activationsCapacity]();
-        _shuffling = r.randperm(_numInputBits);
-        _decoders = new Decoder[_numRams]();
-        
-        for (int i=0;i<_numRams;++i) 
+        // The destructor does not run if setup rejects the RAM size
+        try
+        {
+            _rams = new Ram[_numRams]();
+            _shuffling = r.randperm(_numInputBits);
+            _decoders = new Decoder[_numRams]();
+
+            for (int i=0;i<_numRams;++i)
+            {
+                const int start = i*_numRamBits;
+                const int end   = math::min((i+1)*_numRamBits, numInputBits);
+
+                // The order inside a RAM is irrelevant, sorted indexes let
+                // BinaryDecoder gather each word of a BitRetina at once
+                std::sort(_shuffling + start, _shuffling + end);
+
+                Decoder d(_shuffling + start, end - start);
+                _decoders[i] = d;
+                _rams[i].setup(_decoders[i], _activationsCapacity, _numRams);
+            }
+        }
+        catch (...)
         {
-            const int start = i*_numRamBits;
-            const int end   = math::min((i+1)*_numRamBits, numInputBits);
-            Decoder d(_shuffling + start, end - start);
-            _decoders[i] = d;
+            delete [] _rams;
+            delete [] _shuffling;
+            delete [] _decoders;
+
+            throw;
         }
     }
     
     BaseWisard(IntReader & reader) :
-            _confidence(1.0), 
             _rams(NULL),
             _maxBleaching(1),
-            _activations(NULL), 
             _activationsCapacity(0),
-            _k1(0),
-            _k2(0),
-            _k3(0),
             _numRams(0),
             _shuffling(NULL),
             _decoders(NULL),
             _numInputBits(0),
             _numRamBits(0)
     {
-        // Número de verificação
-        int tmp = 0;
-        reader.get(tmp);
-        if (tmp != -1)
+        // Número de verificação, -1 para o formato original e -2 para o
+        // compacto (exportCompactTo)
+        int magic = 0;
+        reader.get(magic);
+        if (magic != -1 && magic != -2)
             throw WUPException("Invalid WiSARD file");
 
-        // Atributos simples
+        const bool compact = magic == -2;
+        bool compressed = false;
+
+        if (compact)
+            compressed = reader.getBool();
+
+        // Atributos simples, os contadores podem ser menores que os do
+        // modelo salvo
         reader.get(_maxBleaching);
+        _maxBleaching = math::min(_maxBleaching, Ram::maxCounter());
         reader.get(_activationsCapacity);
         reader.get(_numInputBits);
         reader.get(_numRamBits);
         reader.get(_numRams);
 
+        // Valida o cabeçalho antes de alocar qualquer vetor
+        if (_activationsCapacity < 0 || _numInputBits <= 0 || _numRamBits <= 0 ||
+                _numRams != (_numInputBits + _numRamBits - 1) / _numRamBits)
+            throw WUPException("Invalid WiSARD file");
+
         int thrashSize;
         int thrashItem;
         reader.get(thrashSize);
@@ -122,14 +257,10 @@ public:
         try 
         {
             // Aloca os vetores internos
-            _activations = new int[_activationsCapacity]();
             _rams = new Ram[_numRams]();
             _shuffling = new uint[_numInputBits];
             _decoders = new Decoder[_numRams];
 
-            if (_activations == NULL)
-                throw WUPException("Out of memory");
-
             if (_rams == NULL)
                 throw WUPException("Out of memory");
 
@@ -141,8 +272,13 @@ public:
 
             // Carrega o shuffling
             for (int i=0;i<_numInputBits;++i)
+            {
                 _shuffling[i] = reader.get();
 
+                if (_shuffling[i] >= uint(_numInputBits))
+                    throw WUPException("Invalid WiSARD file");
+            }
+
             // Cria as RamInputs
             for (int i=0;i<_numRams;++i)
             {
@@ -155,68 +291,37 @@ public:
 
             }
 
-            int length, discriminator, hits;
-            std::stringstream ss;
-
             // Para cada ram
             for (int r=0;r<_numRams;++r) 
             {
-                // Pega o input correspondente
-                Decoder & decoder = _decoders[r];
+                _rams[r].setup(_decoders[r], _activationsCapacity, _numRams);
 
-                // Pega a ram correspondente (omap)
-                Ram & ram = _rams[r];
-
-                // Carrega o numero de chaves na ram
-                int numKeys;
-                reader.get(numKeys);
-            
-                // Para cada chave nesta ram
-                for (int k=0;k<numKeys;++k)
-                {
-                    // Carrega o padrão para o input e atualiza a funcao de hash
-                    for (int i=0;i<decoder.patternSize();++i)
-                        reader.get(decoder.pattern()[i]);
-                    decoder.updateHash();
-
-                    // Carrega a posição endereçada
-                    MultiDiscriminator &multidiscriminator = ram[decoder];
-
-                    // Carrega o numero de discriminadores que acessaram esta posição
-                    reader.get(length);
-                    
-                    // Carrega o conteudo desta posicao endereçada
-                    for (int t=0;t<length;++t)
-                    {
-                        reader.get(discriminator);
-                        reader.get(hits);
-                        multidiscriminator[discriminator] = hits;
-                    }
-                }
+                if (compact)
+                    importCompact(reader, r, compressed);
+                else
+                    _rams[r].importFrom(reader, _decoders[r]);
             }
+
+            // Número de verificação no final
+            int tmp = 0;
+            reader.get(tmp);
+            if (tmp != magic)
+                throw WUPException("Invalid WiSARD file");
         }
-        catch (WUPException e) 
+        catch (...)
         {
+            // The destructor does not run if the file is truncated or corrupt
             delete [] _rams;
-            delete [] _activations;
             delete [] _shuffling;
             delete [] _decoders;
-            
-            throw e;
+
+            throw;
         }
-        
-        // Número de verificação no final
-        tmp = 0;
-        reader.get(tmp);
-        if (tmp != -1)
-            throw WUPException("Invalid WiSARD file");
-        //LOGE("_7");
     }
 
     ~BaseWisard()
     {
         delete [] _rams;
-        delete [] _activations;
         delete [] _shuffling;
         delete [] _decoders;
     }
@@ -235,68 +340,82 @@ public:
         int tmp = -1;
         writer.put(tmp);
         
-        // Atributos simples
-        writer.put(_maxBleaching);
-        writer.put(_activationsCapacity);
-        writer.put(_numInputBits);
-        writer.put(_numRamBits);
-        writer.put(_numRams);
-        
-        if (_innerToOutter.size() != _outterToInner.size())
-            throw WUPException("Internal error");
-        
-        writer.put(_thrash.size());
-        for (auto &n : _thrash)
-            writer.put(n);
+        exportHeader(writer);
         
-        writer.put(_innerToOutter.size());
-        for (auto &pair : _innerToOutter) 
+        // Para cada ram
+        for (int r=0;r<_numRams;++r) 
         {
-            writer.put(pair.first);
-            writer.put(pair.second);
+            // The decoder is used as scratch by storages that keep packed keys
+            Decoder decoder(_decoders[r]);
+            _rams[r].exportTo(writer, decoder);
         }
         
-        for (int i=0;i<_numInputBits;++i)
-            writer.put(_shuffling[i]);
-        
-        // Para cada ram
-        for (int r=0;r<_numRams;++r) 
+        // Número de verificação final
+        writer.put(tmp);
+    }
+
+    void
+    exportCompactTo(const char * const filepath, const bool compress=true) const
+    {
+        IntFileWriter writer( filepath, 10240 );
+        exportCompactTo(writer, compress);
+    }
+
+    // Writes the model in the compact format, usually many times smaller
+    // than exportTo. Patterns are bit packed, addresses are sorted and
+    // delta encoded and numbers are varints (see CompactRamCodec). Each RAM
+    // may also be compressed with zlib. Both formats are loaded by the
+    // IntReader constructor.
+    void
+    exportCompactTo(IntWriter & writer, const bool compress=true) const
+    {
+#ifdef WUP_NO_ZIP
+        if (compress)
+            throw WUPException("Compression requires zlib, built with WUP_NO_ZIP");
+#endif
+
+        int tmp = -2;
+        writer.put(tmp);
+        writer.putBool(compress);
+
+        exportHeader(writer);
+
+        std::vector<int32_t> records;
+        std::vector<uint8_t> bytes;
+
+        for (int r=0;r<_numRams;++r)
         {
-            Ram &ram = _rams[r];
-            
-            int numKeys = ram.size();
-            writer.put(numKeys);
+            Decoder decoder(_decoders[r]);
 
-//            if (r == 0)
-//                LOGE("Ram %d has %d addresses", r, omap.size());
-            
-            // Para cada posição nela endereçada
-            // int key = 0;
-            for (auto it=ram.begin(); it!=ram.end();++it) {
-                const MultiDiscriminator &multidiscriminator = it->second;
-                
-                const Decoder & ram = it->first;
-                for (int i=0;i<ram.patternSize();++i)
-                    writer.put(ram.pattern()[i]);
-                writer.put(multidiscriminator.size());
-
-//                if (r == 0) {
-//                    std::stringstream ss;
-//                    for (int i=0;i<ram.size();++i)
-//                        ss << ram.pattern()[i] << " ";
-//                    LOGE("RAM=0, key=%d, hash=%d, Saving %s", key++, ram.hash(), ss.str().c_str());
-//                }
-
-                // Salva as caixas
-                for (auto it2=multidiscriminator.begin(); it2 != multidiscriminator.end();++it2)
-                {
-                    writer.put(it2->first);
-                    writer.put(it2->second);
-                }
+            {
+                VectorSink<int32_t> sink(records);
+                IntWriter ramWriter(sink);
+                _rams[r].exportTo(ramWriter, decoder);
+            }
+
+            bytes.clear();
+            CompactRamCodec::encode(records, decoder.patternSize(), bytes);
+
+#ifndef WUP_NO_ZIP
+            if (compress)
+            {
+                uint8_t * zipped = NULL;
+                uint64_t zippedSize = 0;
+
+                zip(bytes.data(), bytes.size(), zipped, zippedSize);
+
+                writer.putSize(zippedSize);
+                writer.putData(zipped, zippedSize);
+
+                delete [] zipped;
+                continue;
             }
+#endif
+
+            writer.putSize(bytes.size());
+            writer.putData(bytes.data(), bytes.size());
         }
-        
-        // Número de verificação final
+
         writer.put(tmp);
     }
     
@@ -337,204 +456,490 @@ public:
         long sum = 0;
 
         for (int r=0;r<_numRams;++r)
-        {
-            Ram &ram = _rams[r];
-            for (auto it : ram)
-                sum += it.second.size();
-        }
+            sum += _rams[r].numPositions();
 
         return sum;
     }
 
-    template <typename Retina>
-    int learn(const Retina & retina, int target)
+    // Counters held by target, only available for storages with a per class
+    // index, like IndexedRam
+    long
+    numPositions(const int target) const
     {
-        target = getInnerTarget(target);
+        auto it = _outterToInner.find(target);
+        if (it == _outterToInner.end())
+            return 0;
 
-        // Redimensiona o tamanho dos vetores de classes
-        if (target >= _activationsCapacity)
+        long sum = 0;
+
+        for (int r=0;r<_numRams;++r)
+            sum += _rams[r].numPositions(it->second);
+
+        return sum;
+    }
+
+    // Approximate memory used by the RAMs, in bytes
+    size_t
+    numBytes() const
+    {
+        size_t sum = 0;
+
+        for (int r=0;r<_numRams;++r)
+            sum += _rams[r].numBytes();
+
+        return sum;
+    }
+
+    // Forgets every counter below minCount and releases the addresses left
+    // empty, including the ones emptied by forgetSample and forgetClass.
+    // May be called after training or from time to time while learning.
+    // Returns the bytes reclaimed.
+    size_t
+    prune(const int minCount)
+    {
+        size_t reclaimed = 0;
+
+        for (int r=0;r<_numRams;++r)
+            reclaimed += _rams[r].prune(minCount);
+
+        return reclaimed;
+    }
+
+    // Prunes once, with the smallest threshold that brings the RAMs within
+    // maxBytes. An address stays while its largest counter reaches the
+    // threshold, so the size each threshold leaves comes from the counters
+    // collected in a single pass. Throws, leaving the model untouched, if it
+    // only fits by emptying a RAM, as with DenseRam, whose array is released
+    // only once empty. Returns the bytes reclaimed.
+    size_t
+    compactToBudget(const size_t maxBytes)
+    {
+        typedef typename Decoder::key_type Key;
+
+        // Sorted counters of each RAM and largest counter of each address
+        std::vector<std::vector<int> > counters(_numRams);
+        std::vector<std::vector<int> > largest(_numRams);
+
+        for (int r=0;r<_numRams;++r)
         {
-            _activationsCapacity = target == 0 ? 2 : target * 2;
-            delete [] _activations;
-            _activations = new int[_activationsCapacity];
+            std::vector<int> & c = counters[r];
+            std::vector<int> & l = largest[r];
+
+            _rams[r].forEach([&c, &l](const Key &, const int * const hits,
+                const int classes)
+            {
+                int top = 0;
+
+                for (int i=0;i!=classes;++i)
+                {
+                    if (hits[i] > 0)
+                    {
+                        c.push_back(hits[i]);
+                        top = math::max(top, hits[i]);
+                    }
+                }
+
+                if (top != 0)
+                    l.push_back(top);
+            });
+
+            std::sort(c.begin(), c.end());
+            std::sort(l.begin(), l.end());
         }
 
-        // Para cada RAM
+        // The size only changes right after a counter value. Thresholds
+        // above the largest counter of a RAM leave it empty.
+        std::vector<int> thresholds(1, 1);
+        int limit = INT_MAX;
+
         for (int r=0;r<_numRams;++r)
         {
-            _decoders[r].read(retina);
+            for (const int hits : counters[r])
+                thresholds.push_back(hits + 1);
 
-            if (IgnoreZeroAddress && _decoders[r].isZero())
-            {
-                //print("Zero detected!");
-                continue;
-            }
+            if (!largest[r].empty())
+                limit = math::min(limit, largest[r].back());
+        }
 
-//            if (r == 0) {
-//                std::stringstream ss;
-//                for (int i=0;i<_decoders[r].size();++i)
-//                    ss << _decoders[r].pattern()[i] << " ";
-//                LOGE("RAM=0 is learning a key, hash=%d, Saving %s", _decoders[r].hash(), ss.str().c_str());
-//            }
+        std::sort(thresholds.begin(), thresholds.end());
+        thresholds.erase(std::unique(thresholds.begin(), thresholds.end()),
+                thresholds.end());
+        thresholds.erase(std::upper_bound(thresholds.begin(), thresholds.end(),
+                limit), thresholds.end());
 
-            Ram &ram = _rams[r];
-            MultiDiscriminator &multidiscriminator = ram[_decoders[r]];
+        auto bytes = [&](const int minCount) -> size_t
+        {
+            size_t sum = 0;
 
-            // Se a posição endereçada não foi alocada
-            if (multidiscriminator.find(target) == multidiscriminator.end())
-            {
-                multidiscriminator[target] = 1;
-            }
-            else
+            for (int r=0;r<_numRams;++r)
             {
-                multidiscriminator[target] = multidiscriminator[target] + 1;
+                const std::vector<int> & c = counters[r];
+                const std::vector<int> & l = largest[r];
 
-                // Incrementa maxBleaching se necessario
-                if (multidiscriminator[target] > _maxBleaching)
-                    _maxBleaching = multidiscriminator[target];
+                sum += _rams[r].prunedBytes(
+                        l.end() - std::lower_bound(l.begin(), l.end(), minCount),
+                        c.end() - std::lower_bound(c.begin(), c.end(), minCount));
             }
 
-//            if (r == 0) {
-//                auto it = omap.find(_decoders[r]);
-//                auto input = it->first;
-//
-//                std::stringstream ss;
-//                for (int i=0;i<input.size();++i)
-//                    ss << input.pattern()[i] << " ";
-//                LOGE("RAM0's omap has saved %s at the addressed position", ss.str().c_str());
-//            }
+            return sum;
+        };
+
+        // The size shrinks as the threshold grows
+        size_t lo = 0;
+        size_t hi = thresholds.size();
+
+        while (lo != hi)
+        {
+            const size_t mid = (lo + hi) / 2;
 
+            if (bytes(thresholds[mid]) <= maxBytes)
+                hi = mid;
+            else
+                lo = mid + 1;
         }
 
-        return target;
+        if (lo == thresholds.size())
+            throw WUPException(cat("The RAMs can not fit in ", maxBytes,
+                    " bytes without emptying one of them"));
+
+        size_t reclaimed = prune(thresholds[lo]);
+
+        // Some storages only estimate their size
+        while (numBytes() > maxBytes && ++lo != thresholds.size())
+            reclaimed += prune(thresholds[lo]);
+
+        return reclaimed;
     }
 
     template <typename Retina>
-    int forgetSample(const Retina & retina, int target)
+    int learn(const Retina & retina, int target, const int weight=1)
     {
+        if (weight <= 0)
+            throw WUPException("weight must be larger than 0");
+
         target = getInnerTarget(target);
 
+        // Redimensiona o tamanho dos vetores de classes, os contextos
+        // acompanham na próxima leitura
+        if (target >= _activationsCapacity)
+            _activationsCapacity = target == 0 ? 2 : target * 2;
+
         // Para cada RAM
-        for (int r=0;r<_numRams;++r)
+        pipeline(retina, _decoders, [this, target, weight](const int r)
         {
-            _decoders[r].read(retina);
+            if (IgnoreZeroAddress && _decoders[r].isZero())
+                return true;
 
-            Ram &ram = _rams[r];
-            MultiDiscriminator &multidiscriminator = ram[_decoders[r]];
-            auto it = multidiscriminator.find(target);
+            const int hits = _rams[r].learn(_decoders[r], target, weight);
 
-            // Se a posição endereçada não foi alocada
-            if (it == multidiscriminator.end())
-                continue;
+            // Incrementa maxBleaching se necessario
+            if (hits > _maxBleaching)
+                _maxBleaching = hits;
 
-            if (it->second == 1)
-                multidiscriminator.erase(it);
-            else
-                it->second = it->second -1;
-        }
+            return true;
+        });
 
         return target;
     }
 
-    void
-    forgetClass(const int target)
+    // Learns numPatterns patterns placed stride elements apart, with their
+    // labels in targets. The RAMs are independent, so they are distributed
+    // among threads (0 uses all cores) and each thread streams all samples
+    // through its own RAMs, without locks. The result is the same of calling
+    // learn for each sample.
+    template <typename T>
+    void learnBatch(const T * const patterns, const int numPatterns,
+        const int stride, const int * const targets, uint threads=1)
     {
-        auto it = _outterToInner.find(target);
-        if (it == _outterToInner.end())
-            return;
-
-        const int innerTarget = it->second;
+        std::vector<int> inner(numPatterns);
 
-        for (int r=0;r<_numRams;++r)
+        for (int i=0;i!=numPatterns;++i)
         {
-            Ram &ram = _rams[r];
-            for (auto &pair : ram)
-            {
-                MultiDiscriminator &multidiscriminator = pair.second;
-                auto it2 = multidiscriminator.find(innerTarget);
-                if (it2 != multidiscriminator.end())
-                    multidiscriminator.erase(it2);
-            }
+            inner[i] = getInnerTarget(targets[i]);
+
+            // Redimensiona o tamanho dos vetores de classes
+            if (inner[i] >= _activationsCapacity)
+                _activationsCapacity = inner[i] == 0 ? 2 : inner[i] * 2;
         }
 
-        _innerToOutter.erase(it->second);
-        _outterToInner.erase(it);
-        _thrash.push_back(innerTarget);
+        learnRows(patterns, stride, numPatterns, NULL, inner.data(), NULL, threads);
     }
 
-    template <typename Retina>
-    int readCounts(const Retina &retina)
+    // Same as learnBatch, but repeated samples, with the same pattern and
+    // label, are learned only once with their number of copies as weight
+    template <typename T>
+    void learnDeduplicated(const T * const patterns, const int numPatterns,
+        const int stride, const int * const targets, const uint threads=1)
     {
-        if (numDiscriminators() == 0)
+        std::vector<int> inner(numPatterns);
+
+        for (int i=0;i!=numPatterns;++i)
         {
-            _k1 = 0;
-            _k2 = _k3 = -1;
-            _confidence = 0.0;
-            return 0;
+            inner[i] = getInnerTarget(targets[i]);
+
+            // Redimensiona o tamanho dos vetores de classes
+            if (inner[i] >= _activationsCapacity)
+                _activationsCapacity = inner[i] == 0 ? 2 : inner[i] * 2;
         }
 
-        // Limpa o vetor de ativações
-        for (int i=0;i<numDiscriminators();++i)
-            _activations[i] = 0;
+        // Unique samples with their weights, found by hashing the inputs
+        std::unordered_map<uint64_t, std::vector<int> > buckets;
+        std::vector<int> rows;
+        std::vector<int> rowTargets;
+        std::vector<int> weights;
 
-        // Para cada RAM
-        for (int r=0;r<_numRams;++r)
+        for (int i=0;i!=numPatterns;++i)
         {
-            _decoders[r].read(retina);
+            const T * const p = patterns + size_t(i) * stride;
 
-            Ram &ram = _rams[r];
-            const Decoder & decoder = _decoders[r];
-            
-            // Se não contém o endereço mapeado continua
-            if (ram.find(decoder) == ram.end())
-                continue;
+            uint64_t h = mixBits(uint64_t(inner[i]) + 1);
+            for (int j=0;j!=_numInputBits;++j)
+                h = mixBits(h ^ std::hash<T>()(p[j]));
+
+            std::vector<int> & bucket = buckets[h];
+            bool found = false;
+
+            for (const int u : bucket)
+            {
+                const T * const q = patterns + size_t(rows[u]) * stride;
 
-            // Do contrario incrementa as ativações
-            MultiDiscriminator &multidiscriminator = ram[decoder];
-            for (auto it=multidiscriminator.begin(); it!= multidiscriminator.end();++it)
-                _activations[it->first] += it->second;
+                if (rowTargets[u] == inner[i] && std::equal(p, p + _numInputBits, q))
+                {
+                    ++weights[u];
+                    found = true;
+                    break;
+                }
+            }
+
+            if (!found)
+            {
+                bucket.push_back(rows.size());
+                rows.push_back(i);
+                rowTargets.push_back(inner[i]);
+                weights.push_back(1);
+            }
         }
 
-        // Retorna o discriminador mais ativado, calculando a confiança
-        return getOutterTarget(indexOfMax(_activations, numDiscriminators()));
+        learnRows(patterns, stride, rows.size(), rows.data(), rowTargets.data(),
+                weights.data(), threads);
     }
 
-    template <typename Retina>
-    int readBinary(const Retina &retina, const int threshold=1)
+    template <typename T>
+    void learnBatch(const Bundle<T> & patterns, const int * const targets,
+        const uint threads=1)
     {
-        if (numDiscriminators() == 0)
-        {
-            _k1 = 0;
-            _k2 = _k3 = -1;
-            _confidence = 0.0;
-            return 0;
-        }
+        learnBatch(patterns.data(), patterns.rows(), patterns.cols(), targets,
+                threads);
+    }
+
+    template <typename T>
+    void learnDeduplicated(const Bundle<T> & patterns, const int * const targets,
+        const uint threads=1)
+    {
+        learnDeduplicated(patterns.data(), patterns.rows(), patterns.cols(), targets,
+                threads);
+    }
+
+    // Adds the knowledge of other to this model, the result is the same of
+    // learning the samples of both with a single model. Both models must
+    // share the same shuffling, like copies loaded from the same untrained
+    // model file.
+    void
+    merge(const BaseWisard & other, const uint threads=1)
+    {
+        merge(std::vector<const BaseWisard*>(1, &other), threads);
+    }
+
+    // Merges several models at once, in the given order. The RAMs are
+    // distributed among threads (0 uses all cores), like in learnBatch.
+    void
+    merge(const std::vector<const BaseWisard*> & others, uint threads=1)
+    {
+        for (const BaseWisard * other : others)
+        {
+            if (other == this)
+                throw WUPException("A model can not be merged with itself");
+
+            if (other->_numInputBits != _numInputBits ||
+                    other->_numRamBits != _numRamBits ||
+                    !std::equal(_shuffling, _shuffling + _numInputBits,
+                            other->_shuffling))
+                throw WUPException("Only models with the same shuffling can be merged");
+        }
+
+        // Classes are registered in the order each model first saw them
+        std::vector<std::vector<int> > classMaps(others.size());
+
+        for (size_t k=0;k!=others.size();++k)
+        {
+            const BaseWisard & other = *others[k];
+            std::vector<int> & classMap = classMaps[k];
+
+            if (!other._innerToOutter.empty())
+                classMap.assign(other._innerToOutter.rbegin()->first + 1, -1);
+
+            for (auto &pair : other._innerToOutter)
+            {
+                const int inner = getInnerTarget(pair.second);
+                classMap[pair.first] = inner;
+
+                // Redimensiona o tamanho dos vetores de classes
+                if (inner >= _activationsCapacity)
+                    _activationsCapacity = inner == 0 ? 2 : inner * 2;
+            }
+
+            if (other._maxBleaching > _maxBleaching)
+                _maxBleaching = math::min(other._maxBleaching, Ram::maxCounter());
+        }
+
+        if (threads == 0)
+            threads = math::max(std::thread::hardware_concurrency(), 1u);
+
+        threads = math::min(threads, uint(_numRams));
+
+        std::vector<int> maxHits(threads, _maxBleaching);
+
+        auto job = [&](const int tid, const int r)
+        {
+            int & max = maxHits[tid];
+
+            for (size_t k=0;k!=others.size();++k)
+            {
+                const int hits = _rams[r].merge(_decoders[r],
+                        others[k]->_rams[r], classMaps[k]);
+
+                if (hits > max)
+                    max = hits;
+            }
+        };
+
+        runJobs(threads, _numRams, job);
+
+        for (const int hits : maxHits)
+            if (hits > _maxBleaching)
+                _maxBleaching = hits;
+    }
+
+    template <typename Retina>
+    int forgetSample(const Retina & retina, int target)
+    {
+        target = getInnerTarget(target);
+
+        // Para cada RAM
+        for (int r=0;r<_numRams;++r)
+        {
+            _decoders[r].read(retina);
+            _rams[r].forget(_decoders[r], target);
+        }
+
+        return target;
+    }
+
+    void
+    forgetClass(const int target)
+    {
+        auto it = _outterToInner.find(target);
+        if (it == _outterToInner.end())
+            return;
+
+        const int innerTarget = it->second;
+
+        for (int r=0;r<_numRams;++r)
+            _rams[r].forgetClass(innerTarget);
+
+        _innerToOutter.erase(it->second);
+        _outterToInner.erase(it);
+        _thrash.push_back(innerTarget);
+    }
+
+    template <typename Retina>
+    int readCounts(const Retina &retina)
+    {
+        return readCounts(retina, _context);
+    }
+
+    template <typename Retina>
+    int readCounts(const Retina &retina, InferenceContext & ctx) const
+    {
+        prepare(ctx);
+
+        if (numDiscriminators() == 0)
+            return ctx._ranking.reset();
+
+        // Limpa o vetor de ativações
+        for (int i=0;i<numDiscriminators();++i)
+            ctx._activations[i] = 0;
+
+        // Para cada RAM
+        pipeline(retina, ctx._decoders.data(), [this, &ctx](const int r)
+        {
+            // Incrementa as ativações das classes presentes no endereço mapeado
+            _rams[r].read(ctx._decoders[r], [&ctx](const int target, const int hits)
+            {
+                ctx._activations[target] += hits;
+            });
+
+            // Each RAM adds at most _maxBleaching to a class
+            if (ctx._earlyExit && r != _numRams - 1 && settled(ctx,
+                    numDiscriminators(), long(_numRams - r - 1) * _maxBleaching))
+            {
+                ctx._decidedEarly = true;
+                return false;
+            }
+
+            return true;
+        });
+
+        // Retorna o discriminador mais ativado, calculando a confiança
+        return getOutterTarget(indexOfMax(ctx._activations, numDiscriminators(), ctx));
+    }
+
+    template <typename Retina>
+    int readBinary(const Retina &retina, const int threshold=1)
+    {
+        return readBinary(retina, _context, threshold);
+    }
+
+    template <typename Retina>
+    int readBinary(const Retina &retina, InferenceContext & ctx,
+        const int threshold=1) const
+    {
+        prepare(ctx);
+
+        if (numDiscriminators() == 0)
+            return ctx._ranking.reset();
 
-        // Prepara as chaves de hash
-        for (int i=0;i<_numRams;++i)
-            _decoders[i].read(retina);
-        
         // Equivalente ao bleaching com threshold fixo e igual a 1
-        return getOutterTarget(readBleached(threshold));
+        return getOutterTarget(readBleached(retina, ctx, threshold));
     }
     
     template <typename Retina>
     int readBleaching(const Retina &retina)
     {
-        return readBleaching(retina, 1, 0.0);
+        return readBleaching(retina, _context, 1, 0.0);
+    }
+
+    template <typename Retina>
+    int readBleaching(const Retina &retina, InferenceContext & ctx) const
+    {
+        return readBleaching(retina, ctx, 1, 0.0);
     }
     
     template <typename Retina>
     int readBleaching(const Retina &retina, const int step,
         const float minConfidence)
     {
+        return readBleaching(retina, _context, step, minConfidence);
+    }
+
+    template <typename Retina>
+    int readBleaching(const Retina &retina, InferenceContext & ctx,
+        const int step, const float minConfidence) const
+    {
+        prepare(ctx);
+
         if (numDiscriminators() == 0)
-        {
-            _k1 = 0;
-            _k2 = _k3 = -1;
-            _confidence = 0.0;
-            return 0;
-        }
+            return ctx._ranking.reset();
 
         if (step <= 0)
             throw WUPException("step must be larger than 0");
@@ -542,72 +947,39 @@ public:
         if (minConfidence < 0.0 || minConfidence > 1.0)
             throw WUPException("minConfidence must be between 0.0 and 1.0");
         
-        // Prepara as chaves de hash
-        for (int i=0;i<_numRams;++i)
-            _decoders[i].read(retina);
-        
-        int bestBleach       = 1;
-        int bestPrediction   = 0;
-        float bestConfidence = 0;
+        // Lê os contadores de cada RAM uma única vez
+        gatherHits(retina, ctx);
 
-        // Aplica o bleaching
-        for (int t=1;t<=_maxBleaching;t+=step)
-        {
-            const int predicted    = readBleached(t);
-            const float confidence = getConfidence();
-
-            // Se atingiu a confiança mínima retorne a resposta
-            if (confidence > minConfidence)
-                return getOutterTarget(predicted);
-
-            // Se for a de maior confiança até agora guarde-a
-            if (confidence > bestConfidence)
-            {
-                bestConfidence = confidence;
-                bestPrediction = predicted;
-                bestBleach     = t;
-            }
-        }
-
-        // Se nenhum deles atingiu a confiança mínima,
-        // retorne o melhor encontrado
-        //LOGI("Predicted %d", bestPredicted);
-        if (bestPrediction == -1)
-        {
-            return _innerToOutter.empty()
-                    ? 0 : _innerToOutter.begin()->second;
-        }
-        else
-        {
-            // We call read bleach again to populate the activations array
-            return getOutterTarget( readBleached( bestBleach ) );
-        }
+        return bleach(ctx, step, minConfidence);
     }
 
     template <typename Retina>
     int readBinaryBleaching(const Retina &retina)
     {
+        return readBinaryBleaching(retina, _context);
+    }
+
+    template <typename Retina>
+    int readBinaryBleaching(const Retina &retina, InferenceContext & ctx) const
+    {
+        prepare(ctx);
+
         if (numDiscriminators() == 0)
-        {
-            _k1 = 0;
-            _k2 = _k3 = -1;
-            _confidence = 0.0;
-            return 0;
-        }
+            return ctx._ranking.reset();
+
+        gatherHits(retina, ctx);
 
-        // Prepara as chaves de hash
-        for (int i=0;i<_numRams;++i)
-            _decoders[i].read(retina);
-        
         if (_maxBleaching == 1)
-            return getOutterTarget(readBleached(1));
+            return getOutterTarget(readGathered(ctx, 1));
+
+        const int * const activations = ctx._activations.data();
         
         int begin = 1;
         int end = _maxBleaching;
         int current = _nextBinaryStep(begin, end);
         
-        double weightBegin = _activations[readBleached(begin)];
-        double weightCurrent = _activations[readBleached(current)];
+        double weightBegin = activations[readGathered(ctx, begin)];
+        double weightCurrent = activations[readGathered(ctx, current)];
         
         double weightOne = weightBegin;
         
@@ -624,49 +996,227 @@ public:
             }
             
             current = _nextBinaryStep(begin, end);
-            weightCurrent = _activations[readBleached(current)];
+            weightCurrent = activations[readGathered(ctx, current)];
         }
         
-        return getOutterTarget(getFirstBestPrediction());
+        return getOutterTarget(getFirstBestPrediction(ctx));
     }
     
+    // Batch version of readBinary. Reads numPatterns patterns placed stride
+    // elements apart and writes the predicted labels into predictions. When
+    // given, confidences receive one value per pattern and activations one
+    // row of numDiscriminators() values per pattern, with the classes in the
+    // order returned by targets(). The patterns are split in chunks and each
+    // RAM is read for a whole chunk before moving to the next one, so its
+    // table stays in cache. Chunks are distributed among threads, 0 uses all
+    // cores.
+    template <typename T>
+    void readBatch(const T * const patterns, const int numPatterns,
+        const int stride, int * const predictions,
+        float * const confidences=NULL, int * const activations=NULL,
+        const int threshold=1, const uint threads=1) const
+    {
+        if (numDiscriminators() == 0)
+            return emptyBatch(numPatterns, predictions, confidences);
+
+        readChunks(numPatterns, threads, [&](InferenceContext & ctx,
+            const int first, const int last)
+        {
+            const int capacity = _activationsCapacity;
+            std::vector<int> & counts = ctx._batchActivations;
+            counts.assign(size_t(last - first) * capacity, 0);
+
+            for (int r=0;r<_numRams;++r)
+            {
+                Decoder & decoder = ctx._decoders[r];
+
+                for (int i=first;i!=last;++i)
+                {
+                    int * const a = &counts[size_t(i - first) * capacity];
+
+                    decoder.read(patterns + size_t(i) * stride);
+                    _rams[r].read(decoder, [a, threshold](const int target, const int hits)
+                    {
+                        if (hits >= threshold)
+                            ++a[target];
+                    });
+                }
+            }
+
+            for (int i=first;i!=last;++i)
+            {
+                const int * const a = &counts[size_t(i - first) * capacity];
+                const int predicted = indexOfMax(a, capacity, ctx);
+
+                storeBatchResult(ctx, i, getOutterTarget(predicted), a,
+                        predictions, confidences, activations);
+            }
+        });
+    }
+
+    template <typename T>
+    void readBatch(const Bundle<T> & patterns, int * const predictions,
+        float * const confidences=NULL, int * const activations=NULL,
+        const int threshold=1, const uint threads=1) const
+    {
+        readBatch(patterns.data(), patterns.rows(), patterns.cols(),
+                predictions, confidences, activations, threshold, threads);
+    }
+
+    // Batch version of readBleaching, see readBatch for the parameters
+    template <typename T>
+    void readBleachingBatch(const T * const patterns, const int numPatterns,
+        const int stride, int * const predictions,
+        float * const confidences=NULL, int * const activations=NULL,
+        const int step=1, const float minConfidence=0.0,
+        const uint threads=1) const
+    {
+        if (numDiscriminators() == 0)
+            return emptyBatch(numPatterns, predictions, confidences);
+
+        if (step <= 0)
+            throw WUPException("step must be larger than 0");
+
+        if (minConfidence < 0.0 || minConfidence > 1.0)
+            throw WUPException("minConfidence must be between 0.0 and 1.0");
+
+        readChunks(numPatterns, threads, [&](InferenceContext & ctx,
+            const int first, const int last)
+        {
+            std::vector<std::vector<std::pair<int, int> > > & hits = ctx._batchHits;
+            hits.resize(last - first);
+
+            for (auto & h : hits)
+                h.clear();
+
+            for (int r=0;r<_numRams;++r)
+            {
+                Decoder & decoder = ctx._decoders[r];
+
+                for (int i=first;i!=last;++i)
+                {
+                    std::vector<std::pair<int, int> > & h = hits[i - first];
+
+                    decoder.read(patterns + size_t(i) * stride);
+                    _rams[r].read(decoder, [&h](const int target, const int count)
+                    {
+                        h.push_back(std::make_pair(count, target));
+                    });
+                }
+            }
+
+            for (int i=first;i!=last;++i)
+            {
+                ctx._bleachingHits.swap(hits[i - first]);
+                std::sort(ctx._bleachingHits.begin(), ctx._bleachingHits.end());
+
+                const int predicted = bleach(ctx, step, minConfidence);
+
+                storeBatchResult(ctx, i, predicted, ctx._activations.data(),
+                        predictions, confidences, activations);
+            }
+        });
+    }
+
+    template <typename T>
+    void readBleachingBatch(const Bundle<T> & patterns, int * const predictions,
+        float * const confidences=NULL, int * const activations=NULL,
+        const int step=1, const float minConfidence=0.0,
+        const uint threads=1) const
+    {
+        readBleachingBatch(patterns.data(), patterns.rows(), patterns.cols(),
+                predictions, confidences, activations, step, minConfidence,
+                threads);
+    }
+
+    // Labels of the known classes, in the order used by the activation rows
+    // of the batch methods
+    std::vector<int>
+    targets() const
+    {
+        std::vector<int> result;
+
+        for (auto & pair : _outterToInner)
+            result.push_back(pair.first);
+
+        return result;
+    }
+
     float 
     getConfidence() const
     {
-        return _confidence;
+        return _context.getConfidence();
+    }
+
+    // Early exit of the reads that use the model context, see
+    // InferenceContext::setEarlyExit
+    void
+    setEarlyExit(const bool enabled)
+    {
+        _context.setEarlyExit(enabled);
+    }
+
+    bool
+    decidedEarly() const
+    {
+        return _context.decidedEarly();
     }
     
     int
     getExcitation(const int target) const
+    {
+        return getExcitation(_context, target);
+    }
+
+    int
+    getExcitation(const InferenceContext & ctx, const int target) const
     {
         if (target == -1)
             return -1;
 
         auto it = _outterToInner.find(target);
-        if (it == _outterToInner.end())
+        if (it == _outterToInner.end() || ctx._activations.empty())
             return 0;
             //throw WUPException("Unknown target");
         
         //return _activations[it->second] / float(_numRams);
-        return _activations[it->second];
+        return ctx._activations[it->second];
     }
     
     int
     getFirstBestPrediction() const
     {
-        return getOutterTarget(_k1);
+        return getFirstBestPrediction(_context);
+    }
+
+    int
+    getFirstBestPrediction(const InferenceContext & ctx) const
+    {
+        return getOutterTarget(ctx._ranking.k1);
     }
     
     int
     getSecondBestPrediction() const
     {
-        return getOutterTarget(_k2);
+        return getSecondBestPrediction(_context);
+    }
+
+    int
+    getSecondBestPrediction(const InferenceContext & ctx) const
+    {
+        return getOutterTarget(ctx._ranking.k2);
     }
     
     int
     getThirdBestPrediction() const
     {
-        return getOutterTarget(_k3);
+        return getThirdBestPrediction(_context);
+    }
+
+    int
+    getThirdBestPrediction(const InferenceContext & ctx) const
+    {
+        return getOutterTarget(ctx._ranking.k3);
     }
 
     bool 
@@ -678,7 +1228,7 @@ public:
      bool
     operator ==(BaseWisard const& other) const
     {
-        if (_rams->size() != other._rams->size())
+        if (_rams->numAddresses() != other._rams->numAddresses())
             return false;
 
         if (_maxBleaching != other._maxBleaching)
@@ -718,35 +1268,29 @@ public:
     int
     indexOfMax(const T & array, const int length)
     {
-        _k1 = -1;
-        _k2 = -1;
-        _k3 = -1;
-
-        for (int i=0;i<length;++i)
-            if (_k1 == -1 || array[i] > array[_k1] )
-                _k1 =  i;
-
-        for (int i=0;i<length;++i)
-            if (i != _k1 && (_k2 == -1 || array[i] > array[_k2]))
-                _k2 = i;
-        
-        for (int i=0;i<length;++i)
-            if (i != _k1 && i != _k2 && (_k3 == -1 || array[i] > array[_k3]))
-                _k3 = i;
-        
-        _confidence = _k1 == -1 || _k2 == -1
-                ? 1.0
-                : (float) (array[_k1] - array[_k2]) / (array[_k1]);
+        return indexOfMax(array, length, _context);
+    }
 
-        return _k1;
+    template<typename T>
+    int
+    indexOfMax(const T & array, const int length, InferenceContext & ctx) const
+    {
+        return ctx._ranking.select(array, length);
     }
     
     void
     clearActivations()
+    {
+        prepare(_context);
+        clearActivations(_context);
+    }
+
+    void
+    clearActivations(InferenceContext & ctx) const
     {
         // Limpa o vetor de ativações
         for (int i=0;i<_activationsCapacity;++i)
-            _activations[i] = 0;
+            ctx._activations[i] = 0;
     }
 
     template <typename T>
@@ -760,28 +1304,214 @@ public:
     void
     readRamBleach(const T & pattern, const int r, const int threshold)
     {
-        Ram &ram = _rams[r];
-        const Decoder & decoder = _decoders[r];
+        prepare(_context);
 
-        // Se não contém o endereço mapeado continua
-        if (ram.find(decoder) == ram.end())
-            return;
+        // Incrementa as ativações das classes acima do threshold
+        _rams[r].read(_context._decoders[r], [this, threshold](const int target, const int hits)
+        {
+            if (hits >= threshold)
+                ++_context._activations[target];
+        });
+    }
 
-        // Do contrario incrementa as ativações
-        MultiDiscriminator &imap = ram[decoder];
-        for (auto it=imap.begin(); it!= imap.end();++it)
-            if (it->second >= threshold)
-                ++_activations[it->first];
+    // Decoder of a RAM holding the address of the last read without a
+    // context
+    const Decoder &
+    decoderAt(const int index) const
+    {
+        return decoderAt(_context, index);
     }
 
+    // Same for the last read that used ctx. Before it reads from this model
+    // the decoders are the ones of the model.
     const Decoder &
-    decoderAt(const int index)
+    decoderAt(const InferenceContext & ctx, const int index) const
+    {
+        return ctx._owner == this ? ctx._decoders[index] : _decoders[index];
+    }
+
+    const Ram &
+    ramAt(const int index) const
     {
-        return _decoders[index];
+        return _rams[index];
     }
 
 private:
     
+    // Fields shared by exportTo and exportCompactTo, right after the magic
+    void
+    exportHeader(IntWriter & writer) const
+    {
+        // Atributos simples
+        writer.put(_maxBleaching);
+        writer.put(_activationsCapacity);
+        writer.put(_numInputBits);
+        writer.put(_numRamBits);
+        writer.put(_numRams);
+        
+        if (_innerToOutter.size() != _outterToInner.size())
+            throw WUPException("Internal error");
+        
+        writer.put(_thrash.size());
+        for (auto &n : _thrash)
+            writer.put(n);
+        
+        writer.put(_innerToOutter.size());
+        for (auto &pair : _innerToOutter) 
+        {
+            writer.put(pair.first);
+            writer.put(pair.second);
+        }
+        
+        for (int i=0;i<_numInputBits;++i)
+            writer.put(_shuffling[i]);
+    }
+
+    // Loads RAM r from a block written by exportCompactTo
+    void
+    importCompact(IntReader & reader, const int r, const bool compressed)
+    {
+        std::vector<uint8_t> bytes(reader.getSize());
+        reader.getData(bytes.data(), bytes.size());
+
+        if (compressed)
+        {
+#ifdef WUP_NO_ZIP
+            throw WUPException("Compressed WiSARD files require zlib, built with WUP_NO_ZIP");
+#else
+            uint8_t * unzipped = NULL;
+            uint64_t unzippedSize = 0;
+
+            unzip(bytes.data(), bytes.size(), unzipped, unzippedSize);
+            bytes.assign(unzipped, unzipped + unzippedSize);
+
+            delete [] unzipped;
+#endif
+        }
+
+        std::vector<int32_t> records;
+        CompactRamCodec::decode(bytes.data(), bytes.size(),
+                _decoders[r].patternSize(), records);
+
+        IntMemReader ramReader(records.data(), records.size());
+        _rams[r].importFrom(ramReader, _decoders[r]);
+    }
+
+    // Builds the decoders of a context the first time it reads from this
+    // model and keeps its activations as large as the number of classes.
+    // Called at the start of every read.
+    void
+    prepare(InferenceContext & ctx) const
+    {
+        if (ctx._owner != this || ctx._decoders.size() != size_t(_numRams))
+        {
+            ctx._decoders.assign(_decoders, _decoders + _numRams);
+            ctx._owner = this;
+        }
+
+        if (ctx._activations.size() != size_t(_activationsCapacity))
+            ctx._activations.resize(_activationsCapacity, 0);
+
+        ctx._decidedEarly = false;
+    }
+
+    // Runs job(tid, j) for j in [0, numJobs). A worker that throws skips
+    // its remaining jobs and the first exception is rethrown here, after
+    // every thread has joined, instead of terminating the process.
+    template <typename F>
+    static void
+    runJobs(const uint threads, const int numJobs, F job)
+    {
+        if (threads <= 1)
+        {
+            for (int j=0;j!=numJobs;++j)
+                job(0, j);
+            return;
+        }
+
+        std::vector<std::exception_ptr> errors(threads);
+
+        parallel(threads, numJobs, [&](const int tid, const int j)
+        {
+            if (errors[tid])
+                return;
+
+            try
+            {
+                job(tid, j);
+            }
+            catch (...)
+            {
+                errors[tid] = std::current_exception();
+            }
+        });
+
+        for (const std::exception_ptr & e : errors)
+            if (e)
+                std::rethrow_exception(e);
+    }
+
+    // Calls f(ctx, first, last) for chunks of the interval [0, numPatterns),
+    // each thread with its own context
+    template <typename F>
+    void
+    readChunks(const int numPatterns, uint threads, F f) const
+    {
+        const int chunkSize = 64;
+        const int numChunks = (numPatterns + chunkSize - 1) / chunkSize;
+
+        if (threads == 0)
+            threads = math::max(std::thread::hardware_concurrency(), 1u);
+
+        threads = math::min(threads, uint(math::max(numChunks, 1)));
+
+        std::vector<InferenceContext> contexts(threads);
+
+        for (auto & ctx : contexts)
+            prepare(ctx);
+
+        auto job = [&](const int tid, const int chunk)
+        {
+            const int first = chunk * chunkSize;
+            const int last  = math::min(first + chunkSize, numPatterns);
+            f(contexts[tid], first, last);
+        };
+
+        runJobs(threads, numChunks, job);
+    }
+
+    void
+    storeBatchResult(const InferenceContext & ctx, const int i,
+        const int predicted, const int * const a, int * const predictions,
+        float * const confidences, int * const activations) const
+    {
+        predictions[i] = predicted;
+
+        if (confidences != NULL)
+            confidences[i] = ctx.getConfidence();
+
+        if (activations != NULL)
+        {
+            int * row = activations + size_t(i) * numDiscriminators();
+
+            for (auto & pair : _outterToInner)
+                *row++ = a[pair.second];
+        }
+    }
+
+    void
+    emptyBatch(const int numPatterns, int * const predictions,
+        float * const confidences) const
+    {
+        for (int i=0;i!=numPatterns;++i)
+        {
+            predictions[i] = 0;
+
+            if (confidences != NULL)
+                confidences[i] = 0.0;
+        }
+    }
+
     int
     _nextBinaryStep(const int begin, const int end) const
     {
@@ -796,32 +1526,164 @@ private:
         return r;
     }
     
+    // Learns the patterns at the given rows (all when rows is NULL) with the
+    // inner targets and weights (1 when NULL) of each one, each thread
+    // streams the rows through its own RAMs
+    template <typename T>
+    void
+    learnRows(const T * const patterns, const int stride, const int numRows,
+        const int * const rows, const int * const inner, const int * const weights,
+        uint threads)
+    {
+        if (threads == 0)
+            threads = math::max(std::thread::hardware_concurrency(), 1u);
+
+        threads = math::min(threads, uint(_numRams));
+
+        std::vector<int> maxHits(threads, _maxBleaching);
+
+        auto job = [&](const int tid, const int r)
+        {
+            Decoder & decoder = _decoders[r];
+            int & max = maxHits[tid];
+
+            for (int i=0;i!=numRows;++i)
+            {
+                const int row = rows == NULL ? i : rows[i];
+                decoder.read(patterns + size_t(row) * stride);
+
+                if (IgnoreZeroAddress && decoder.isZero())
+                    continue;
+
+                const int hits = _rams[r].learn(decoder, inner[i],
+                        weights == NULL ? 1 : weights[i]);
+
+                if (hits > max)
+                    max = hits;
+            }
+        };
+
+        runJobs(threads, _numRams, job);
+
+        for (const int hits : maxHits)
+            if (hits > _maxBleaching)
+                _maxBleaching = hits;
+    }
+
+    // Decodes the RAMs in blocks of WUP_PREFETCH_BLOCK and asks for their
+    // addresses before calling f(r) for each RAM of the block, so the cache
+    // misses of a block overlap instead of stalling one after the other.
+    // Stops when f returns false.
+    template <typename Retina, typename F>
+    void
+    pipeline(const Retina & retina, Decoder * const decoders, F f) const
+    {
+        for (int b=0;b<_numRams;b+=WUP_PREFETCH_BLOCK)
+        {
+            const int e = math::min(b + WUP_PREFETCH_BLOCK, _numRams);
+
+            for (int r=b;r!=e;++r)
+            {
+                decoders[r].read(retina);
+                _rams[r].prefetch(decoders[r]);
+            }
+
+            for (int r=b;r!=e;++r)
+                if (!f(r))
+                    return;
+        }
+    }
+
+    // True if no class can take the place of the current leader, as chosen
+    // by indexOfMax, after gaining up to reach more hits
+    bool
+    settled(const InferenceContext & ctx, const int length, const long reach) const
+    {
+        const int * const a = ctx._activations.data();
+
+        int best = 0;
+        for (int i=1;i<length;++i)
+            if (a[i] > a[best])
+                best = i;
+
+        // Classes before the leader win ties
+        for (int i=0;i<length;++i)
+            if (i != best && a[i] + reach + (i < best) > a[best])
+                return false;
+
+        return true;
+    }
+
+    template <typename Retina>
     int
-    readBleached(const int threshold)
+    readBleached(const Retina & retina, InferenceContext & ctx,
+        const int threshold) const
     {
-        clearActivations();
+        clearActivations(ctx);
 
         // Para cada RAM
-        for (int r=0;r<_numRams;++r) 
+        pipeline(retina, ctx._decoders.data(), [this, &ctx, threshold](const int r)
         {
-            Ram &ram = _rams[r];
-            const Decoder & decoder = _decoders[r];
+            // Incrementa as ativações das classes acima do threshold
+            _rams[r].read(ctx._decoders[r], [&ctx, threshold](const int target, const int hits)
+            {
+                if (hits >= threshold)
+                    ++ctx._activations[target];
+            });
 
-            // Se não contém o endereço mapeado continua
-            if (ram.find(decoder) == ram.end())
-                continue;
+            // Each RAM adds at most one to a class
+            if (ctx._earlyExit && r != _numRams - 1 &&
+                    settled(ctx, _activationsCapacity, _numRams - r - 1))
+            {
+                ctx._decidedEarly = true;
+                return false;
+            }
 
-            // Do contrario incrementa as ativações
-            MultiDiscriminator &imap = ram[decoder];
-            for (auto it=imap.begin(); it!= imap.end();++it)
-                if (it->second >= threshold)
-                    ++_activations[it->first];
-        }
+            return true;
+        });
 
         // Retorna o discriminador mais ativado, calculando a confiança
-        return indexOfMax(_activations, _activationsCapacity);
+        return indexOfMax(ctx._activations, _activationsCapacity, ctx);
     }
     
+    // Applies the bleaching over the sorted pairs in ctx._bleachingHits
+    int
+    bleach(InferenceContext & ctx, const int step, const float minConfidence) const
+    {
+        return getOutterTarget(ctx._ranking.bleach(ctx._bleachingHits,
+                ctx._activations.data(), _activationsCapacity, _maxBleaching,
+                step, minConfidence));
+    }
+
+    // Collects the (hits, class) pairs addressed in every RAM, sorted by hits
+    template <typename Retina>
+    void
+    gatherHits(const Retina & retina, InferenceContext & ctx) const
+    {
+        std::vector<std::pair<int, int> > & hits = ctx._bleachingHits;
+        hits.clear();
+
+        pipeline(retina, ctx._decoders.data(), [this, &ctx, &hits](const int r)
+        {
+            _rams[r].read(ctx._decoders[r], [&hits](const int target, const int count)
+            {
+                hits.push_back(std::make_pair(count, target));
+            });
+
+            return true;
+        });
+
+        std::sort(hits.begin(), hits.end());
+    }
+
+    // Same as readBleached but uses the pairs collected by gatherHits
+    int
+    readGathered(InferenceContext & ctx, const int threshold) const
+    {
+        return ctx._ranking.gather(ctx._bleachingHits, ctx._activations.data(),
+                _activationsCapacity, threshold);
+    }
+
     int
     getInnerTarget(const int outter)
     {
@@ -876,21 +1738,13 @@ private:
 
 private:
 
-    float _confidence;
+    InferenceContext _context;
     
     Ram *_rams;
     
     int _maxBleaching;
     
-    int *_activations;
-    
     int _activationsCapacity;
-    
-    int _k1;
-    
-    int _k2;
-    
-    int _k3;
 
     int _numRams;
     
@@ -908,6 +1762,11 @@ private:
 
     std::map<int, int> _outterToInner;
 
+    template <int, int, typename>
+    friend class StaticWisard;
+
+    friend class MappedWisard;
+
 };
 
 } /* wup */
@@ -17,20 +17,34 @@ namespace wup {
 
 namespace node {
 
+// Selects the kernels of each feature as it arrives. With many dimensions,
+// or more than one thread, the features of a sample are buffered and
+// selected in a single batch when the sample finishes.
 class KernelCanvas : public Node {
 private:
 
+    // Below this a select per feature is faster than a single threaded
+    // selectMany, see examples/test8
+    static const uint BatchDims = 64;
+
     wup::KernelCanvas<EuclideanKernelSpace> _kc;
     // wup::KernelCanvas<HashedKernelSpace> _kc;
     //legacy::KernelCanvas _kc;
 
+    std::vector<double> _pending;
+
+    uint _threads;
+
 public:
 
+    // threads is used by the batches, 0 uses all cores
     KernelCanvas(Node * const parent, 
-                 IntReader & reader) :
+                 IntReader & reader,
+                 const uint threads=1) :
 
             Node(parent, reader),
-            _kc(reader)
+            _kc(reader),
+            _threads(threads)
     {
 
     }
@@ -38,10 +52,12 @@ public:
     KernelCanvas(Node * const parent, 
                  const double activation, 
                  const uint termBits,
-                 wup::Bundle<double> & kernels) :
+                 wup::Bundle<double> & kernels,
+                 const uint threads=1) :
 
         Node(parent),
-        _kc(activation, termBits, kernels)
+        _kc(activation, termBits, kernels),
+        _threads(threads)
     {
 
     }
@@ -50,6 +66,7 @@ public:
     onClear()
     {
         _kc.clear();
+        _pending.clear();
     }
 
     virtual
@@ -61,17 +78,23 @@ public:
     virtual void
     onDigest(const Feature & input)
     {
-        _kc.read(input.data());
+        const uint dims = _kc.kernelSpace().dims();
+
+        if (_threads == 1 && dims < BatchDims)
+            _kc.read(input.data());
+        else
+            _pending.insert(_pending.end(), input.data(), input.data() + dims);
     }
 
     virtual void onFinish()
     {
-
+        flush();
     }
 
     virtual void
     toPattern(int * dst)
     {
+        flush();
         memcpy(dst, _kc.binary_output().data(), sizeof(int) * _kc.binary_output_size());
     }
 
@@ -91,6 +114,19 @@ public:
         return _kc == other._kc;
     }
 
+private:
+
+    void
+    flush()
+    {
+        if (_pending.empty())
+            return;
+
+        _kc.readMany(_pending.data(), _pending.size() / _kc.kernelSpace().dims(),
+                _threads);
+        _pending.clear();
+    }
+
 };
 
 } /* node */
@@ -52,9 +52,13 @@
 #endif
 
 #include <wup/models/wisard.hpp>
+#include <wup/models/staticwisard.hpp>
+#include <wup/models/mappedwisard.hpp>
+#include <wup/models/ensemblewisard.hpp>
 #include <wup/models/kernelcanvas.hpp>
 #include <wup/models/markovlocalization.hpp>
 #include <wup/models/pattern.hpp>
+#include <wup/models/bitretina.hpp>
 
 #include <wup/nodes/all.hpp>
 #include <wup/nodes/streamencoder.hpp>
@@ -0,0 +1,637 @@
+#ifndef TEST_KERNELCANVAS_HPP
+#define TEST_KERNELCANVAS_HPP
+
+#include <cxxtest/TestSuite.h>
+#include <wup/wup.hpp>
+#include <vector>
+#include <algorithm>
+
+using namespace wup;
+using namespace std;
+
+class TestKernelCanvas : public CxxTest::TestSuite
+{
+public:
+
+    TestKernelCanvas()
+    {
+        // This will be executed only once, when the test class is created
+        srand(11);
+    }
+
+    void test_simd_levels_match_scalar()
+    {
+        for (uint dims : {1u, 2u, 3u, 7u, 16u})
+        {
+            for (uint numKernels : {1u, 8u, 13u, 100u})
+            {
+                Bundle<double> kernels = randomKernels(numKernels, dims);
+                vector<double> pattern = randomPattern(dims);
+
+                vector<double> storage;
+                const double * const blocks = simd::packBlocks(kernels.begin(),
+                        numKernels, dims, storage);
+                const uint numBlocks = (numKernels + simd::Lanes - 1) / simd::Lanes;
+
+                TS_ASSERT_EQUALS(uintptr_t(blocks) % simd::Alignment, 0u);
+
+                vector<double> expected(numBlocks * simd::Lanes);
+                simd::sdistancesScalar(pattern.data(), blocks, dims, numBlocks, expected.data());
+
+                for (uint i=0;i!=numKernels;++i)
+                    TS_ASSERT_EQUALS(expected[i], simd::sdistance(pattern.data(),
+                            &kernels(i, 0u), dims));
+
+                for (int level=simd::SSE2; level<=simd::best(); ++level)
+                {
+                    vector<double> distances(numBlocks * simd::Lanes);
+                    simd::sdistances(simd::Level(level), pattern.data(), blocks, dims,
+                            numBlocks, distances.data());
+
+                    TS_ASSERT(equal(distances.begin(), distances.begin() + numKernels,
+                            expected.begin()));
+                }
+            }
+        }
+    }
+
+    void test_simd_float_levels_match_scalar()
+    {
+        for (uint dims : {1u, 2u, 3u, 7u, 16u})
+        {
+            for (uint numKernels : {1u, 8u, 13u, 24u, 100u})
+            {
+                Bundle<float> kernels = randomFloatKernels(numKernels, dims);
+                vector<float> pattern(dims);
+                for (auto & v : pattern)
+                    v = rand() / float(RAND_MAX);
+
+                vector<float> storage;
+                const float * const blocks = simd::packBlocks(kernels.begin(),
+                        numKernels, dims, storage);
+                const uint numBlocks = (numKernels + simd::Lanes - 1) / simd::Lanes;
+
+                TS_ASSERT_EQUALS(uintptr_t(blocks) % simd::Alignment, 0u);
+
+                vector<float> expected(numBlocks * simd::Lanes);
+                simd::sdistancesScalar(pattern.data(), blocks, dims, numBlocks, expected.data());
+
+                for (uint i=0;i!=numKernels;++i)
+                    TS_ASSERT_EQUALS(expected[i], simd::sdistance(pattern.data(),
+                            &kernels(i, 0u), dims));
+
+                for (int level=simd::SSE2; level<=simd::best(); ++level)
+                {
+                    vector<float> distances(numBlocks * simd::Lanes);
+                    simd::sdistances(simd::Level(level), pattern.data(), blocks, dims,
+                            numBlocks, distances.data());
+
+                    TS_ASSERT(equal(distances.begin(), distances.begin() + numKernels,
+                            expected.begin()));
+
+                    // Five patterns, the last tile is incomplete
+                    vector<float> patterns(5 * dims);
+                    for (auto & v : patterns)
+                        v = rand() / float(RAND_MAX);
+
+                    vector<float> products(5 * numBlocks * simd::Lanes);
+                    simd::products(simd::Level(level), patterns.data(), 5, blocks, dims,
+                            numBlocks, products.data());
+
+                    for (uint p=0;p!=5;++p)
+                    {
+                        for (uint i=0;i!=numKernels;++i)
+                        {
+                            float dot = 0.0f;
+                            for (uint d=0;d!=dims;++d)
+                                dot += patterns[p * dims + d] * kernels(i, d);
+
+                            TS_ASSERT_DELTA(products[p * numBlocks * simd::Lanes + i], dot, 1e-4);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    void test_select_matches_sort()
+    {
+        for (uint dims : {1u, 2u, 5u, 12u})
+        {
+            for (uint numKernels : {1u, 9u, 64u, 2048u})
+            {
+                for (double act : {0.01, 0.1, 1.0})
+                {
+                    Bundle<double> kernels = randomKernels(numKernels, dims);
+                    Bundle<double> copy(kernels);
+                    EuclideanKernelSpace space(act, copy);
+
+                    for (int level=simd::Scalar; level<=simd::best(); ++level)
+                    {
+                        space.simdLevel(simd::Level(level));
+
+                        for (int s=0;s!=5;++s)
+                        {
+                            vector<double> pattern = randomPattern(dims);
+                            vector<int> expected = nearest(kernels, pattern, space.k());
+                            const int * const selected = space.select(pattern.data());
+
+                            TS_ASSERT(equal(expected.begin(), expected.end(), selected));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    void test_select_many_matches_select()
+    {
+        for (uint dims : {1u, 3u, 8u, 20u})
+        {
+            for (uint numKernels : {1u, 13u, 512u})
+            {
+                Bundle<double> kernels = randomKernels(numKernels, dims);
+                EuclideanKernelSpace space(0.1, kernels);
+
+                for (uint n : {1u, 7u, 70u})
+                {
+                    vector<double> patterns;
+                    for (uint i=0;i!=n;++i)
+                    {
+                        vector<double> p = randomPattern(dims);
+                        patterns.insert(patterns.end(), p.begin(), p.end());
+                    }
+
+                    for (uint threads : {1u, 3u})
+                    {
+                        vector<int> selections(n * space.k());
+                        space.selectMany(patterns.data(), n, selections.data(), threads);
+
+                        for (uint i=0;i!=n;++i)
+                        {
+                            const int * const selected = space.select(&patterns[i * dims]);
+                            TS_ASSERT(equal(selected, selected + space.k(),
+                                    &selections[i * space.k()]));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    void test_ties_keep_lowest_ids()
+    {
+        // Kernels and patterns on a coarse grid, most distances repeat
+        Bundle<double> kernels(300, 2);
+        for (auto & v : kernels)
+            v = rand() % 3;
+
+        Bundle<double> copy(kernels);
+        EuclideanKernelSpace space(0.1, copy);
+
+        vector<double> patterns;
+        for (int i=0;i!=40;++i)
+            patterns.push_back((rand() % 5) * 0.5);
+
+        vector<int> selections(20 * space.k());
+        space.selectMany(patterns.data(), 20, selections.data());
+
+        for (uint i=0;i!=20;++i)
+        {
+            vector<double> pattern(&patterns[i * 2], &patterns[i * 2] + 2);
+            vector<int> expected = nearest(kernels, pattern, space.k());
+
+            for (int level=simd::Scalar; level<=simd::best(); ++level)
+            {
+                space.simdLevel(simd::Level(level));
+                const int * const selected = space.select(pattern.data());
+                TS_ASSERT(equal(expected.begin(), expected.end(), selected));
+            }
+
+            TS_ASSERT(equal(expected.begin(), expected.end(), &selections[i * space.k()]));
+        }
+    }
+
+    void test_canvas_read_many()
+    {
+        Bundle<double> kernels = randomKernels(200, 4);
+        Bundle<double> copy(kernels);
+
+        KernelCanvas<> kc1(0.05, 2, kernels);
+        KernelCanvas<> kc2(0.05, 2, copy);
+
+        vector<double> patterns;
+        for (int i=0;i!=30;++i)
+        {
+            vector<double> p = randomPattern(4);
+            patterns.insert(patterns.end(), p.begin(), p.end());
+            kc1.read(p.data());
+        }
+
+        kc2.readMany(patterns.data(), 30);
+
+        TS_ASSERT(kc1.binary_output() == kc2.binary_output());
+    }
+
+    void test_indexed_matches_euclidean()
+    {
+        for (uint dims : {1u, 2u, 3u, 5u, 8u})
+        {
+            for (uint numKernels : {1u, 7u, 100u, 2048u})
+            {
+                for (double act : {0.005, 0.05, 0.3})
+                {
+                    Bundle<double> kernels = randomKernels(numKernels, dims);
+                    Bundle<double> copy(kernels);
+
+                    EuclideanKernelSpace euclidean(act, kernels);
+                    IndexedKernelSpace indexed(act, copy);
+
+                    TS_ASSERT_EQUALS(euclidean.k(), indexed.k());
+
+                    for (int s=0;s!=10;++s)
+                    {
+                        // Some patterns fall outside of the kernels
+                        vector<double> pattern = randomPattern(dims);
+                        for (auto & v : pattern)
+                            v *= 1.0 + s % 3;
+
+                        const int * const expected = euclidean.select(pattern.data());
+                        const int * const selected = indexed.select(pattern.data());
+
+                        TS_ASSERT(equal(expected, expected + euclidean.k(), selected));
+                    }
+                }
+            }
+        }
+    }
+
+    void test_indexed_ties()
+    {
+        // Kernels on a coarse grid, many share a place and a distance
+        for (uint dims : {2u, 3u})
+        {
+            Bundle<double> kernels(500, dims);
+            for (auto & v : kernels)
+                v = rand() % 3;
+
+            Bundle<double> copy(kernels);
+            EuclideanKernelSpace euclidean(0.07, kernels);
+            IndexedKernelSpace indexed(0.07, copy);
+
+            for (int s=0;s!=30;++s)
+            {
+                vector<double> pattern(dims);
+                for (auto & v : pattern)
+                    v = (rand() % 5) * 0.5;
+
+                const int * const expected = euclidean.select(pattern.data());
+                const int * const selected = indexed.select(pattern.data());
+
+                TS_ASSERT(equal(expected, expected + euclidean.k(), selected));
+            }
+        }
+
+        // Every kernel at the same place
+        Bundle<double> same(40, 2);
+        for (auto & v : same)
+            v = 0.5;
+
+        IndexedKernelSpace indexed(0.25, same);
+        const double pattern[] = {0.1, 0.9};
+        const int * const selected = indexed.select(pattern);
+
+        for (uint i=0;i!=indexed.k();++i)
+            TS_ASSERT_EQUALS(selected[i], int(i));
+    }
+
+    void test_indexed_canvas_reads_euclidean_file()
+    {
+        Bundle<double> kernels = randomKernels(300, 3);
+        KernelCanvas<EuclideanKernelSpace> kc1(0.05, 2, kernels);
+
+        vector<int32_t> buffer;
+        VectorSink<int32_t> snk(buffer);
+        IntWriter writer(snk);
+        kc1.exportTo(writer);
+
+        MemSource<int32_t> src(buffer.data(), buffer.size());
+        IntReader reader(src);
+        KernelCanvas<IndexedKernelSpace> kc2(reader);
+
+        for (int s=0;s!=20;++s)
+        {
+            vector<double> pattern = randomPattern(3);
+            kc1.read(pattern.data());
+            kc2.read(pattern.data());
+        }
+
+        TS_ASSERT(kc1.binary_output() == kc2.binary_output());
+    }
+
+    void test_hashed_selections_are_sorted()
+    {
+        for (uint dims : {1u, 2u, 4u})
+        {
+            for (uint numKernels : {1u, 30u, 1000u})
+            {
+                Bundle<double> kernels = randomKernels(numKernels, dims);
+                Bundle<double> copy(kernels);
+                HashedKernelSpace space(0.05, copy, 3);
+
+                for (int s=0;s!=20;++s)
+                {
+                    vector<double> pattern = randomPattern(dims);
+                    const int * const selected = space.select(pattern.data());
+
+                    for (uint i=0;i!=space.k();++i)
+                        TS_ASSERT(selected[i] >= 0 && selected[i] < int(numKernels));
+
+                    for (uint i=1;i<space.k();++i)
+                    {
+                        const auto a = make_pair(math::sdistance(pattern.data(),
+                                &kernels(selected[i-1], 0u), dims), selected[i-1]);
+                        const auto b = make_pair(math::sdistance(pattern.data(),
+                                &kernels(selected[i], 0u), dims), selected[i]);
+                        TS_ASSERT(a <= b);
+                    }
+                }
+            }
+        }
+    }
+
+    void test_hashed_recall_grows_with_tables()
+    {
+        Bundle<double> kernels = randomKernels(2000, 3);
+        Bundle<double> copy1(kernels);
+        Bundle<double> copy8(kernels);
+
+        HashedKernelSpace hashed1(0.01, copy1, 1);
+        HashedKernelSpace hashed8(0.01, copy8, 8);
+
+        double recall1 = 0.0;
+        double recall8 = 0.0;
+
+        for (int s=0;s!=200;++s)
+        {
+            vector<double> pattern = randomPattern(3);
+            vector<int> expected = nearest(kernels, pattern, hashed1.k());
+            sort(expected.begin(), expected.end());
+
+            recall1 += recall(expected, hashed1.select(pattern.data()), hashed1.k());
+            recall8 += recall(expected, hashed8.select(pattern.data()), hashed8.k());
+        }
+
+        TS_ASSERT_LESS_THAN(recall1, recall8);
+        TS_ASSERT_LESS_THAN(0.8, recall8 / 200);
+    }
+
+    void test_hashed_export_import()
+    {
+        Bundle<double> kernels = randomKernels(500, 2);
+        KernelCanvas<HashedKernelSpace> kc1(0.05, 2, kernels);
+
+        vector<int32_t> buffer;
+        VectorSink<int32_t> snk(buffer);
+        IntWriter writer(snk);
+        kc1.exportTo(writer);
+
+        MemSource<int32_t> src(buffer.data(), buffer.size());
+        IntReader reader(src);
+        KernelCanvas<HashedKernelSpace> kc2(reader);
+
+        for (int s=0;s!=20;++s)
+        {
+            vector<double> pattern = randomPattern(2);
+            kc1.read(pattern.data());
+            kc2.read(pattern.data());
+        }
+
+        TS_ASSERT(kc1.binary_output() == kc2.binary_output());
+
+        Bundle<double> other = randomKernels(10, 2);
+        Bundle<double> same(other);
+        HashedKernelSpace space1(0.2, other, 2);
+        HashedKernelSpace space2(0.2, same, 2);
+        TS_ASSERT(space1 == space2);
+
+        Bundle<double> third(space1.numKernels(), 2);
+        TS_ASSERT_EQUALS(space1.numTables(), 2u);
+        TS_ASSERT_THROWS(HashedKernelSpace(0.2, third, 0), WUPException);
+    }
+
+    void test_float_select_matches_sort()
+    {
+        for (uint dims : {1u, 2u, 5u, 12u})
+        {
+            for (uint numKernels : {1u, 9u, 64u, 1000u})
+            {
+                Bundle<double> kernels = randomKernels(numKernels, dims);
+                FloatEuclideanKernelSpace space(0.05, kernels);
+
+                Bundle<float> narrow(numKernels, dims);
+                copy(kernels.begin(), kernels.end(), narrow.begin());
+
+                for (int level=simd::Scalar; level<=simd::best(); ++level)
+                {
+                    space.simdLevel(simd::Level(level));
+
+                    vector<float> patterns;
+                    for (int s=0;s!=40;++s)
+                    {
+                        vector<double> p = randomPattern(dims);
+                        patterns.insert(patterns.end(), p.begin(), p.end());
+                    }
+
+                    vector<int> selections(40 * space.k());
+                    space.selectMany(patterns.data(), 40, selections.data(), 2);
+
+                    for (uint s=0;s!=40;++s)
+                    {
+                        const float * const pattern = &patterns[s * dims];
+                        vector<int> expected = nearest(narrow, pattern, space.k());
+
+                        TS_ASSERT(equal(expected.begin(), expected.end(),
+                                space.select(pattern)));
+                        TS_ASSERT(equal(expected.begin(), expected.end(),
+                                &selections[s * space.k()]));
+                    }
+                }
+            }
+        }
+    }
+
+    void test_float_shares_the_file_format()
+    {
+        Bundle<double> kernels = randomKernels(300, 3);
+        Bundle<double> copy(kernels);
+        KernelCanvas<EuclideanKernelSpace> kc1(0.05, 2, copy);
+
+        vector<int32_t> buffer1;
+        VectorSink<int32_t> snk1(buffer1);
+        IntWriter writer1(snk1);
+        kc1.exportTo(writer1);
+
+        MemSource<int32_t> src1(buffer1.data(), buffer1.size());
+        IntReader reader1(src1);
+        KernelCanvas<FloatEuclideanKernelSpace> kc2(reader1);
+
+        TS_ASSERT_EQUALS(kc2.kernelSpace().k(), kc1.kernelSpace().k());
+        TS_ASSERT_EQUALS(kc2.kernelSpace().numKernels(), 300u);
+
+        // Back to double precision, the kernels rounded to float
+        vector<int32_t> buffer2;
+        VectorSink<int32_t> snk2(buffer2);
+        IntWriter writer2(snk2);
+        kc2.exportTo(writer2);
+
+        MemSource<int32_t> src2(buffer2.data(), buffer2.size());
+        IntReader reader2(src2);
+        KernelCanvas<EuclideanKernelSpace> kc3(reader2);
+
+        for (auto & v : kernels)
+            v = float(v);
+
+        EuclideanKernelSpace expected(0.05, kernels);
+        TS_ASSERT(kc3.kernelSpace() == expected);
+    }
+
+    void test_float_validation()
+    {
+        Bundle<double> kernels = randomKernels(500, 4);
+        FloatEuclideanKernelSpace space(0.05, kernels, true);
+        FloatEuclideanKernelSpace plain(0.05, kernels);
+
+        TS_ASSERT(space.validating());
+        TS_ASSERT(!plain.validating());
+
+        vector<double> patterns;
+        for (int s=0;s!=30;++s)
+        {
+            vector<double> p = randomPattern(4);
+            patterns.insert(patterns.end(), p.begin(), p.end());
+            space.select(p.data());
+            plain.select(p.data());
+        }
+
+        vector<int> selections(30 * space.k());
+        space.selectMany(patterns.data(), 30, selections.data());
+
+        TS_ASSERT_EQUALS(space.validation().selections, 60u);
+        TS_ASSERT_LESS_THAN_EQUALS(space.validation().mismatches, 60u);
+        TS_ASSERT_EQUALS(plain.validation().selections, 0u);
+
+        space.resetValidation();
+        TS_ASSERT_EQUALS(space.validation().selections, 0u);
+
+        // Kernel 1 is nearer in double precision, in float both are at the
+        // same distance and the lowest id wins
+        Bundle<double> close(2, 1);
+        close(0u, 0u) = 1.0;
+        close(1u, 0u) = 1.0 - 1e-12;
+
+        FloatEuclideanKernelSpace tie(0.5, close, true);
+        const double pattern[] = {0.0};
+
+        TS_ASSERT_EQUALS(tie.select(pattern)[0], 0);
+        TS_ASSERT_EQUALS(tie.validation().selections, 1u);
+        TS_ASSERT_EQUALS(tie.validation().mismatches, 1u);
+        TS_ASSERT_EQUALS(tie.validation().missedKernels, 1u);
+    }
+
+    void test_select_after_import()
+    {
+        Bundle<double> kernels = randomKernels(300, 3);
+        EuclideanKernelSpace space1(0.05, kernels);
+
+        vector<int32_t> buffer;
+        VectorSink<int32_t> snk(buffer);
+        IntWriter writer(snk);
+        space1.exportTo(writer);
+
+        MemSource<int32_t> src(buffer.data(), buffer.size());
+        IntReader reader(src);
+        EuclideanKernelSpace space2(reader);
+
+        TS_ASSERT(space1 == space2);
+
+        for (int s=0;s!=20;++s)
+        {
+            vector<double> pattern = randomPattern(3);
+            vector<int> first(space1.select(pattern.data()),
+                    space1.select(pattern.data()) + space1.k());
+
+            TS_ASSERT(equal(first.begin(), first.end(), space2.select(pattern.data())));
+        }
+    }
+
+private:
+
+    Bundle<double> randomKernels(const uint numKernels, const uint dims)
+    {
+        Bundle<double> kernels(numKernels, dims);
+
+        for (auto & v : kernels)
+            v = rand() / double(RAND_MAX) * 2.0 - 1.0;
+
+        return kernels;
+    }
+
+    vector<double> randomPattern(const uint dims)
+    {
+        vector<double> pattern(dims);
+
+        for (auto & v : pattern)
+            v = rand() / double(RAND_MAX) * 2.0 - 1.0;
+
+        return pattern;
+    }
+
+    // Fraction of the sorted ids in expected that are also in selected
+    double recall(const vector<int> & expected, const int * const selected, const uint k)
+    {
+        uint hits = 0;
+
+        for (uint i=0;i!=k;++i)
+            hits += binary_search(expected.begin(), expected.end(), selected[i]);
+
+        return hits / double(k);
+    }
+
+    Bundle<float> randomFloatKernels(const uint numKernels, const uint dims)
+    {
+        Bundle<float> kernels(numKernels, dims);
+
+        for (auto & v : kernels)
+            v = rand() / float(RAND_MAX) * 2.0f - 1.0f;
+
+        return kernels;
+    }
+
+    // Reference selection, sorts every kernel by distance and id
+    vector<int> nearest(Bundle<double> & kernels, const vector<double> & pattern, const uint k)
+    {
+        return nearest(kernels, pattern.data(), k);
+    }
+
+    template <typename T>
+    vector<int> nearest(Bundle<T> & kernels, const T * const pattern, const uint k)
+    {
+        vector<pair<T, int>> all;
+
+        for (uint i=0;i!=kernels.rows();++i)
+            all.push_back(make_pair(simd::sdistance(pattern, &kernels(i, 0u),
+                    kernels.cols()), int(i)));
+
+        sort(all.begin(), all.end());
+
+        vector<int> ids;
+        for (uint i=0;i!=k;++i)
+            ids.push_back(all[i].second);
+
+        return ids;
+    }
+
+};
+
+#endif // TEST_KERNELCANVAS_HPP
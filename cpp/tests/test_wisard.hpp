@@ -0,0 +1,1220 @@
+#ifndef TEST_WISARD_HPP
+#define TEST_WISARD_HPP
+
+#include <cxxtest/TestSuite.h>
+#include <wup/wup.hpp>
+#include <vector>
+#include <cmath>
+#include <fstream>
+#include <iterator>
+#include <functional>
+
+using namespace wup;
+using namespace std;
+
+//WUP_STATICS;
+
+// Storage that throws while learning a given inner class or merging, to
+// check that errors raised by the workers reach the caller
+class FailingRam : public MapRam<BinaryDecoder>
+{
+public:
+
+    static const int FailTarget = 3;
+
+    int
+    learn(const BinaryDecoder & decoder, const int target, const int weight=1)
+    {
+        if (target == FailTarget)
+            throw WUPException("FailingRam");
+
+        return MapRam<BinaryDecoder>::learn(decoder, target, weight);
+    }
+
+    int
+    merge(const BinaryDecoder &, const FailingRam &, const vector<int> &)
+    {
+        throw WUPException("FailingRam");
+    }
+};
+
+class TestWisard : public CxxTest::TestSuite
+{
+    const int numInputs = 256;
+    const int numClasses = 5;
+    const int numSamples = 200;
+
+    vector<vector<int>> patterns;
+    vector<int> targets;
+
+public:
+
+    TestWisard()
+    {
+        // This will be executed only once, when the test class is created
+        srand(7);
+
+        vector<vector<int>> prototypes(numClasses, vector<int>(numInputs));
+        for (auto & p : prototypes)
+            for (auto & v : p)
+                v = rand() % 2;
+
+        for (int i=0;i!=numSamples;++i)
+        {
+            const int target = i % numClasses;
+            vector<int> p = prototypes[target];
+
+            for (auto & v : p)
+                if (rand() % 10 == 0)
+                    v = 1 - v;
+
+            patterns.push_back(p);
+            targets.push_back(target * 10 + 1);
+        }
+    }
+
+    ~TestWisard()
+    {
+        // This will be executed only once, when the test class is destroyed
+    }
+
+    void
+    setUp()
+    {
+        // This will be executed for each test in this test class, before the test
+    }
+
+    void
+    tearDown()
+    {
+        // This will be executed for each test in this test class, after the test
+    }
+
+    void test_flatram_matches_mapram()
+    {
+        // Both models share the same input mapping
+        Wisard w1(numInputs, 16, numClasses);
+        vector<int32_t> buffer = exportToBuffer(w1);
+        MemSource<int32_t> src(buffer.data(), buffer.size());
+        IntReader reader(src);
+        FlatWisard w2(reader);
+
+        train(w1);
+        train(w2);
+
+        TS_ASSERT_EQUALS(w1.numPositions(), w2.numPositions());
+        assertSamePredictions(w1, w2);
+    }
+
+    void test_flatram_export_format()
+    {
+        FlatWisard w1(numInputs, 12, numClasses);
+        train(w1);
+
+        vector<int32_t> buffer = exportToBuffer(w1);
+        MemSource<int32_t> src(buffer.data(), buffer.size());
+        IntReader reader(src);
+        Wisard w2(reader);
+
+        TS_ASSERT_EQUALS(w1.numPositions(), w2.numPositions());
+        assertSamePredictions(w1, w2);
+    }
+
+    void test_flatram_rejects_invalid_files()
+    {
+        const int numRamBits = 12;
+        FlatWisard w1(numInputs, numRamBits, numClasses);
+        train(w1);
+
+        const vector<int32_t> original = exportToBuffer(w1);
+
+        // The first RAM follows the header, the class map and the shuffling,
+        // with its number of keys, the first pattern, its length and boxes
+        const size_t ram = 8 + 2 * original[7] + numInputs;
+        const size_t length = ram + 1 + numRamBits;
+        TS_ASSERT_LESS_THAN(0, original[ram]);
+        TS_ASSERT_LESS_THAN(0, original[length]);
+
+        const vector<pair<size_t, int32_t> > corruptions = {
+            {ram, -1},
+            {length, -1},
+            {length, INT_MAX},
+            {length + 1, -1},
+            {length + 1, 1000}
+        };
+
+        for (auto & c : corruptions)
+        {
+            vector<int32_t> corrupt = original;
+            corrupt[c.first] = c.second;
+
+            MemSource<int32_t> src(corrupt.data(), corrupt.size());
+            IntReader reader(src);
+            TS_ASSERT_THROWS(FlatWisard w2(reader), WUPException);
+        }
+    }
+
+    void test_import_rejects_invalid_files()
+    {
+        Wisard w1(numInputs, 12, numClasses);
+        train(w1);
+
+        const vector<int32_t> original = exportToBuffer(w1);
+        const vector<int32_t> compact = exportCompactToBuffer(w1);
+
+        // Truncated files, runs under ASan to catch the leaks
+        for (const vector<int32_t> * b : {&original, &compact})
+        {
+            for (size_t size : {size_t(1), size_t(5), b->size() / 2, b->size() - 1})
+            {
+                vector<int32_t> buffer(b->begin(), b->begin() + size);
+                MemSource<int32_t> src(buffer.data(), buffer.size());
+                IntReader reader(src);
+                TS_ASSERT_THROWS(Wisard w2(reader), WUPException);
+            }
+        }
+
+        // Header is magic, maxBleaching, activationsCapacity, numInputBits,
+        // numRamBits, numRams and then the thrash and the shuffling
+        vector<int32_t> corrupt = original;
+        corrupt[5] = INT_MAX;
+        {
+            MemSource<int32_t> src(corrupt.data(), corrupt.size());
+            IntReader reader(src);
+            TS_ASSERT_THROWS(Wisard w2(reader), WUPException);
+        }
+
+        corrupt = original;
+        corrupt[4] = 0;
+        {
+            MemSource<int32_t> src(corrupt.data(), corrupt.size());
+            IntReader reader(src);
+            TS_ASSERT_THROWS(Wisard w2(reader), WUPException);
+        }
+
+        // First shuffling index, after an empty thrash and the class map
+        corrupt = original;
+        TS_ASSERT_EQUALS(corrupt[6], 0);
+        corrupt[8 + 2 * corrupt[7]] = numInputs;
+        {
+            MemSource<int32_t> src(corrupt.data(), corrupt.size());
+            IntReader reader(src);
+            TS_ASSERT_THROWS(Wisard w2(reader), WUPException);
+        }
+    }
+
+    void test_autoram_matches_mapram()
+    {
+        Wisard w1(numInputs, 12, numClasses);
+        vector<int32_t> buffer = exportToBuffer(w1);
+        MemSource<int32_t> src(buffer.data(), buffer.size());
+        IntReader reader(src);
+        AutoWisard w2(reader);
+
+        // 12 bits RAMs are small enough to be direct addressed
+        TS_ASSERT(w2.ramAt(0).isDense());
+
+        train(w1);
+        train(w2);
+
+        TS_ASSERT_EQUALS(w1.numPositions(), w2.numPositions());
+        assertSamePredictions(w1, w2);
+
+        // Wide addresses fall back to the hash table
+        AutoWisard w3(numInputs, 32, numClasses);
+        TS_ASSERT(!w3.ramAt(0).isDense());
+    }
+
+    void test_bleaching_matches_thresholds()
+    {
+        Wisard w(numInputs, 8, numClasses);
+
+        // Repeats the samples to get large counters
+        for (int k=0;k!=20;++k)
+            train(w);
+
+        const int maxThreshold = 20 * numSamples;
+        const float minConfidences[] = {0.0f, 0.1f, 0.5f};
+
+        for (int step=1;step<=7;step+=3)
+        {
+            for (const float minConfidence : minConfidences)
+            {
+                for (int i=0;i<numSamples;i+=7)
+                {
+                    const int expected = bleachingByThresholds(w, patterns[i],
+                            step, minConfidence, maxThreshold);
+                    const float confidence = w.getConfidence();
+
+                    TS_ASSERT_EQUALS(w.readBleaching(patterns[i], step, minConfidence), expected);
+                    TS_ASSERT_EQUALS(w.getConfidence(), confidence);
+                }
+            }
+        }
+    }
+
+    void test_concurrent_contexts()
+    {
+        Wisard w(numInputs, 16, numClasses);
+        train(w);
+
+        vector<int> expected(numSamples);
+        vector<float> confidences(numSamples);
+
+        for (int i=0;i!=numSamples;++i)
+        {
+            expected[i] = w.readBleaching(patterns[i]);
+            confidences[i] = w.getConfidence();
+        }
+
+        // Each thread reads the shared model with its own context
+        const Wisard & model = w;
+        const int numThreads = 4;
+        vector<Wisard::InferenceContext> contexts(numThreads);
+        vector<int> predicted(numSamples);
+        vector<float> predictedConfidences(numSamples);
+
+        parallel(numThreads, numSamples, [&](const int tid, const int i)
+        {
+            predicted[i] = model.readBleaching(patterns[i], contexts[tid]);
+            predictedConfidences[i] = contexts[tid].getConfidence();
+        });
+
+        TS_ASSERT(predicted == expected);
+        TS_ASSERT(predictedConfidences == confidences);
+    }
+
+    void test_decoder_follows_reads()
+    {
+        Wisard w(numInputs, 16, numClasses);
+        train(w);
+
+        Wisard::InferenceContext ctx;
+        w.readBinary(patterns[0]);
+        w.readBinary(patterns[1], ctx);
+
+        for (int r=0;r!=numInputs/16;++r)
+        {
+            BinaryDecoder d0 = w.decoderAt(r);
+            BinaryDecoder d1 = w.decoderAt(ctx, r);
+            d1.read(patterns[0]);
+            d0.read(patterns[1]);
+
+            TS_ASSERT_EQUALS(w.decoderAt(r).key(), d1.key());
+            TS_ASSERT_EQUALS(w.decoderAt(ctx, r).key(), d0.key());
+        }
+    }
+
+    void test_batch_matches_single()
+    {
+        Wisard w(numInputs, 16, numClasses);
+        train(w);
+        train(w);
+
+        Bundle<int> bundle(numSamples, numInputs);
+        for (int i=0;i!=numSamples;++i)
+            for (int j=0;j!=numInputs;++j)
+                bundle(i, j) = patterns[i][j];
+
+        const vector<int> labels = w.targets();
+        vector<int> predictions(numSamples);
+        vector<float> confidences(numSamples);
+        vector<int> activations(numSamples * w.numDiscriminators());
+
+        w.readBatch(bundle.data(), numSamples, numInputs, predictions.data(),
+                confidences.data(), activations.data(), 1, 3);
+
+        for (int i=0;i!=numSamples;++i)
+        {
+            TS_ASSERT_EQUALS(predictions[i], w.readBinary(patterns[i]));
+            TS_ASSERT_EQUALS(confidences[i], w.getConfidence());
+
+            for (int j=0;j!=w.numDiscriminators();++j)
+                TS_ASSERT_EQUALS(activations[i * w.numDiscriminators() + j],
+                        w.getExcitation(labels[j]));
+        }
+
+        w.readBleachingBatch(bundle, predictions.data(), confidences.data(),
+                activations.data(), 1, 0.1, 0);
+
+        for (int i=0;i!=numSamples;++i)
+        {
+            TS_ASSERT_EQUALS(predictions[i], w.readBleaching(patterns[i], 1, 0.1));
+            TS_ASSERT_EQUALS(confidences[i], w.getConfidence());
+
+            for (int j=0;j!=w.numDiscriminators();++j)
+                TS_ASSERT_EQUALS(activations[i * w.numDiscriminators() + j],
+                        w.getExcitation(labels[j]));
+        }
+    }
+
+    void test_learnbatch_matches_learn()
+    {
+        Wisard w1(numInputs, 16, numClasses);
+        vector<int32_t> buffer = exportToBuffer(w1);
+        MemSource<int32_t> src(buffer.data(), buffer.size());
+        IntReader reader(src);
+        Wisard w2(reader);
+
+        vector<int> flat;
+        for (auto & p : patterns)
+            flat.insert(flat.end(), p.begin(), p.end());
+
+        train(w1);
+        train(w1);
+        w2.learnBatch(flat.data(), numSamples, numInputs, targets.data(), 4);
+        w2.learnBatch(flat.data(), numSamples, numInputs, targets.data(), 4);
+
+        TS_ASSERT_EQUALS(w1.numPositions(), w2.numPositions());
+        TS_ASSERT(w1 == w2);
+        assertSamePredictions(w1, w2);
+    }
+
+    void test_worker_errors_reach_caller()
+    {
+        typedef BaseWisard<BinaryDecoder, false, FailingRam> W;
+
+        vector<int> flat;
+        for (auto & p : patterns)
+            flat.insert(flat.end(), p.begin(), p.end());
+
+        for (const uint threads : {1u, 4u})
+        {
+            W w1(numInputs, 16, numClasses);
+            vector<int32_t> buffer = exportToBuffer(w1);
+            MemSource<int32_t> src(buffer.data(), buffer.size());
+            IntReader reader(src);
+            W w2(reader);
+
+            TS_ASSERT_THROWS(w1.learnBatch(flat.data(), numSamples, numInputs,
+                    targets.data(), threads), WUPException);
+
+            // Only the samples before the first of FailTarget
+            w2.learnBatch(flat.data(), FailingRam::FailTarget, numInputs,
+                    targets.data(), threads);
+            TS_ASSERT_LESS_THAN(0, w2.numPositions());
+
+            TS_ASSERT_THROWS(w1.merge(w2, threads), WUPException);
+        }
+    }
+
+    void test_bitretina_matches_ints()
+    {
+        Wisard w1(numInputs, 16, numClasses);
+        vector<int32_t> buffer = exportToBuffer(w1);
+        MemSource<int32_t> src(buffer.data(), buffer.size());
+        IntReader reader(src);
+        FlatWisard w2(reader);
+
+        vector<BitRetina> bits;
+        for (auto & p : patterns)
+            bits.push_back(BitRetina(p, numInputs));
+
+        train(w1);
+        for (int i=0;i!=numSamples;++i)
+            w2.learn(bits[i], targets[i]);
+
+        TS_ASSERT_EQUALS(w1.numPositions(), w2.numPositions());
+
+        for (int i=0;i!=numSamples;++i)
+        {
+            TS_ASSERT_EQUALS(w1.readCounts(patterns[i]), w1.readCounts(bits[i]));
+            TS_ASSERT_EQUALS(w1.readBleaching(patterns[i]), w2.readBleaching(bits[i]));
+            TS_ASSERT_EQUALS(w1.getConfidence(), w2.getConfidence());
+        }
+
+        // Indexes out of order and spread over several words
+        vector<uint> indexes = {130, 3, 64, 65, 2, 200, 7, 255, 128};
+        BinaryDecoder d1(indexes.data(), indexes.size());
+        BinaryDecoder d2(indexes.data(), indexes.size());
+
+        for (int i=0;i!=numSamples;++i)
+        {
+            d1.read(patterns[i]);
+            d2.read(bits[i]);
+
+            TS_ASSERT(d1 == d2);
+            TS_ASSERT_EQUALS(d1.key(), d2.key());
+            TS_ASSERT_EQUALS(d1.hash(), d2.hash());
+            TS_ASSERT_EQUALS(d1.isZero(), d2.isZero());
+
+            for (uint j=0;j!=indexes.size();++j)
+                TS_ASSERT_EQUALS(d2.pattern()[j], patterns[i][indexes[j]]);
+        }
+    }
+
+    void test_staticwisard_matches_wisard()
+    {
+        // 256 inputs leave a last RAM of 4 bits
+        Wisard w1(numInputs, 12, numClasses);
+        train(w1);
+
+        vector<int32_t> buffer = exportToBuffer(w1);
+        MemSource<int32_t> src(buffer.data(), buffer.size());
+        IntReader reader(src);
+        StaticWisard<12, 8> w2(reader);
+
+        TS_ASSERT_EQUALS(w2.numRams(), w1.numRams());
+        assertSamePredictions(w1, w2);
+
+        Wisard w3(numInputs, 16, numClasses);
+        train(w3);
+
+        StaticWisard<16, 5> w4(w3);
+        assertSamePredictions(w3, w4);
+
+        for (int i=0;i!=numSamples;++i)
+        {
+            TS_ASSERT_EQUALS(w3.readBleaching(patterns[i], 2, 0.2), w4.readBleaching(patterns[i], 2, 0.2));
+            TS_ASSERT_EQUALS(w3.getConfidence(), w4.getConfidence());
+        }
+
+        // The RAM width must match
+        typedef StaticWisard<8, 5> SmallWisard;
+        TS_ASSERT_THROWS(SmallWisard w5(w3), WUPException);
+    }
+
+    void test_mappedwisard_matches_wisard()
+    {
+        const char * const filepath = "/tmp/test_wisard.mapped";
+
+        Wisard w1(numInputs, 12, numClasses);
+        train(w1);
+
+        vector<int32_t> buffer = exportToBuffer(w1);
+        MemSource<int32_t> src(buffer.data(), buffer.size());
+        IntReader reader(src);
+        MappedWisard::convert(reader, filepath);
+
+        MappedWisard w2(filepath);
+
+        TS_ASSERT_EQUALS(w2.numRams(), w1.numRams());
+        TS_ASSERT_EQUALS(w2.numDiscriminators(), w1.numDiscriminators());
+        assertSamePredictions(w1, w2);
+
+        for (int i=0;i!=numSamples;++i)
+        {
+            TS_ASSERT_EQUALS(w1.readBleaching(patterns[i], 3, 0.1), w2.readBleaching(patterns[i], 3, 0.1));
+            TS_ASSERT_EQUALS(w1.getExcitation(targets[i]), w2.getExcitation(targets[i]));
+        }
+
+        remove(filepath);
+    }
+
+    void test_mappedwisard_rejects_corrupted_files()
+    {
+        const char * const filepath = "/tmp/test_wisard_corrupted.mapped";
+        typedef MappedWisard::Header Header;
+        typedef MappedWisard::RamEntry RamEntry;
+
+        Wisard w1(numInputs, 12, numClasses);
+        train(w1);
+
+        vector<int32_t> buffer = exportToBuffer(w1);
+        MemSource<int32_t> src(buffer.data(), buffer.size());
+        IntReader reader(src);
+        MappedWisard::convert(reader, filepath);
+
+        vector<char> original;
+        {
+            ifstream fin(filepath, ios::binary);
+            original.assign(istreambuf_iterator<char>(fin), istreambuf_iterator<char>());
+        }
+
+        const Header header = *(const Header *) original.data();
+        const RamEntry * const rams = (const RamEntry *) &original[header.ramsOffset];
+
+        // Each change breaks one field, opening must fail
+        vector<function<void(vector<char> &)> > corruptions = {
+            [](vector<char> & f) { ((Header *) f.data())->numRamBits = 0; },
+            [](vector<char> & f) { ((Header *) f.data())->numRamBits = 64; },
+            [](vector<char> & f) { ((Header *) f.data())->numRams += 1; },
+            [](vector<char> & f) { ((Header *) f.data())->numInputBits += 1000; },
+            [](vector<char> & f) { ((Header *) f.data())->numClasses = -1; },
+            [](vector<char> & f) { ((Header *) f.data())->slotSize = 4; },
+            [](vector<char> & f) { ((Header *) f.data())->shufflingOffset = f.size() - 4; },
+            [](vector<char> & f) { ((Header *) f.data())->labelsOffset = ~uint64_t(0) - 3; },
+            [](vector<char> & f) { ((Header *) f.data())->ramsOffset = ~uint64_t(0) - 7; },
+            [&](vector<char> & f) { ((uint32_t *) &f[header.shufflingOffset])[3] = numInputs; },
+            [&](vector<char> & f) { ((RamEntry *) &f[header.ramsOffset])[0].capacity = 0; },
+            [&](vector<char> & f) { ((RamEntry *) &f[header.ramsOffset])[1].capacity = 1; },
+            [&](vector<char> & f) { ((RamEntry *) &f[header.ramsOffset])[0].capacity = uint64_t(1) << 62; },
+            [&](vector<char> & f) { ((RamEntry *) &f[header.ramsOffset])[0].offset = ~uint64_t(0) - 7; },
+        };
+
+        for (auto & corrupt : corruptions)
+        {
+            vector<char> file(original);
+            corrupt(file);
+            writeFile(filepath, file);
+
+            TS_ASSERT_THROWS(MappedWisard w2(filepath), WUPException);
+        }
+
+        // A table without empty slots is valid, reads must still end
+        vector<char> full(original);
+        for (uint64_t s=0;s!=rams[0].capacity;++s)
+            *(uint64_t *) &full[rams[0].offset + s * header.slotSize] = uint64_t(1) << 63 | s;
+
+        writeFile(filepath, full);
+        MappedWisard w3(filepath);
+
+        for (int i=0;i!=numSamples;++i)
+            w3.readBleaching(patterns[i]);
+
+        remove(filepath);
+    }
+
+    void test_compact_export()
+    {
+        Wisard w1(numInputs, 12, numClasses);
+        GrayWisard w2(numInputs, 12, numClasses);
+        FlatWisard w3(numInputs, 40, numClasses);
+        Wisard w4(numInputs, 96, numClasses);
+
+        for (int k=0;k!=3;++k)
+        {
+            train(w1);
+            train(w2);
+            train(w3);
+            train(w4);
+        }
+
+        assertCompactRoundTrip(w1);
+        assertCompactRoundTrip(w2);
+        assertCompactRoundTrip(w3);
+        assertCompactRoundTrip(w4);
+    }
+
+    void test_merge_matches_learn()
+    {
+        assertMergeMatchesLearn<Wisard>();
+        assertMergeMatchesLearn<FlatWisard>();
+        assertMergeMatchesLearn<AutoWisard>();
+    }
+
+    void test_narrow_counters()
+    {
+        Wisard w1(numInputs, 12, numClasses);
+        vector<int32_t> buffer = exportToBuffer(w1);
+        MemSource<int32_t> src(buffer.data(), buffer.size());
+        IntReader reader(src);
+        FlatWisard8 w2(reader);
+
+        train(w1);
+        train(w2);
+
+        TS_ASSERT_EQUALS(w1.numPositions(), w2.numPositions());
+        assertSamePredictions(w1, w2);
+
+        // Counters stop at 255, files keep the saturated values
+        FlatWisard8 w3(numInputs, 12, numClasses);
+        FlatWisard16 w4(numInputs, 12, numClasses);
+
+        for (int k=0;k!=300;++k)
+        {
+            w1.learn(patterns[0], targets[0]);
+            w3.learn(patterns[0], targets[0]);
+            w4.learn(patterns[0], targets[0]);
+        }
+
+        const int numRams = w3.numRams();
+
+        w3.readCounts(patterns[0]);
+        TS_ASSERT_EQUALS(w3.getExcitation(targets[0]), numRams * 255);
+
+        w4.readCounts(patterns[0]);
+        TS_ASSERT_EQUALS(w4.getExcitation(targets[0]), numRams * 300);
+
+        vector<int32_t> saturated = exportToBuffer(w3);
+        MemSource<int32_t> src2(saturated.data(), saturated.size());
+        IntReader reader2(src2);
+        Wisard w5(reader2);
+
+        w5.readCounts(patterns[0]);
+        TS_ASSERT_EQUALS(w5.getExcitation(targets[0]), numRams * 255);
+
+        // Wider counters are clamped when loaded
+        vector<int32_t> wide = exportToBuffer(w1);
+        MemSource<int32_t> src3(wide.data(), wide.size());
+        IntReader reader3(src3);
+        FlatWisard8 w6(reader3);
+
+        w6.readCounts(patterns[0]);
+        TS_ASSERT_EQUALS(w6.getExcitation(targets[0]), numRams * 255);
+        TS_ASSERT_EQUALS(w6.readBleaching(patterns[0]), targets[0]);
+    }
+
+    void test_prune()
+    {
+        Wisard w1(numInputs, 12, numClasses);
+        vector<int32_t> buffer = exportToBuffer(w1);
+        MemSource<int32_t> src1(buffer.data(), buffer.size());
+        MemSource<int32_t> src2(buffer.data(), buffer.size());
+        IntReader reader1(src1), reader2(src2);
+        FlatWisard w2(reader1);
+        AutoWisard w3(reader2);
+
+        // Forgetting unknown addresses must not create them
+        w1.forgetSample(patterns[0], targets[0]);
+        TS_ASSERT_EQUALS(w1.numPositions(), 0);
+
+        train(w1);
+        train(w2);
+        train(w3);
+
+        const long positions = w1.numPositions();
+        const size_t before = w1.numBytes();
+        const size_t reclaimed = w1.prune(2);
+
+        TS_ASSERT_LESS_THAN(w1.numPositions(), positions);
+        TS_ASSERT_LESS_THAN(0u, reclaimed);
+        TS_ASSERT_EQUALS(before - reclaimed, w1.numBytes());
+
+        const size_t flatBefore = w2.numBytes();
+        TS_ASSERT_EQUALS(flatBefore - w2.prune(2), w2.numBytes());
+        w3.prune(2);
+
+        TS_ASSERT_EQUALS(w1.numPositions(), w2.numPositions());
+        TS_ASSERT_EQUALS(w1.numPositions(), w3.numPositions());
+        assertSamePredictions(w1, w2);
+        assertSamePredictions(w1, w3);
+
+        const size_t budget = w2.numBytes() / 3;
+        w2.compactToBudget(budget);
+        TS_ASSERT_LESS_THAN_EQUALS(w2.numBytes(), budget);
+        TS_ASSERT_LESS_THAN(0, w2.numPositions());
+    }
+
+    void test_compact_keeps_frequent()
+    {
+        const int numRams = numInputs / 8;
+
+        // Every RAM starts dense, the first sample is seen many more times
+        AutoWisard w1(numInputs, 8, numClasses);
+        train(w1);
+
+        for (int i=0;i!=20;++i)
+            w1.learn(patterns[0], targets[0]);
+
+        TS_ASSERT(w1.ramAt(0).isDense());
+
+        const size_t budget = w1.numBytes() / 4;
+        w1.compactToBudget(budget);
+
+        TS_ASSERT_LESS_THAN_EQUALS(w1.numBytes(), budget);
+        TS_ASSERT(!w1.ramAt(0).isDense());
+        TS_ASSERT_EQUALS(w1.readBinary(patterns[0]), targets[0]);
+        TS_ASSERT_EQUALS(w1.getExcitation(targets[0]), numRams);
+
+        // Dense arrays only go away once empty
+        BaseWisard<BinaryDecoder, false, DenseRam<BinaryDecoder> > w2(numInputs, 8, numClasses);
+        train(w2);
+
+        const long positions = w2.numPositions();
+        TS_ASSERT_THROWS(w2.compactToBudget(w2.numBytes() / 4), WUPException);
+        TS_ASSERT_EQUALS(w2.numPositions(), positions);
+
+        w2.compactToBudget(w2.numBytes());
+        TS_ASSERT_EQUALS(w2.numPositions(), positions);
+    }
+
+    void test_early_exit()
+    {
+        Wisard w(numInputs, 8, numClasses);
+        train(w);
+
+        Wisard::InferenceContext full;
+        Wisard::InferenceContext early;
+        early.setEarlyExit(true);
+
+        int decided = 0;
+
+        for (int i=0;i!=numSamples;++i)
+        {
+            TS_ASSERT_EQUALS(w.readCounts(patterns[i], full), w.readCounts(patterns[i], early));
+            TS_ASSERT(!full.decidedEarly());
+            decided += early.decidedEarly();
+
+            for (int t=1;t!=3;++t)
+            {
+                TS_ASSERT_EQUALS(w.readBinary(patterns[i], full, t),
+                        w.readBinary(patterns[i], early, t));
+                decided += early.decidedEarly();
+            }
+        }
+
+        TS_ASSERT_LESS_THAN(0, decided);
+
+        // The flag is cleared by reads that do not exit early
+        w.readBleaching(patterns[0], early);
+        TS_ASSERT(!early.decidedEarly());
+    }
+
+    void test_ensemblewisard()
+    {
+        EnsembleWisard<FlatWisard> e1(5, numInputs, 12, numClasses);
+        EnsembleWisard<FlatWisard> e2(5, numInputs, 12, numClasses);
+
+        // Members draw different mappings
+        vector<int32_t> m0 = exportToBuffer(e1.memberAt(0));
+        vector<int32_t> m1 = exportToBuffer(e1.memberAt(1));
+        TS_ASSERT(m0 != m1);
+
+        vector<int> flat;
+        for (auto & p : patterns)
+            flat.insert(flat.end(), p.begin(), p.end());
+
+        // Copies of the members trained one sample at a time, serially
+        vector<vector<int32_t> > blanks;
+        for (int m=0;m!=e1.numMembers();++m)
+            blanks.push_back(exportToBuffer(e1.memberAt(m)));
+
+        for (int i=0;i!=numSamples;++i)
+            e1.learn(patterns[i], targets[i], 3);
+
+        for (int m=0;m!=e1.numMembers();++m)
+        {
+            MemSource<int32_t> src(blanks[m].data(), blanks[m].size());
+            IntReader reader(src);
+            FlatWisard copy(reader);
+            train(copy);
+
+            TS_ASSERT(copy == e1.memberAt(m));
+        }
+
+        e2.learnBatch(flat.data(), numSamples, numInputs, targets.data(), 3);
+
+        vector<int> predictions(numSamples);
+        vector<float> confidences(numSamples);
+        int correct = 0;
+
+        for (auto rule : {EnsembleWisard<FlatWisard>::Vote, EnsembleWisard<FlatWisard>::Sum})
+        {
+            e2.readBatch(flat.data(), numSamples, numInputs, predictions.data(),
+                    confidences.data(), rule, 1, 3);
+
+            for (int i=0;i!=numSamples;++i)
+            {
+                // Sum of the members is the same as reading each one
+                int sum = 0;
+                for (int m=0;m!=e1.numMembers();++m)
+                {
+                    e1.memberAt(m).readBinary(patterns[i]);
+                    sum += e1.memberAt(m).getExcitation(targets[i]);
+                }
+
+                const int predicted = e1.readBinary(patterns[i], 1, rule);
+
+                if (rule == EnsembleWisard<FlatWisard>::Sum)
+                    TS_ASSERT_EQUALS(e1.getExcitation(targets[i]), sum);
+
+                TS_ASSERT_EQUALS(predictions[i], e2.readBinary(patterns[i], 1, rule, 3));
+                TS_ASSERT_EQUALS(confidences[i], e2.getConfidence());
+
+                correct += predicted == targets[i];
+            }
+        }
+
+        TS_ASSERT_LESS_THAN(numSamples * 19 / 10, correct);
+        TS_ASSERT_EQUALS(e1.readCounts(patterns[0]), targets[0]);
+        TS_ASSERT_EQUALS(e1.readBleaching(patterns[0]), targets[0]);
+
+        for (int i=0;i<numSamples;i+=7)
+        {
+            const int expected = e1.readBleaching(patterns[i]);
+            const int excitation = e1.getExcitation(expected);
+
+            TS_ASSERT_EQUALS(e1.readBleaching(patterns[i], EnsembleWisard<FlatWisard>::Sum, 3), expected);
+            TS_ASSERT_EQUALS(e1.getExcitation(expected), excitation);
+        }
+    }
+
+    void test_weighted_learn()
+    {
+        Wisard blank(numInputs, 12, numClasses);
+        const vector<int32_t> buffer = exportToBuffer(blank);
+
+        MemSource<int32_t> src1(buffer.data(), buffer.size());
+        MemSource<int32_t> src2(buffer.data(), buffer.size());
+        MemSource<int32_t> src3(buffer.data(), buffer.size());
+        IntReader reader1(src1), reader2(src2), reader3(src3);
+        Wisard w1(reader1), w2(reader2), w3(reader3);
+
+        // Each sample is repeated (i % 3) + 1 times
+        vector<int> flat;
+        vector<int> labels;
+
+        for (int i=0;i!=numSamples;++i)
+        {
+            w1.learn(patterns[i], targets[i], i % 3 + 1);
+
+            for (int k=0;k<=i%3;++k)
+            {
+                flat.insert(flat.end(), patterns[i].begin(), patterns[i].end());
+                labels.push_back(targets[i]);
+            }
+        }
+
+        w2.learnBatch(flat.data(), labels.size(), numInputs, labels.data());
+        w3.learnDeduplicated(flat.data(), labels.size(), numInputs, labels.data(), 2);
+
+        const vector<int32_t> expected = exportCompactToBuffer(w2);
+        TS_ASSERT(exportCompactToBuffer(w1) == expected);
+        TS_ASSERT(exportCompactToBuffer(w3) == expected);
+
+        TS_ASSERT_THROWS(w1.learn(patterns[0], targets[0], 0), WUPException);
+    }
+
+    void test_graydecoder_key()
+    {
+        vector<int> retina = {5, 3, 9, 3, 1, 7, 7, 2};
+        vector<uint> indexes = {0, 1, 2, 3, 4, 5, 6, 7};
+
+        GrayDecoder d1(indexes.data(), indexes.size());
+        GrayDecoder d2(indexes.data(), indexes.size());
+
+        d1.read(retina);
+        d2.key(d1.key());
+
+        TS_ASSERT(d1 == d2);
+        TS_ASSERT_EQUALS(d1.hash(), d2.hash());
+    }
+
+    void test_graydecoder_ranks()
+    {
+        for (uint size=1;size<=40;++size)
+        {
+            vector<uint> indexes(size);
+            for (uint i=0;i!=size;++i)
+                indexes[i] = size - 1 - i;
+
+            GrayDecoder decoder(indexes.data(), size);
+            vector<int> retina(size);
+
+            for (int k=0;k!=50;++k)
+            {
+                // Few distinct values, so there are many ties
+                for (auto & v : retina)
+                    v = rand() % 8 - 4;
+
+                decoder.read(retina);
+
+                vector<int> expected = grayRanks(retina, indexes);
+                TS_ASSERT(equal(expected.begin(), expected.end(), decoder.pattern()));
+                TS_ASSERT_EQUALS(decoder.hash(), grayHash(expected));
+            }
+        }
+    }
+
+    void test_intwisard_key_widths()
+    {
+        const int ramBits[] = {16, 48, 100};
+        const int widths[] = {32, 64, 128};
+
+        for (int k=0;k!=3;++k)
+        {
+            // Same input mapping as a Wisard, keys of every width
+            Wisard w1(numInputs, ramBits[k], numClasses);
+            vector<int32_t> buffer = exportToBuffer(w1);
+            MemSource<int32_t> src(buffer.data(), buffer.size());
+            IntReader reader(src);
+            IntWisard w2(reader);
+
+            TS_ASSERT_EQUALS(w2.ramAt(0).keyWidth(), widths[k]);
+
+            train(w1);
+            train(w2);
+
+            TS_ASSERT_EQUALS(w1.numPositions(), w2.numPositions());
+            assertSamePredictions(w1, w2);
+            assertCompactRoundTrip(w2);
+        }
+
+        assertMergeMatchesLearn<IntWisard>();
+
+        TS_ASSERT_THROWS(IntWisard(numInputs, 129, numClasses), WUPException);
+    }
+
+    void test_indexed_forget_class()
+    {
+        assertIndexedMatchesPlain<IndexedWisard, Wisard>();
+        assertIndexedMatchesPlain<IndexedFlatWisard, FlatWisard>();
+        assertIndexedMatchesPlain<IndexedIntWisard, IntWisard>();
+        assertMergeMatchesLearn<IndexedWisard>();
+    }
+
+private:
+
+    void
+    writeFile(const char * const filepath, const vector<char> & data)
+    {
+        ofstream fout(filepath, ios::binary);
+        fout.write(data.data(), data.size());
+    }
+
+    // Reference ranks, one comparison with every other pixel
+    vector<int>
+    grayRanks(const vector<int> & retina, const vector<uint> & indexes)
+    {
+        vector<int> ranks(indexes.size());
+
+        for (size_t i=0;i!=indexes.size();++i)
+        {
+            const int current = retina[indexes[i]];
+
+            for (size_t j=0;j!=indexes.size();++j)
+            {
+                const int visiting = retina[indexes[j]];
+
+                if (current < visiting || (current == visiting && i < j))
+                    ++ranks[i];
+            }
+        }
+
+        return ranks;
+    }
+
+    // Reference permutation index, relabeling the remaining ranks
+    size_t
+    grayHash(vector<int> ranks)
+    {
+        vector<size_t> factorials(ranks.size(), 1);
+        for (size_t i=1;i<ranks.size();++i)
+            factorials[i] = i * factorials[i-1];
+
+        size_t h = 0;
+
+        for (size_t n=ranks.size()-1;n!=0;--n)
+        {
+            h += ranks[n] * factorials[n];
+
+            for (size_t j=0;j!=n;++j)
+                if (ranks[j] > ranks[n])
+                    --ranks[j];
+        }
+
+        return h;
+    }
+
+    // Classes are forgotten, partially forgotten and registered again in
+    // both models, the index must give the same answers as a full scan
+    template <typename Indexed, typename Plain>
+    void
+    assertIndexedMatchesPlain()
+    {
+        Plain w1(numInputs, 16, numClasses);
+        vector<int32_t> buffer = exportToBuffer(w1);
+        MemSource<int32_t> src(buffer.data(), buffer.size());
+        IntReader reader(src);
+        Indexed w2(reader);
+
+        train(w1);
+        train(w2);
+
+        for (int i=0;i<numSamples;i+=3)
+        {
+            w1.forgetSample(patterns[i], targets[i]);
+            w2.forgetSample(patterns[i], targets[i]);
+        }
+
+        assertClassPositions(w2);
+
+        w1.forgetClass(targets[1]);
+        w2.forgetClass(targets[1]);
+
+        TS_ASSERT_EQUALS(w2.numPositions(targets[1]), 0);
+        TS_ASSERT_EQUALS(w1.numPositions(), w2.numPositions());
+        assertSamePredictions(w1, w2);
+        assertClassPositions(w2);
+
+        // The class comes back with other samples
+        for (int i=0;i!=numSamples;++i)
+        {
+            if (targets[i] == targets[2])
+            {
+                w1.learn(patterns[i], targets[1]);
+                w2.learn(patterns[i], targets[1]);
+            }
+        }
+
+        w1.prune(2);
+        w2.prune(2);
+
+        TS_ASSERT_EQUALS(w1.numPositions(), w2.numPositions());
+        assertSamePredictions(w1, w2);
+        assertClassPositions(w2);
+
+        // The index survives export and import
+        vector<int32_t> trained = exportToBuffer(w2);
+        MemSource<int32_t> src2(trained.data(), trained.size());
+        IntReader reader2(src2);
+        Indexed w3(reader2);
+
+        w1.forgetClass(targets[3]);
+        w3.forgetClass(targets[3]);
+
+        TS_ASSERT_EQUALS(w1.numPositions(), w3.numPositions());
+        assertSamePredictions(w1, w3);
+        assertClassPositions(w3);
+    }
+
+    template <typename W>
+    void
+    assertClassPositions(W & w)
+    {
+        long sum = 0;
+
+        for (int t=0;t!=numClasses;++t)
+            sum += w.numPositions(t * 10 + 1);
+
+        TS_ASSERT_EQUALS(sum, w.numPositions());
+    }
+
+    template <typename W>
+    void
+    train(W & w)
+    {
+        for (int i=0;i!=numSamples;++i)
+            w.learn(patterns[i], targets[i]);
+    }
+
+    template <typename W>
+    vector<int32_t>
+    exportToBuffer(W & w)
+    {
+        vector<int32_t> buffer;
+        VectorSink<int32_t> snk(buffer);
+        IntWriter writer(snk);
+        w.exportTo(writer);
+        return buffer;
+    }
+
+    template <typename W>
+    void
+    assertCompactRoundTrip(W & w1)
+    {
+        const vector<int32_t> original = exportToBuffer(w1);
+
+        for (int compress=0;compress!=2;++compress)
+        {
+            vector<int32_t> buffer;
+            VectorSink<int32_t> snk(buffer);
+            IntWriter writer(snk);
+            w1.exportCompactTo(writer, compress != 0);
+
+            TS_ASSERT_LESS_THAN(buffer.size() * 4, original.size());
+
+            MemSource<int32_t> src(buffer.data(), buffer.size());
+            IntReader reader(src);
+            W w2(reader);
+
+            TS_ASSERT_EQUALS(w1.numPositions(), w2.numPositions());
+            assertSamePredictions(w1, w2);
+        }
+    }
+
+    // Trains one model with all samples and three shards of a copy of it,
+    // merged pairwise and all at once
+    template <typename W>
+    void
+    assertMergeMatchesLearn()
+    {
+        W blank(numInputs, 12, numClasses);
+        const vector<int32_t> buffer = exportToBuffer(blank);
+
+        MemSource<int32_t> src0(buffer.data(), buffer.size());
+        MemSource<int32_t> src1(buffer.data(), buffer.size());
+        MemSource<int32_t> src2(buffer.data(), buffer.size());
+        MemSource<int32_t> src3(buffer.data(), buffer.size());
+        IntReader reader0(src0), reader1(src1), reader2(src2), reader3(src3);
+
+        W all(reader0), shard1(reader1), shard2(reader2), shard3(reader3);
+
+        for (int i=0;i!=numSamples;++i)
+        {
+            all.learn(patterns[i], targets[i]);
+
+            if (i < numSamples / 3)
+                shard1.learn(patterns[i], targets[i]);
+            else if (i < 2 * numSamples / 3)
+                shard2.learn(patterns[i], targets[i]);
+            else
+                shard3.learn(patterns[i], targets[i]);
+        }
+
+        const vector<int32_t> expected = exportCompactToBuffer(all);
+
+        MemSource<int32_t> src4(buffer.data(), buffer.size());
+        IntReader reader4(src4);
+        W reduced(reader4);
+        reduced.merge(vector<const W*>{&shard1, &shard2, &shard3}, 2);
+
+        TS_ASSERT(exportCompactToBuffer(reduced) == expected);
+
+        TS_ASSERT_THROWS(shard1.merge(shard1), WUPException);
+
+        shard2.merge(shard3);
+        shard1.merge(shard2);
+
+        TS_ASSERT(exportCompactToBuffer(shard1) == expected);
+        assertSamePredictions(all, shard1);
+    }
+
+    template <typename W>
+    vector<int32_t>
+    exportCompactToBuffer(W & w)
+    {
+        vector<int32_t> buffer;
+        VectorSink<int32_t> snk(buffer);
+        IntWriter writer(snk);
+        w.exportCompactTo(writer, false);
+        return buffer;
+    }
+
+    // Reference bleaching, reads the model once per threshold
+    template <typename W>
+    int
+    bleachingByThresholds(W & w, const vector<int> & pattern, const int step,
+            const float minConfidence, const int maxThreshold)
+    {
+        int bestBleach = 1;
+        float bestConfidence = 0;
+
+        for (int t=1;t<=maxThreshold;t+=step)
+        {
+            const int predicted = w.readBinary(pattern, t);
+
+            if (w.getConfidence() > minConfidence)
+                return predicted;
+
+            if (w.getConfidence() > bestConfidence)
+            {
+                bestConfidence = w.getConfidence();
+                bestBleach = t;
+            }
+        }
+
+        return w.readBinary(pattern, bestBleach);
+    }
+
+    template <typename W1, typename W2>
+    void
+    assertSamePredictions(W1 & w1, W2 & w2)
+    {
+        for (int i=0;i!=numSamples;++i)
+        {
+            TS_ASSERT_EQUALS(w1.readCounts(patterns[i]), w2.readCounts(patterns[i]));
+            TS_ASSERT_EQUALS(w1.readBinary(patterns[i]), w2.readBinary(patterns[i]));
+            TS_ASSERT_EQUALS(w1.readBleaching(patterns[i]), w2.readBleaching(patterns[i]));
+
+            // Patterns of forgotten classes excite nobody and both sides
+            // report a NaN confidence
+            if (!std::isnan(w1.getConfidence()) || !std::isnan(w2.getConfidence()))
+                TS_ASSERT_EQUALS(w1.getConfidence(), w2.getConfidence());
+        }
+    }
+
+};
+
+#endif // TEST_WISARD_HPP